@@ -38,6 +38,7 @@
 #define ERROR_PRIVISION_DEVICE               -6
 #define ERROR_CREATE_WATCHDOG_THREAD         -7
 #define ERROR_CREATE_COMMAND                 -8
+#define ERROR_TRANSPORT_BUSY                 -9
 
 // Forward declaration of callback function that receives Command 
 // Packets from the desktop via CommandTransport.ProcessCommand
@@ -46,7 +47,18 @@ HRESULT STDAPICALLTYPE CommandCallback( DWORD dwCmd, const CCommandPacket* pCmdD
 
 // This object is contained in the Remote Tool SDK library
 CDeviceRemoteTool g_DeviceRemoteTool;
-CCommandPacket* g_pCmd = NULL;
+
+// outgoing commands. the commands are created once, creating them per call causes PushCommand
+// 0x8007000d error after 113 cycles. the semaphore counts the free commands, a free one is
+// taken with an interlocked flag, so the callback and the working threads push concurrently.
+#define COMMAND_POOL_SIZE              4
+#define COMMAND_ACQUIRE_TIMEOUT        5000
+CCommandPacket* g_cmdPool[COMMAND_POOL_SIZE];
+volatile LONG g_cmdBusy[COMMAND_POOL_SIZE];
+HANDLE g_hCmdSemaphore = NULL;
+int AcquireCommand( DWORD dwTimeout = COMMAND_ACQUIRE_TIMEOUT );
+void ReleaseCommand( int index );
+BOOL PushCommand( DWORD dwCmd, CCommandPacket* pCmd );
 
 void ReadDesktopWriteDevicePacket( DWORD dwCmd, const CCommandPacket* pCmdDataIn );
 void ReadDeviceWriteDesktop();
@@ -57,12 +69,40 @@ BOOL DeactivateDriver();
 BOOL ProvisionDeviceWithRgs( LPCWSTR szwFileName );
 BOOL ProvisionDevice();
 BOOL SendCommand( DWORD dwCmd, DWORD dwMsgId );
-BOOL SendCommand( DWORD dwCmd, BYTE* pData, DWORD cbData );
-BOOL Initialize();
+BOOL SendCommand( DWORD dwCmd, DWORD dwMsgId, DWORD dwParam );
+BOOL SendFrames( CCommandPacket* pCmd, DWORD dwFrames );
+BOOL WriteFrameResult( DWORD dwLastError, DWORD dwSeq );
+void AddFrame( CCommandPacket* pCmd, const BYTE* pData, DWORD cbData, DWORD dwSeq, DWORD& dwFrames, DWORD& dwBytes );
+BOOL Initialize( DWORD dwControllerMtu );
 BOOL Uninitialize();
+BOOL OpenHandshakeEvents( DWORD dwInstance );
+void CloseHandshakeEvents();
 
 #define WORKING_THREAD_SLEEP_TIMEOUT   100
 DWORD WINAPI WorkingThread( LPVOID lpParam );
+void StopWorkingThread();
+// the working thread drains the device lanes on each wake and sends all the frames in one
+// command. the number of messages read at once is bounded, so the quit event isn't delayed.
+// the command is bounded by the bytes of its frames too, it's sent when the next frame would
+// take it over DRAIN_MAX_BYTES and the rest of the frames go in the next one.
+#define DRAIN_MAX_MESSAGES             MSG_QUEUE_MAX_DEPTH
+#define DRAIN_MAX_BYTES                ( 4 * MSG_BUFFER_SIZE )
+
+// HCI frames from the desktop are batched per lane while the device side is busy. a pending
+// batch is flushed as soon as its lane has room, the working thread retries every
+// BATCH_FLUSH_TIMEOUT ms.
+#define BATCH_FLUSH_TIMEOUT            10
+// a full batch is waited for at most BATCH_FULL_TIMEOUT ms, the desktop callback holds the
+// batch lock meanwhile. the frame is dropped if the device hasn't taken the batch by then.
+#define BATCH_FULL_TIMEOUT             1000
+unsigned char g_batchBuffers[MSG_LANE_COUNT][MSG_BUFFER_SIZE];
+HciBatchWriter g_batches[MSG_LANE_COUNT];
+CRITICAL_SECTION g_batchSection;
+HANDLE g_hBatchEvent = NULL;
+BOOL AppendToBatch( const BYTE* pData, DWORD cbData );
+BOOL ReadToBatch( const CCommandPacket* pCmdDataIn, DWORD cbData );
+BOOL FlushBatch( int lane, DWORD dwTimeout );
+BOOL WriteToDevice( const BYTE* pData, DWORD cbData );
 
 #define WATCHDOG_SLEEP_TIMEOUT         5000
 #define WATCHDOG_MAX_COUNTER           (60000/WATCHDOG_SLEEP_TIMEOUT)
@@ -70,12 +110,53 @@ LONG g_lWatchDogCounter = WATCHDOG_MAX_COUNTER;
 DWORD WINAPI WatchDogThread( LPVOID lpParam );
 
 HANDLE g_hQuitEvent = NULL;
+HANDLE g_hReadyEvent = NULL;     // set while the driver and the channels are up.
+HANDLE g_hClosedEvent = NULL;    // set while the transport has no connection open. kept after Uninitialize, so the next Initialize waits for it.
 HANDLE g_hDevice = NULL;
+DWORD g_dwInstance = 0;    // index of the activated BTE device, the channels are named after it.
+MSG_CHANNELS g_channels;
 HANDLE g_hWorkingThread = NULL;
+HANDLE g_hStopEvent = NULL;      // stops the working thread before the channels are closed.
 
 LONG g_lIncomeMsgCounter = 0;
 LONG g_lOutcomeMsgCounter = 0;
-CRITICAL_SECTION g_criticalSection;
+
+// HCI frame statistics per direction. frames are counted per H4 packet type:
+// 0 - unknown, 1 - command, 2 - ACL data, 3 - SCO data, 4 - event.
+#define FRAME_STATS_TYPES              5
+struct FRAME_STATS {
+   LONG lFrames[FRAME_STATS_TYPES];
+   LONG lBytes;
+};
+FRAME_STATS g_toDeviceStats;
+FRAME_STATS g_toDesktopStats;
+
+// desktop to device message queue credit statistics.
+struct CREDIT_STATS {
+   LONG lWrites;        // messages written.
+   LONG lStalls;        // flushes postponed because there were no credits.
+   LONG lMinCredits;    // the lowest number of credits seen before a write.
+};
+CREDIT_STATS g_creditStats = { 0, 0, MSG_QUEUE_MAX_DEPTH };
+LONG g_lSendFramesFailures = 0;  // commands with HCI frames that failed to be pushed to the desktop.
+LONG g_lDroppedFrames = 0;       // HCI frames lost with them.
+LONG g_lDroppedBatchFrames = 0;  // HCI frames from the desktop dropped because the batch of their lane stayed full.
+DWORD g_dwStartTime = 0;
+DWORD g_dwQueueDepth = MSG_QUEUE_DEFAULT_DEPTH;
+DWORD g_dwAclMtu = 0;   // ACL MTU negotiated with the desktop, 0 if the controller's one is unknown.
+// the numbers the driver has given the HCI frames pushed to the desktop. the desktop returns the
+// results in the order of the frames, each result takes the number of the oldest frame.
+#define RESULT_SEQ_QUEUE_SIZE          4096
+DWORD g_resultSeqs[RESULT_SEQ_QUEUE_SIZE];
+DWORD g_dwResultSeqHead = 0;     // where the next number goes.
+DWORD g_dwResultSeqCount = 0;
+CRITICAL_SECTION g_resultSection;
+void ResetResultSeqs();
+BOOL QueueResultSeq( DWORD dwSeq );
+BOOL TakeResultSeq( DWORD& dwSeq );
+BOOL TakeBackResultSeq( DWORD& dwSeq );
+void UpdateFrameStats( FRAME_STATS& stats, const BYTE* pData, DWORD cbData );
+void DumpFrameStats();
 
 /**
 @func int | WinMain | This function is called by the system as the initial entry point for Windows CE-based applications.
@@ -91,15 +172,28 @@ int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLi
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+WinMain\n" ) );
 
    int nRet = 0;
+   g_dwStartTime = GetTickCount();
    
-   // initialize critical section used to synchronize access to SendCommand functions.
-   InitializeCriticalSection( &g_criticalSection );
+   // initialize critical section used to synchronize access to the batches.
+   InitializeCriticalSection( &g_batchSection );
+   InitializeCriticalSection( &g_resultSection );
+   for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+      g_batches[lane].attach( g_batchBuffers[lane], sizeof( g_batchBuffers[lane] ) );
+   }
    
    // create quit event.
    g_hQuitEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
    ASSERT( g_hQuitEvent );
 
-   if ( !g_hQuitEvent ) {
+   // create batch event, used to wake up the working thread when a batch is pending.
+   g_hBatchEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+   ASSERT( g_hBatchEvent );
+
+   // create stop event, the working thread of the session exits on it.
+   g_hStopEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+   ASSERT( g_hStopEvent );
+
+   if ( !g_hQuitEvent || !g_hBatchEvent || !g_hStopEvent ) {
       nRet = ERROR_CREATE_EVENT;
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-WinMain ret: %d GetLastError: 0x%08x\n", nRet, GetLastError() ) );
       return nRet;
@@ -115,15 +209,32 @@ int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLi
       return nRet;
    }
 
-   // create command globally. using local command creating causes PushCommand 0x8007000d error after 113 cycles.
-   HRESULT hr = g_DeviceRemoteTool.CreateCommand( &g_pCmd );
-   ASSERT( SUCCEEDED( hr ) );
+   // create the command pool. using local command creating causes PushCommand 0x8007000d error after 113 cycles.
+   HRESULT hr = S_OK;
+   for ( int index = 0; index < COMMAND_POOL_SIZE; ++index ) {
+      g_cmdBusy[index] = 0;
+      hr = g_DeviceRemoteTool.CreateCommand( &g_cmdPool[index] );
+      ASSERT( SUCCEEDED( hr ) );
 
-   if ( FAILED( hr ) ) {
-      nRet = ERROR_CREATE_COMMAND;
-      IFDBG( DebugOut( DEBUG_OUTPUT, L"-WinMain ret: %d GetLastError: 0x%08x\n", nRet, hr ) );
-      return nRet;
+      if ( FAILED( hr ) ) {
+         while ( --index >= 0 ) {
+            g_DeviceRemoteTool.FreeCommand( g_cmdPool[index] );
+         }
+
+         nRet = ERROR_CREATE_COMMAND;
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"-WinMain ret: %d GetLastError: 0x%08x\n", nRet, hr ) );
+         return nRet;
+      }
    }   
+
+   g_hCmdSemaphore = CreateSemaphore( NULL, COMMAND_POOL_SIZE, COMMAND_POOL_SIZE, NULL );
+   ASSERT( g_hCmdSemaphore );
+
+   if ( !g_hCmdSemaphore ) {
+      nRet = ERROR_CREATE_EVENT;
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-WinMain ret: %d GetLastError: 0x%08x\n", nRet, GetLastError() ) );
+      return nRet;
+   }
   
    // The lpCmdLine has special information in it.
    // Do not tamper with the values.
@@ -135,18 +246,18 @@ int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLi
    // stop remote agent.
    g_DeviceRemoteTool.StopCommandHandler();
 
-   // delete command.
-   hr = g_DeviceRemoteTool.FreeCommand( g_pCmd );
-   ASSERT( SUCCEEDED( hr ) );
-
-   // uninitialize agent.
+   // uninitialize agent, the working thread is stopped.
    Uninitialize();
 
-   if ( g_hWorkingThread ) {
-      PulseEvent( g_hQuitEvent );
-      WaitForSingleObject( g_hWorkingThread, INFINITE );
-      CloseHandle( g_hWorkingThread );
-      g_hWorkingThread = NULL;
+   // delete the commands. the threads that push them are stopped.
+   for ( int index = 0; index < COMMAND_POOL_SIZE; ++index ) {
+      hr = g_DeviceRemoteTool.FreeCommand( g_cmdPool[index] );
+      ASSERT( SUCCEEDED( hr ) );
+   }
+
+   if ( g_hCmdSemaphore ) {
+      CloseHandle( g_hCmdSemaphore );
+      g_hCmdSemaphore = NULL;
    }
 
    if ( g_hQuitEvent ) {
@@ -154,10 +265,24 @@ int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLi
       g_hQuitEvent = NULL;
    }
 
-   DeleteCriticalSection( &g_criticalSection );
+   if ( g_hBatchEvent ) {
+      CloseHandle( g_hBatchEvent );
+      g_hBatchEvent = NULL;
+   }
+
+   if ( g_hStopEvent ) {
+      CloseHandle( g_hStopEvent );
+      g_hStopEvent = NULL;
+   }
+
+   CloseHandshakeEvents();
+
+   DeleteCriticalSection( &g_batchSection );
+   DeleteCriticalSection( &g_resultSection );
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"Total income message counter: %d\n", g_lIncomeMsgCounter ) );
    IFDBG( DebugOut( DEBUG_OUTPUT, L"Total outcome message counter: %d\n", g_lOutcomeMsgCounter ) );
+   DumpFrameStats();
    
    if ( nRet ) {
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-WinMain ret: %d GetLastError: 0x%08x\n", nRet, GetLastError() ) );
@@ -178,14 +303,12 @@ void ReadDesktopWriteDevicePacket( DWORD dwCmd, const CCommandPacket* pCmdDataIn
 {
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+ReadDesktopWriteDevicePacket\n" ) );
       
-   ASSERT( g_hWriteQueue );
+   ASSERT( g_channels.pTransports[MSG_CONTROL_LANE] );
    ASSERT( pCmdDataIn );
-   if ( g_hWriteQueue && pCmdDataIn ) {
+   if ( g_channels.pTransports[MSG_CONTROL_LANE] && pCmdDataIn ) {
       CCommandPacket::DATATYPE dataType = CCommandPacket::DATATYPE_END;
       DWORD dwSize = 0; 
       if ( pCmdDataIn->GetNextParameterType( &dataType, &dwSize ) ) {
-         unsigned char buffer[MSG_BUFFER_SIZE] = {0};
-         
          switch( dwCmd ) {
             case MESSAGE_PACKET: {
                if ( dataType != CCommandPacket::DATATYPE_END && dataType == CCommandPacket::DATATYPE_DWORD && dwSize > 0 ) {
@@ -193,25 +316,25 @@ void ReadDesktopWriteDevicePacket( DWORD dwCmd, const CCommandPacket* pCmdDataIn
                   if ( pCmdDataIn->GetParameterDWORD( &dwMsgId ) ) {
                      TRACE0( "Readed packet from desktop" );
                      IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from desktop: dwCmd: 0x%08x dwMsgId: 0x%08x\n", dwCmd, dwMsgId ) );
-                     Packet packet;
-                     packet.writeInt( dwCmd );
-                     packet.writeInt( dwMsgId );
-                     dwSize = packet.serialize( buffer, packet.length() );                     
+                     unsigned char buffer[ControlMsg::SIZE];
+                     WriteToDevice( buffer, ControlMsg::encode( buffer, dwMsgId ) );
                   }
                }               
             }
             break;
 
             case HCI_DATA_PACKET: {
-               if ( dataType != CCommandPacket::DATATYPE_END && dataType == CCommandPacket::DATATYPE_BYTES && dwSize > 0 && dwSize < MSG_BUFFER_SIZE ) {
-                  if ( pCmdDataIn->GetParameterBytes( buffer, dwSize ) ) {
-                     TRACE0( "Readed packet from desktop" );
-                     IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from desktop: dwCmd: 0x%08x\n", dwCmd ) );
-                     IFDBG( DumpBuff( DEBUG_OUTPUT, buffer, dwSize ) );
-                     Packet packet;
-                     packet.writeInt( dwCmd );
-                     packet.writeUCharArray( buffer, dwSize );
-                     dwSize = packet.serialize( buffer, packet.length() );                     
+               // the command may carry several frames.
+               while ( dataType == CCommandPacket::DATATYPE_BYTES && dwSize > 0 && dwSize <= (DWORD)HciBatchMsg::MAX_FRAME_SIZE ) {
+                  if ( !ReadToBatch( pCmdDataIn, dwSize ) ) {
+                     break;
+                  }
+
+                  TRACE0( "Readed packet from desktop" );
+                  IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from desktop: dwCmd: 0x%08x size: %d\n", dwCmd, dwSize ) );
+
+                  if ( !pCmdDataIn->GetNextParameterType( &dataType, &dwSize ) ) {
+                     break;
                   }
                }
             }
@@ -221,18 +344,6 @@ void ReadDesktopWriteDevicePacket( DWORD dwCmd, const CCommandPacket* pCmdDataIn
                IFDBG( DebugOut( DEBUG_OUTPUT, L"Unknown packet type: 0x%08x\n", dwCmd ) );
                break;
          }
-
-         BOOL bRet = WriteMsgQueue( g_hWriteQueue, buffer, dwSize, MSG_QUEUE_WRITE_TIMEOUT, 0 );
-         if ( bRet ) {
-            TRACE0( "Written packet to device" );
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"Data to device:\n" ) );
-            IFDBG( DumpBuff( DEBUG_OUTPUT, buffer, dwSize ) );
-         } else {
-            TRACE1( "WriteMsgQueue ret: 0x%08x", GetLastError() );
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteMsgQueue ret: 0x%08x\n", GetLastError() ) );
-         }    
-         
-         
       } else {
          IFDBG( DebugOut( DEBUG_OUTPUT, L"COMMAND_PACKET GetNextParameterType ret: FAILED\n" ) );
       }
@@ -242,44 +353,222 @@ void ReadDesktopWriteDevicePacket( DWORD dwCmd, const CCommandPacket* pCmdDataIn
 }
 
 /**
-@func void | ReadDesktopWriteDevicePacket | Reads data from the message queue and writes them to the desktop.
+@func BOOL | AppendToBatch | Appends the HCI frame to the batch of its lane. The batch is written to the lane right away if the lane has room.
+@parm const BYTE* | pData | HCI frame.
+@parm DWORD | cbData | HCI frame size.
+@rdesc Returns TRUE if the frame has been accepted. The frame is dropped if the batch stays full for BATCH_FULL_TIMEOUT ms.
+*/
+BOOL AppendToBatch( const BYTE* pData, DWORD cbData )
+{
+   int lane = GetFrameLane( pData, cbData );
+
+   EnterCriticalSection( &g_batchSection );
+
+   BOOL bRet = g_batches[lane].append( pData, cbData );
+   if ( !bRet ) {
+      // the batch is full, wait a bounded time until the device takes it. the lock is held by
+      // the caller too, so it can't be released for the wait.
+      FlushBatch( lane, BATCH_FULL_TIMEOUT );
+      bRet = g_batches[lane].append( pData, cbData );
+      if ( !bRet ) {
+         InterlockedIncrement( &g_lDroppedBatchFrames );
+         TRACE1( "Frame dropped, lane %d is full", lane );
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"AppendToBatch - frame dropped, lane %d is full\n", lane ) );
+      }
+   }
+
+   if ( bRet && !FlushBatch( lane, 0 ) ) {
+      // the device side is busy, let the working thread flush the batch.
+      SetEvent( g_hBatchEvent );
+   }
+
+   LeaveCriticalSection( &g_batchSection );
+   return bRet;
+}
+
+/**
+@func BOOL | ReadToBatch | Reads the HCI frame of the desktop command right into the batch of its lane.
+@parm const CCommandPacket* | pCmdDataIn | Command with the frame as the next parameter.
+@parm DWORD | cbData | HCI frame size.
+@rdesc Returns TRUE if the frame has been read. It's dropped if it isn't accepted.
+@remark The lane is known once the frame is read, so it's read into the ACL batch, where most of the data goes. The frames of the other lanes are moved to their batches.
+*/
+BOOL ReadToBatch( const CCommandPacket* pCmdDataIn, DWORD cbData )
+{
+   EnterCriticalSection( &g_batchSection );
+
+   BOOL bRet = FALSE;
+   BYTE* pData = g_batches[MSG_ACL_LANE].reserve( cbData );
+   if ( pData ) {
+      bRet = pCmdDataIn->GetParameterBytes( pData, cbData );
+      if ( bRet ) {
+         IFDBG( DumpBuff( DEBUG_OUTPUT, pData, cbData ) );
+
+         int lane = GetFrameLane( pData, cbData );
+         if ( MSG_ACL_LANE == lane ) {
+            UpdateFrameStats( g_toDeviceStats, pData, cbData );
+            g_batches[lane].commit( cbData );
+            if ( !FlushBatch( lane, 0 ) ) {
+               // the device side is busy, let the working thread flush the batch.
+               SetEvent( g_hBatchEvent );
+            }
+         } else if ( AppendToBatch( pData, cbData ) ) {
+            UpdateFrameStats( g_toDeviceStats, pData, cbData );
+         }
+      }
+   } else {
+      // the ACL batch is full. the frame is read aside, so a frame of another lane doesn't
+      // wait for the ACL lane.
+      BYTE payload[MSG_BUFFER_SIZE];
+      bRet = pCmdDataIn->GetParameterBytes( payload, cbData );
+      if ( bRet ) {
+         IFDBG( DumpBuff( DEBUG_OUTPUT, payload, cbData ) );
+         if ( AppendToBatch( payload, cbData ) ) {
+            UpdateFrameStats( g_toDeviceStats, payload, cbData );
+         }
+      }
+   }
+
+   LeaveCriticalSection( &g_batchSection );
+   return bRet;
+}
+
+/**
+@func BOOL | FlushBatch | Writes the pending batch of the lane. Must be called within the batch critical section.
+@parm int | lane | MSG_LANE value.
+@parm DWORD | dwTimeout | Write timeout.
+@rdesc Returns TRUE if nothing is pending anymore.
+*/
+BOOL FlushBatch( int lane, DWORD dwTimeout )
+{
+   BOOL bRet = TRUE;
+
+   HciBatchWriter& batch = g_batches[lane];
+   if ( batch.count() > 0 ) {
+      // don't even try to write without credits unless it's allowed to wait.
+      LONG lCredits = g_channels.pTransports[lane]->GetCredits( MSG_BUFFER_SIZE );
+      if ( 0 == lCredits && 0 == dwTimeout ) {
+         InterlockedIncrement( &g_creditStats.lStalls );
+         return FALSE;
+      }
+      if ( lCredits < g_creditStats.lMinCredits ) {
+         g_creditStats.lMinCredits = lCredits;
+      }
+
+      PacketSegment segment = { batch.data(), batch.length() };
+      bRet = g_channels.pTransports[lane]->Send( &segment, 1, dwTimeout );
+      if ( bRet ) {
+         InterlockedIncrement( &g_creditStats.lWrites );
+         TRACE0( "Written packet to device" );
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"Data to device: lane: %d %d frame(s)\n", lane, batch.count() ) );
+         IFDBG( DumpBuff( DEBUG_OUTPUT, batch.data(), batch.length() ) );
+         batch.reset();
+      } else if ( ERROR_TIMEOUT != GetLastError() ) {
+         TRACE1( "Send ret: 0x%08x", GetLastError() );
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"Send ret: 0x%08x\n", GetLastError() ) );
+         batch.reset();
+      }
+   }
+
+   return bRet;
+}
+
+/**
+@func BOOL | WriteToDevice | Writes the message to the control lane after the pending batch of the lane, so the order is kept.
+@parm const BYTE* | pData | Message data.
+@parm DWORD | cbData | Message size.
+@rdesc Returns TRUE on success.
+*/
+BOOL WriteToDevice( const BYTE* pData, DWORD cbData )
+{
+   EnterCriticalSection( &g_batchSection );
+
+   FlushBatch( MSG_CONTROL_LANE, MSG_QUEUE_WRITE_TIMEOUT );
+   PacketSegment segment = { pData, cbData };
+   BOOL bRet = g_channels.pTransports[MSG_CONTROL_LANE]->Send( &segment, 1, MSG_QUEUE_WRITE_TIMEOUT );
+   if ( bRet ) {
+      InterlockedIncrement( &g_creditStats.lWrites );
+      TRACE0( "Written packet to device" );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Data to device:\n" ) );
+      IFDBG( DumpBuff( DEBUG_OUTPUT, pData, cbData ) );
+   } else {
+      TRACE1( "Send ret: 0x%08x", GetLastError() );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Send ret: 0x%08x\n", GetLastError() ) );
+   }
+
+   LeaveCriticalSection( &g_batchSection );
+   return bRet;
+}
+
+/**
+@func void | ReadDeviceWriteDesktop | Drains the device lanes and writes the HCI frames to the desktop in one command.
 */
 void ReadDeviceWriteDesktop()
 {
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+ReadDeviceWriteDesktop\n" ) );
 
-   //ASSERT( g_hReadQueue );   
-   if ( g_hReadQueue ) {
-      unsigned char buffer[MSG_BUFFER_SIZE] = {0};
+   //ASSERT( g_channels.pTransports[MSG_CONTROL_LANE] );   
+   if ( g_channels.pTransports[MSG_CONTROL_LANE] ) {
+      // the frames are collected in a command of its own, so the replies sent meanwhile don't wait.
+      int index = AcquireCommand();
+      if ( index < 0 ) {
+         // the frames stay in the lanes until the next wake.
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"-ReadDeviceWriteDesktop - no free command\n" ) );
+         return;
+      }
+      CCommandPacket* pCmd = g_cmdPool[index];
+
+      unsigned char buffer[MSG_BUFFER_SIZE];
+      DWORD dwFrames = 0;
+      DWORD dwBytes = 0;
+      for ( int i = 0; i < DRAIN_MAX_MESSAGES; ++i ) {
+         DWORD dwReaded = 0;
+         if ( !ReceiveFromLanes( g_channels, buffer, MSG_BUFFER_SIZE, &dwReaded, 0 ) ) {
+            // the lanes are drained.
+            break;
+         }
 
-      DWORD dwReaded = 0;
-      DWORD dwFlags = 0;          
-      BOOL bRet = ReadMsgQueue( g_hReadQueue, buffer, MSG_BUFFER_SIZE, &dwReaded, 0/*MSG_QUEUE_READ_TIMEOUT*/, &dwFlags );
-      if ( bRet ) {
          TRACE0( "Readed packet from device" );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from device:\n" ) );
-         Packet packet;
-         packet.deserialize( buffer, dwReaded );
-         IFDBG( DumpBuff( DEBUG_OUTPUT, buffer, dwReaded ) );
-         
+
          // read packet type.
-         DWORD dwCmd = packet.readInt();
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"Data to desktop: dwCmd: 0x%08x\n", dwCmd ) );
+         int type = -1;
+         MsgHeader::decode( buffer, dwReaded, type );
+         DWORD dwCmd = type;
 
          switch( dwCmd ) {               
          
          case MESSAGE_PACKET: {
-            DWORD dwMsgId = packet.readInt();
-            // send command...
-            SendCommand( MESSAGE_PACKET, dwMsgId );
+            int msgId = 0;
+            if ( ControlMsg::decode( buffer, dwReaded, msgId ) ) {
+               // the frames read before go first, so the desktop sees the same order.
+               SendFrames( pCmd, dwFrames );
+               dwFrames = 0;
+               dwBytes = 0;
+               pCmd->Reset();
+               SendCommand( MESSAGE_PACKET, msgId );
+            }
             }
             break;
 
          case HCI_DATA_PACKET: {
-            // read data packet if any.
-            size_t size = packet.readUCharArray( buffer, sizeof( buffer ) );
-            // send command...
-            SendCommand( HCI_DATA_PACKET, buffer, size );
+            // the data is added right from the message buffer.
+            size_t size = 0;
+            DWORD dwSeq = 0;
+            const unsigned char* pData = HciDataMsg::decode( buffer, dwReaded, size, dwSeq );
+            if ( pData ) {
+               AddFrame( pCmd, pData, size, dwSeq, dwFrames, dwBytes );
+            }
+            }
+            break;
+
+         case HCI_DATA_BATCH_PACKET: {
+            HciBatchReader batch( buffer, dwReaded );
+            size_t size = 0;
+            DWORD dwSeq = 0;
+            const unsigned char* pData = NULL;
+            while ( NULL != ( pData = batch.next( size, dwSeq ) ) ) {
+               AddFrame( pCmd, pData, size, dwSeq, dwFrames, dwBytes );
+            }
             }
             break;
 
@@ -287,16 +576,71 @@ void ReadDeviceWriteDesktop()
             IFDBG( DebugOut( DEBUG_OUTPUT, L"Unknown packet type: 0x%08x\n", dwCmd ) );
             break;
          }                                   
+      }
 
-      } else {
-         TRACE1( "ReadMsgQueue ret: 0x%08x", GetLastError() );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadMsgQueue ret: 0x%08x\n", GetLastError() ) );         
-      }         
+      SendFrames( pCmd, dwFrames );
+      ReleaseCommand( index );
    }
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-ReadDeviceWriteDesktop\n" ) );
 }
 
+/**
+@func void | AddFrame | Adds the HCI frame to the command, the command is sent first if the frame would take it over DRAIN_MAX_BYTES.
+@parm CCommandPacket* | pCmd | Command taken from the pool.
+@parm const BYTE* | pData | HCI frame starting with the H4 packet type.
+@parm DWORD | cbData | HCI frame size.
+@parm DWORD | dwSeq | Number the driver has given the frame, its result is returned with it.
+@parm DWORD& | dwFrames | Number of the frames in the command.
+@parm DWORD& | dwBytes | Number of the frame bytes in the command.
+*/
+void AddFrame( CCommandPacket* pCmd, const BYTE* pData, DWORD cbData, DWORD dwSeq, DWORD& dwFrames, DWORD& dwBytes )
+{
+   if ( dwFrames > 0 && dwBytes + cbData > DRAIN_MAX_BYTES ) {
+      SendFrames( pCmd, dwFrames );
+      pCmd->Reset();
+      dwFrames = 0;
+      dwBytes = 0;
+   }
+
+   QueueResultSeq( dwSeq );
+   pCmd->AddParameterBytes( (BYTE*)pData, cbData );
+   UpdateFrameStats( g_toDesktopStats, pData, cbData );
+   ++dwFrames;
+   dwBytes += cbData;
+}
+
+/**
+@func void | UpdateFrameStats | Accounts the HCI frame in the given direction statistics.
+@parm FRAME_STATS& | stats | Direction statistics.
+@parm const BYTE* | pData | HCI frame starting with the H4 packet type.
+@parm DWORD | cbData | HCI frame size.
+*/
+void UpdateFrameStats( FRAME_STATS& stats, const BYTE* pData, DWORD cbData )
+{
+   DWORD dwType = ( cbData > 0 && pData[0] < FRAME_STATS_TYPES ) ? pData[0] : 0;
+   InterlockedIncrement( &stats.lFrames[dwType] );
+   InterlockedExchangeAdd( &stats.lBytes, cbData );
+}
+
+/**
+@func void | DumpFrameStats | Writes the HCI frame statistics as a single key=value line, so it can be collected by scripts.
+*/
+void DumpFrameStats()
+{
+   DWORD dwElapsed = GetTickCount() - g_dwStartTime;
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"STATS elapsed_ms=%lu"
+      L" to_device_bytes=%ld to_device_cmd=%ld to_device_acl=%ld to_device_sco=%ld to_device_evt=%ld to_device_unknown=%ld"
+      L" to_desktop_bytes=%ld to_desktop_cmd=%ld to_desktop_acl=%ld to_desktop_sco=%ld to_desktop_evt=%ld to_desktop_unknown=%ld"
+      L" to_desktop_send_failures=%ld to_desktop_dropped=%ld to_device_dropped=%ld"
+      L" queue_depth=%lu queue_writes=%ld queue_stalls=%ld queue_min_credits=%ld\n",
+      dwElapsed,
+      g_toDeviceStats.lBytes, g_toDeviceStats.lFrames[1], g_toDeviceStats.lFrames[2], g_toDeviceStats.lFrames[3], g_toDeviceStats.lFrames[4], g_toDeviceStats.lFrames[0],
+      g_toDesktopStats.lBytes, g_toDesktopStats.lFrames[1], g_toDesktopStats.lFrames[2], g_toDesktopStats.lFrames[3], g_toDesktopStats.lFrames[4], g_toDesktopStats.lFrames[0],
+      g_lSendFramesFailures, g_lDroppedFrames, g_lDroppedBatchFrames,
+      g_dwQueueDepth, g_creditStats.lWrites, g_creditStats.lStalls, g_creditStats.lMinCredits ) );
+}
+
 /**
 @func HRESULT | CommandCallback | Function prototype for the callback function to StartCommandHandler.
 @parm DWORD | dwCmd | The commandId the desktop sent.
@@ -341,9 +685,19 @@ HRESULT STDAPICALLTYPE CommandCallback( DWORD dwCmd, const CCommandPacket* pCmdD
 
                   case AGENT_INITIALIZE_MSG: {
                      //IFDBG( DebugOut( DEBUG_OUTPUT, L"AGENT_INITIALIZE_MSG back\n" ) );
-                     // initialize agent...
-                     Initialize();
-                     SendCommand( MESSAGE_PACKET, AGENT_INITIALIZE_MSG );                     
+                     // the desktop may send the controller's ACL MTU along.
+                     DWORD dwControllerMtu = 0;
+                     if ( pCmdDataIn->GetNextParameterType( &dataType, &dwSize ) && dataType == CCommandPacket::DATATYPE_DWORD ) {
+                        pCmdDataIn->GetParameterDWORD( &dwControllerMtu );
+                     }
+
+                     // initialize agent and reply with the negotiated MTU...
+                     int nRet = Initialize( dwControllerMtu );
+                     if ( nRet ) {
+                        TRACE1( "Initialize ret: %d", nRet );
+                        IFDBG( DebugOut( DEBUG_OUTPUT, L"Initialize ret: %d\n", nRet ) );
+                     }
+                     SendCommand( MESSAGE_PACKET, AGENT_INITIALIZE_MSG, g_dwAclMtu );
                   }
                   break;
                        
@@ -398,14 +752,13 @@ HRESULT STDAPICALLTYPE CommandCallback( DWORD dwCmd, const CCommandPacket* pCmdD
             if ( pCmdDataIn->GetNextParameterType( &dataType, &dwSize ) ) {
                if ( dataType != CCommandPacket::DATATYPE_END && dataType == CCommandPacket::DATATYPE_DWORD && dwSize > 0 ) {
                   DWORD dwLastError = 0;
+                  DWORD dwSeq = 0;
                   if ( pCmdDataIn->GetParameterDWORD( &dwLastError ) ) {                  
-                     BOOL bRet = WriteMsgQueue( g_hErrorQueue, &dwLastError, sizeof(DWORD), MSG_QUEUE_WRITE_TIMEOUT, 0 );
-                     if ( bRet ) {
-                        IFDBG( DebugOut( DEBUG_OUTPUT, L"Last error received: 0x%08x\n", dwLastError ) );
+                     if ( TakeResultSeq( dwSeq ) ) {
+                        WriteFrameResult( dwLastError, dwSeq );
                      } else {
-                        TRACE1( "WriteMsgQueue ret: 0x%08x", GetLastError() );
-                        IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteMsgQueue ret: 0x%08x\n", GetLastError() ) );
-                     }    
+                        IFDBG( DebugOut( DEBUG_OUTPUT, L"Unexpected frame result: 0x%08x\n", dwLastError ) );
+                     }
                   }
                }
             }
@@ -427,21 +780,44 @@ DWORD WINAPI WorkingThread( LPVOID lpParam )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+WorkingThread\n" ) );
 
    DWORD dwRes = 0;
-   HANDLE handles[] = { g_hQuitEvent, g_hReadQueue };
+   // stop and batch events, the read lanes, the write lanes with a pending batch.
+   HANDLE handles[2 + 2 * MSG_LANE_COUNT] = { g_hStopEvent, g_hBatchEvent };
 
    DWORD dwWait = WAIT_FAILED;
    for (;;) {
-      dwWait = WaitForMultipleObjects( sizeof( handles )/sizeof( handles[0] ), handles, FALSE, INFINITE );
+      // the lane handles are taken before each wait, the shared memory rings signal only a waiting side.
+      DWORD dwCount = 2;
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         handles[dwCount++] = g_channels.pTransports[lane]->GetReceiveEvent();
+      }
+
+      // the write lane is signaled whenever it has room, so it's waited for only while its batch is pending.
+      EnterCriticalSection( &g_batchSection );
+      BOOL bPending = FALSE;
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         if ( g_batches[lane].count() > 0 ) {
+            handles[dwCount++] = g_channels.pTransports[lane]->GetSendEvent( MSG_BUFFER_SIZE );
+            bPending = TRUE;
+         }
+      }
+      LeaveCriticalSection( &g_batchSection );
+
+      dwWait = WaitForMultipleObjects( dwCount, handles, FALSE, bPending ? BATCH_FLUSH_TIMEOUT : INFINITE );
       if ( WAIT_OBJECT_0 == dwWait ) {
          // exit the loop...
          break;
       } else if ( WAIT_OBJECT_0 + 1 == dwWait ) {
+         // a batch is pending...
+      } else if ( WAIT_OBJECT_0 + 2 <= dwWait && WAIT_OBJECT_0 + 2 + MSG_LANE_COUNT > dwWait ) {
          // data available...
-      ReadDeviceWriteDesktop();
-      } else if (WAIT_TIMEOUT == dwWait ) {
-         // this one should never been called.
-         TRACE0( "WaitForMultipleObjects ret: WAIT_TIMEOUT" );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"WaitForMultipleObjects ret: WAIT_TIMEOUT\n" ) );
+         ReadDeviceWriteDesktop();
+      } else if ( WAIT_OBJECT_0 + dwCount > dwWait || WAIT_TIMEOUT == dwWait ) {
+         // flush the pending batches, the higher priority lanes first...
+         EnterCriticalSection( &g_batchSection );
+         for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+            FlushBatch( lane, 0 );
+         }
+         LeaveCriticalSection( &g_batchSection );
       } else {
          // WAIT_FAILED
          DWORD dwError = GetLastError();
@@ -454,6 +830,28 @@ DWORD WINAPI WorkingThread( LPVOID lpParam )
    return dwRes;
 }
 
+/**
+@func void | StopWorkingThread | Stops the working thread and waits for it to exit.
+@rdesc None.
+@remark The batches not flushed yet are dropped, they belong to the session that ends.
+*/
+void StopWorkingThread()
+{
+   if ( g_hWorkingThread ) {
+      SetEvent( g_hStopEvent );
+      WaitForSingleObject( g_hWorkingThread, INFINITE );
+      CloseHandle( g_hWorkingThread );
+      g_hWorkingThread = NULL;
+      ResetEvent( g_hStopEvent );
+   }
+
+   EnterCriticalSection( &g_batchSection );
+   for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+      g_batches[lane].reset();
+   }
+   LeaveCriticalSection( &g_batchSection );
+}
+
 /**
 @func DWORD | WatchDogThread | The watch dog thread, used to determine the connection loss with the desktop.
 @parm LPVOID | lpParam | Thread data passed to the function using the lpParameter parameter of the CreateThread function. 
@@ -491,42 +889,18 @@ BOOL ActivateDriver()
 
    ASSERT( g_hDevice == NULL );
 
-   TCHAR szDeviceName[MAX_PATH];
-   for( int index = 1; index <= 9; ++index ) {		
-      // generate a new device name.
-      memset( szDeviceName, 0, sizeof( szDeviceName ) );
-      _stprintf( szDeviceName, _T("%s%d:"), DEVICE_PREFIX, index ); 
-
-      // store the name to the registry. at initialization time the driver will read this info.
-      HKEY hk = NULL;
-      DWORD dwStatus = RegOpenKeyEx( HKEY_LOCAL_MACHINE, REG_KEY_NAME, 0, 0, &hk );
-      if( ERROR_SUCCESS == dwStatus ) {
-         DWORD dwType, dwSize;
-         dwType = REG_SZ;
-         dwSize = _tcslen( szDeviceName ) * sizeof( TCHAR );
-         dwStatus = RegSetValueEx( hk, _T("Name"), NULL, dwType, (LPBYTE)szDeviceName, dwSize );
-         if( dwStatus == ERROR_SUCCESS ) {
-            // register driver.
-            g_hDevice = RegisterDevice( DEVICE_PREFIX, index, COMMUNICATION_DRIVER_FILENAME, (DWORD)REG_KEY_NAME );
-            if ( !g_hDevice ) {
-               TRACE3( "RegisterDevice %s%d ret: 0x%08x", DEVICE_PREFIX, index, GetLastError() );
-               IFDBG( DebugOut( DEBUG_OUTPUT, L"RegisterDevice %s%d ret: 0x%08x\n", DEVICE_PREFIX, index, GetLastError() ) );
-            } else {
-               bRet = TRUE;               
-            }
-
-            // release the registry key
-            RegCloseKey( hk );
+   // the first free index is taken, so every agent gets its own driver instance. the index
+   // is passed to the driver as the context, the driver names its device and channels after it.
+   for( int index = 1; index <= DEVICE_MAX_INDEX; ++index ) {		
+      g_hDevice = RegisterDevice( DEVICE_PREFIX, index, COMMUNICATION_DRIVER_FILENAME, index );
+      if ( g_hDevice ) {
+         g_dwInstance = index;
+         bRet = TRUE;
+         break;
+      }
 
-            if ( bRet ) break;
-         } else {
-            TRACE3( "RegSetValueEx %s %s ret: 0x%08x", REG_KEY_NAME, _T("Name"), dwStatus );
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"RegSetValueEx %s %s ret: 0x%08x\n", REG_KEY_NAME, _T("Name"), dwStatus ) );
-         }
-      } else {
-         TRACE2( "RegOpenKeyEx %s ret: 0x%08x", REG_KEY_NAME, dwStatus );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"RegOpenKeyEx %s ret: 0x%08x\n", REG_KEY_NAME, dwStatus ) );
-      }	   		
+      TRACE3( "RegisterDevice %s%d ret: 0x%08x", DEVICE_PREFIX, index, GetLastError() );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"RegisterDevice %s%d ret: 0x%08x\n", DEVICE_PREFIX, index, GetLastError() ) );
    }  
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-ActivateDriver ret: %d\n", bRet ) );
@@ -656,6 +1030,65 @@ BOOL ProvisionDeviceWithRgs( LPCWSTR szwFileName )
    return bRet;
 }
 
+/**
+@func int | AcquireCommand | Takes a free command from the pool.
+@parm DWORD | dwTimeout | Time to wait while all the commands are in use.
+@rdesc Returns the index of the command in the pool or -1 if no command has got free in time. GetLastError returns ERROR_TIMEOUT then.
+*/
+int AcquireCommand( DWORD dwTimeout )
+{
+   DWORD dwRet = WaitForSingleObject( g_hCmdSemaphore, dwTimeout );
+   if ( WAIT_OBJECT_0 != dwRet ) {
+      if ( WAIT_TIMEOUT == dwRet ) {
+         SetLastError( ERROR_TIMEOUT );
+      }
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"AcquireCommand - no free command: 0x%08x\n", GetLastError() ) );
+      return -1;
+   }
+
+   // the semaphore has counted a free command, so one is found.
+   for ( int index = 0; index < COMMAND_POOL_SIZE; ++index ) {
+      if ( 0 == InterlockedCompareExchange( (LPLONG)&g_cmdBusy[index], 1, 0 ) ) {
+         g_cmdPool[index]->Reset();
+         return index;
+      }
+   }
+
+   ASSERT( FALSE );
+   ReleaseSemaphore( g_hCmdSemaphore, 1, NULL );
+   return -1;
+}
+
+/**
+@func void | ReleaseCommand | Returns the command to the pool.
+@parm int | index | Index of the command in the pool.
+*/
+void ReleaseCommand( int index )
+{
+   InterlockedExchange( (LPLONG)&g_cmdBusy[index], 0 );
+   ReleaseSemaphore( g_hCmdSemaphore, 1, NULL );
+}
+
+/**
+@func BOOL | PushCommand | Pushes the command to desktop.
+@parm DWORD | dwCmd | Command Id.
+@parm CCommandPacket* | pCmd | Command taken from the pool.
+@rdesc The function should return a value that indicates its success or failure. 
+*/
+BOOL PushCommand( DWORD dwCmd, CCommandPacket* pCmd )
+{
+   HRESULT hr = g_DeviceRemoteTool.PushCommand( dwCmd, pCmd );
+   ASSERT( SUCCEEDED( hr ) );
+   if ( FAILED( hr ) ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"PushCommand ret: 0x%08x\n", hr ) );         
+      SetLastError( HRESULT_CODE( hr ) );
+      return FALSE;
+   }
+
+   InterlockedIncrement( &g_lOutcomeMsgCounter );
+   return TRUE;
+}
+
 /**
 @func BOOL | SendCommand | Sends message packet to desktop.
 @parm DWORD | dwCmd | Command Id.
@@ -664,100 +1097,231 @@ BOOL ProvisionDeviceWithRgs( LPCWSTR szwFileName )
 */
 BOOL SendCommand( DWORD dwCmd, DWORD dwMsgId )
 {
-   EnterCriticalSection( &g_criticalSection );
-   
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+SendCommand dwCmd: 0x%08x dwMsgId: 0x%08x\n", dwCmd, dwMsgId ) );
 
-   BOOL bRet = FALSE;
-
-   if ( g_pCmd ) {
-      g_pCmd->Reset();
-      g_pCmd->AddParameterDWORD( dwMsgId );      
-      
-      HRESULT hr = g_DeviceRemoteTool.PushCommand( dwCmd, g_pCmd );
-      ASSERT( SUCCEEDED( hr ) );
-      if ( SUCCEEDED( hr ) ) {
-         ++g_lOutcomeMsgCounter;
-         bRet = TRUE;      
-      } else {
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"PushCommand ret: 0x%08x\n", hr ) );         
-      }
+   int index = AcquireCommand();
+   if ( index < 0 ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendCommand ret: %d\n", FALSE ) );
+      return FALSE;
    }
+   g_cmdPool[index]->AddParameterDWORD( dwMsgId );      
+   BOOL bRet = PushCommand( dwCmd, g_cmdPool[index] );
+   ReleaseCommand( index );
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendCommand ret: %d\n", bRet ) );
 
-   LeaveCriticalSection( &g_criticalSection );
-
    return bRet;   
 }
 
 /**
-@func BOOL | SendCommand | Sends message packet to desktop.
+@func BOOL | SendCommand | Sends message packet with a parameter to desktop.
 @parm DWORD | dwCmd | Command Id.
-@parm BYTE* | pData | Data buffer.
-@parm DWORD | cbData | Data buffer size.
+@parm DWORD | dwMsgId | Message Id.
+@parm DWORD | dwParam | Message parameter.
 @rdesc The function should return a value that indicates its success or failure. 
 */
-BOOL SendCommand( DWORD dwCmd, BYTE* pData, DWORD cbData )
+BOOL SendCommand( DWORD dwCmd, DWORD dwMsgId, DWORD dwParam )
 {
-   EnterCriticalSection( &g_criticalSection );
-   
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"+SendCommand pData:\n" ) );
-   IFDBG( DumpBuff( DEBUG_OUTPUT, pData, cbData ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+SendCommand dwCmd: 0x%08x dwMsgId: 0x%08x dwParam: 0x%08x\n", dwCmd, dwMsgId, dwParam ) );
 
-   BOOL bRet = FALSE;
+   int index = AcquireCommand();
+   if ( index < 0 ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendCommand ret: %d\n", FALSE ) );
+      return FALSE;
+   }
+   g_cmdPool[index]->AddParameterDWORD( dwMsgId );
+   g_cmdPool[index]->AddParameterDWORD( dwParam );
+   BOOL bRet = PushCommand( dwCmd, g_cmdPool[index] );
+   ReleaseCommand( index );
 
-   if ( g_pCmd ) {
-      if ( cbData ) {
-         g_pCmd->Reset();
-         g_pCmd->AddParameterBytes( pData, cbData );
-      }
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendCommand ret: %d\n", bRet ) );
 
-      HRESULT hr = g_DeviceRemoteTool.PushCommand( dwCmd, g_pCmd );
-      ASSERT( SUCCEEDED( hr ) );
-      if ( SUCCEEDED( hr ) ) {
-         ++g_lOutcomeMsgCounter;
-         bRet = TRUE;      
-      } else {
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"PushCommand ret: 0x%08x\n", hr ) );         
+   return bRet;   
+}
+
+/**
+@func BOOL | SendFrames | Sends the HCI frames collected in the command to desktop.
+@parm CCommandPacket* | pCmd | Command taken from the pool.
+@parm DWORD | dwFrames | Number of the frames.
+@rdesc The function should return a value that indicates its success or failure. Nothing is sent without frames, that's a success.
+@remark The failures and the frames lost with them are counted in the STATS line. The lost frames get failed results
+with their numbers taken back from the queue, so the driver still gets one result per written frame.
+*/
+BOOL SendFrames( CCommandPacket* pCmd, DWORD dwFrames )
+{
+   if ( 0 == dwFrames ) {
+      return TRUE;
+   }
+
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+SendFrames frames: %d\n", dwFrames ) );
+
+   BOOL bRet = PushCommand( HCI_DATA_PACKET, pCmd );
+   if ( !bRet ) {
+      DWORD dwLastError = GetLastError();
+      if ( ERROR_SUCCESS == dwLastError ) {
+         dwLastError = ERROR_WRITE_FAULT;
+      }
+      InterlockedIncrement( &g_lSendFramesFailures );
+      InterlockedExchangeAdd( &g_lDroppedFrames, dwFrames );
+      TRACE1( "SendFrames dropped %d frames", dwFrames );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"SendFrames dropped %d frames\n", dwFrames ) );
+
+      // the frames of the command are the last ones queued, nothing has taken their numbers yet.
+      DWORD dwSeq = 0;
+      for ( DWORD i = 0; i < dwFrames && TakeBackResultSeq( dwSeq ); ++i ) {
+         WriteFrameResult( dwLastError, dwSeq );
       }
    }
 
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendCommand ret: %d\n", bRet ) );
-   
-   LeaveCriticalSection( &g_criticalSection );
-   
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-SendFrames ret: %d\n", bRet ) );
+
    return bRet;   
 }
 
 /**
-@func BOOL | Initialize | Initializes communication means.
+@func void | ResetResultSeqs | Drops the numbers of the frames of the previous session.
+*/
+void ResetResultSeqs()
+{
+   EnterCriticalSection( &g_resultSection );
+   g_dwResultSeqHead = 0;
+   g_dwResultSeqCount = 0;
+   LeaveCriticalSection( &g_resultSection );
+}
+
+/**
+@func BOOL | QueueResultSeq | Queues the number of the HCI frame pushed to the desktop.
+@parm DWORD | dwSeq | Number the driver has given the frame.
+@rdesc Returns FALSE if the queue is full, the result of the frame is matched to a later frame then.
+*/
+BOOL QueueResultSeq( DWORD dwSeq )
+{
+   EnterCriticalSection( &g_resultSection );
+   BOOL bRet = ( g_dwResultSeqCount < RESULT_SEQ_QUEUE_SIZE );
+   if ( bRet ) {
+      g_resultSeqs[g_dwResultSeqHead] = dwSeq;
+      g_dwResultSeqHead = ( g_dwResultSeqHead + 1 ) % RESULT_SEQ_QUEUE_SIZE;
+      ++g_dwResultSeqCount;
+   }
+   LeaveCriticalSection( &g_resultSection );
+
+   if ( !bRet ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"QueueResultSeq - queue full, seq: %lu\n", dwSeq ) );
+   }
+   return bRet;
+}
+
+/**
+@func BOOL | TakeResultSeq | Takes the number of the oldest HCI frame waiting for its result.
+@parm DWORD& | dwSeq | Number of the frame.
+@rdesc Returns FALSE if no frame waits for its result.
+*/
+BOOL TakeResultSeq( DWORD& dwSeq )
+{
+   EnterCriticalSection( &g_resultSection );
+   BOOL bRet = ( g_dwResultSeqCount > 0 );
+   if ( bRet ) {
+      DWORD dwTail = ( g_dwResultSeqHead + RESULT_SEQ_QUEUE_SIZE - g_dwResultSeqCount ) % RESULT_SEQ_QUEUE_SIZE;
+      dwSeq = g_resultSeqs[dwTail];
+      --g_dwResultSeqCount;
+   }
+   LeaveCriticalSection( &g_resultSection );
+   return bRet;
+}
+
+/**
+@func BOOL | TakeBackResultSeq | Takes back the number of the HCI frame queued last, the frame hasn't reached the desktop.
+@parm DWORD& | dwSeq | Number of the frame.
+@rdesc Returns FALSE if the queue is empty.
+*/
+BOOL TakeBackResultSeq( DWORD& dwSeq )
+{
+   EnterCriticalSection( &g_resultSection );
+   BOOL bRet = ( g_dwResultSeqCount > 0 );
+   if ( bRet ) {
+      g_dwResultSeqHead = ( g_dwResultSeqHead + RESULT_SEQ_QUEUE_SIZE - 1 ) % RESULT_SEQ_QUEUE_SIZE;
+      dwSeq = g_resultSeqs[g_dwResultSeqHead];
+      --g_dwResultSeqCount;
+   }
+   LeaveCriticalSection( &g_resultSection );
+   return bRet;
+}
+
+/**
+@func BOOL | WriteFrameResult | Writes the result of the HCI frame to the error queue of the driver.
+@parm DWORD | dwLastError | Result of the frame, ERROR_SUCCESS if the desktop has written it.
+@parm DWORD | dwSeq | Number the driver has given the frame.
 @rdesc The function should return a value that indicates its success or failure. 
+@remark The driver keeps the first failed result and takes every result as an acknowledgment of all the frames before it.
 */
-BOOL Initialize()
+BOOL WriteFrameResult( DWORD dwLastError, DWORD dwSeq )
 {
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"+Initialize\n" ) );
+   unsigned char buffer[ErrorMsg::SIZE];
+   BOOL bRet = WriteMsgQueue( g_channels.hErrorQueue, buffer, ErrorMsg::encode( buffer, dwLastError, dwSeq ), MSG_QUEUE_WRITE_TIMEOUT, 0 );
+   if ( bRet ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Frame result: 0x%08x seq: %lu\n", dwLastError, dwSeq ) );
+   } else {
+      TRACE1( "WriteMsgQueue ret: 0x%08x", GetLastError() );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteMsgQueue ret: 0x%08x\n", GetLastError() ) );
+   }
 
-   // sleep a little. see bthemul.cxx::HCI_OpenConnection
-   Sleep( 500 );
+   return bRet;
+}
+
+/**
+@func BOOL | Initialize | Initializes communication means.
+@parm DWORD | dwControllerMtu | Controller's ACL MTU, 0 if it's unknown.
+@rdesc Returns zero on success or negative number if an error occurs. ERROR_TRANSPORT_BUSY if the transport hasn't closed the connection to the previous driver within HANDSHAKE_TIMEOUT ms.
+*/
+BOOL Initialize( DWORD dwControllerMtu )
+{
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+Initialize\n" ) );
 
    int nRet = 0;
-   // create messages queues to communicate with.
-   BOOL bRet = CreateMsgQueues();
+   // the transport may still be closing the connection to the previous driver. see bthemul.cxx::HCI_CloseConnection
+   if ( g_hClosedEvent && WAIT_OBJECT_0 != WaitForSingleObject( g_hClosedEvent, HANDSHAKE_TIMEOUT ) ) {
+      nRet = ERROR_TRANSPORT_BUSY;
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Transport connection is still open\n" ) );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-Initialize ret: %d\n", nRet ) );
+      return nRet;
+   }
+
+   // provision the device first, the queue settings are read from the registry.
+   BOOL bRet = ProvisionDevice();
    ASSERT( bRet );
 
    if ( bRet ) {
-      bRet = ProvisionDevice();
+      // the HCI transport sizes its packets after the negotiated MTU, so it's stored before
+      // the driver is activated.
+      g_dwAclMtu = NegotiateAclMtu( dwControllerMtu );
+      WriteMsgQueueValue( REG_KEY_NAME, MSG_ACL_MTU_VALNAME, g_dwAclMtu );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"ACL MTU controller: %d, negotiated: %d\n", dwControllerMtu, g_dwAclMtu ) );
+
+      // copy transport and communication drivers to Windows directory.
+      bRet = CopyDriversToWindowsDir();
       ASSERT( bRet );
 
-      if ( bRet ) {
-         // copy transport and communication drivers to Windows directory.
-         bRet = CopyDriversToWindowsDir();
+      if ( bRet ) {  
+         // activate driver. the channels are named after the driver instance, so they're created next.
+         BOOL bRet = ActivateDriver();
          ASSERT( bRet );
 
-         if ( bRet ) {  
-            // activate driver.
-            BOOL bRet = ActivateDriver();
+         if ( bRet ) {
+            // the handshake events are named after the driver instance too.
+            bRet = OpenHandshakeEvents( g_dwInstance );
+            ASSERT( bRet );
+         } else {
+            nRet = ERROR_ACTIVATE_DRIVER;
+         }
+
+         if ( bRet ) {
+            // the working thread of a session not uninitialized must not outlive its channels.
+            StopWorkingThread();
+
+            // create messages queues to communicate with.
+            g_dwQueueDepth = ReadMsgQueueDepth( REG_KEY_NAME );
+            ResetResultSeqs();
+            bRet = CreateMsgQueues( g_channels, g_dwInstance, g_dwQueueDepth, ReadMsgTransport( REG_KEY_NAME ) );
             ASSERT( bRet );
 
             if ( bRet ) {
@@ -770,17 +1334,20 @@ BOOL Initialize()
                   IFDBG( DebugOut( DEBUG_OUTPUT, L"CreateThread GetLastError: 0x%08x\n", GetLastError() ) );
                   return nRet;
                }
+
+               // let the transport open the driver. see bthemul.cxx::HCI_OpenConnection
+               SetEvent( g_hReadyEvent );
             } else {
-               nRet = ERROR_ACTIVATE_DRIVER;
+               nRet = ERROR_CREATE_MSG_QUEUES;
             }
-         } else {
-            nRet = ERROR_COPY_DRIVERS;
+         } else if ( !nRet ) {
+            nRet = ERROR_CREATE_EVENT;
          }
       } else {
-         nRet = ERROR_PRIVISION_DEVICE;
+         nRet = ERROR_COPY_DRIVERS;
       }      
    } else {
-      nRet = ERROR_CREATE_MSG_QUEUES;
+      nRet = ERROR_PRIVISION_DEVICE;
    }
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-Initialize ret: %d\n", nRet ) );
@@ -794,24 +1361,56 @@ BOOL Initialize()
 BOOL Uninitialize()
 {   
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+Uninitialize\n" ) );
-   
-   // close messages queues.
-   BOOL bRet = CloseMsgQueue( g_hWriteQueue );
-   ASSERT( bRet );
-   g_hWriteQueue = NULL;
 
-   bRet = CloseMsgQueue( g_hReadQueue );
-   ASSERT( bRet );
-   g_hReadQueue = NULL;
+   // the transport must not open the driver that goes away.
+   if ( g_hReadyEvent ) {
+      ResetEvent( g_hReadyEvent );
+   }
 
-   bRet = CloseMsgQueue( g_hErrorQueue );
-   ASSERT( bRet );
-   g_hErrorQueue = NULL;
+   // the working thread waits on the channels, it's stopped before they're closed.
+   StopWorkingThread();
+   
+   // close messages queues.
+   CloseMsgQueues( g_channels );
 
    // deactivate driver.
-   bRet = DeactivateDriver();
+   BOOL bRet = DeactivateDriver();
    ASSERT( bRet );
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-Uninitialize ret: %d\n", bRet ) );
    return bRet;
+}
+
+/**
+@func BOOL | OpenHandshakeEvents | Creates the handshake events of the driver instance, shared with the HCI transport.
+@parm DWORD | dwInstance | Driver instance number, the index of the BTE device.
+@rdesc The function should return a value that indicates its success or failure. 
+*/
+BOOL OpenHandshakeEvents( DWORD dwInstance )
+{
+   CloseHandshakeEvents();
+
+   TCHAR szName[MAX_PATH];
+   _stprintf( szName, _T("%s-%lu"), READY_EVENT_NAME, dwInstance );
+   g_hReadyEvent = CreateEvent( NULL, TRUE, FALSE, szName );
+   _stprintf( szName, _T("%s-%lu"), CLOSED_EVENT_NAME, dwInstance );
+   g_hClosedEvent = CreateEvent( NULL, TRUE, TRUE, szName );
+
+   return ( g_hReadyEvent && g_hClosedEvent );
+}
+
+/**
+@func void | CloseHandshakeEvents | Closes the handshake events.
+*/
+void CloseHandshakeEvents()
+{
+   if ( g_hReadyEvent ) {
+      CloseHandle( g_hReadyEvent );
+      g_hReadyEvent = NULL;
+   }
+
+   if ( g_hClosedEvent ) {
+      CloseHandle( g_hClosedEvent );
+      g_hClosedEvent = NULL;
+   }
 }
\ No newline at end of file
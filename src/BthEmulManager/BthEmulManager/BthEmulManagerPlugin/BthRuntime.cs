@@ -64,7 +64,8 @@ namespace BthEmul
     {
         HCI_DATA_PACKET = 0,
         HCI_DATA_ERROR_PACKET,
-        MESSAGE_PACKET
+        MESSAGE_PACKET,
+        HCI_DATA_BATCH_PACKET   // device message queue only.
     };
 
     // messages ids for PACKET_TYPE::MESSAGE_PACKET
@@ -102,6 +103,12 @@ namespace BthEmul
         [DllImport("fbtrt.dll", SetLastError = true)]
         private static extern int GetManufacturerName(ushort manufacturer, IntPtr pBuffer, uint bufferLen);
 
+        [DllImport("fbtrt.dll", SetLastError = true)]
+        public static extern int GetAclMtu(int devId, ref uint aclMtu);
+
+        [DllImport("fbtrt.dll", SetLastError = true)]
+        public static extern int SetRelayMtu(int devId, uint relayMtu);
+
         public delegate int HciEventListenerDelegate(IntPtr pEventBuf, uint eventLen);
 
         [DllImport("fbtrt.dll", SetLastError = true)]
@@ -171,6 +171,20 @@ namespace BthEmul
             }            
         }
 
+        private void SendInitialize()
+        {
+            // the agent negotiates the relay MTU from the controller's one.
+            uint aclMtu = 0;
+            if (BthRuntime.INVALID_DEVICE_ID != devId)
+                BthRuntime.GetAclMtu(devId, ref aclMtu);
+
+            CommandPacket cmd = new CommandPacket();
+            cmd.CommandId = (uint)PACKET_TYPE.MESSAGE_PACKET;
+            cmd.AddParameterDWORD((uint)MESSAGE_ID.AGENT_INITIALIZE_MSG);
+            cmd.AddParameterDWORD(aclMtu);
+            SendCommand(cmd);
+        }
+
         private void SendDeviceLogging()
         {
             CommandPacket cmd = new CommandPacket();
@@ -315,17 +329,19 @@ namespace BthEmul
                         switch (msgId)
                         {
                             case MESSAGE_ID.AGENT_ACK_MSG:
-                                cmd.AddParameterDWORD((uint)MESSAGE_ID.AGENT_INITIALIZE_MSG);
-                                SendCommand(cmd);        
+                                SendInitialize();
                                 break;
 
                             case MESSAGE_ID.AGENT_INITIALIZE_MSG:
+                                // the larger packets from the controller are fragmented to the negotiated MTU.
+                                uint relayMtu = commandPacket.GetParameterDWORD();
+                                if (BthRuntime.INVALID_DEVICE_ID != devId)
+                                    BthRuntime.SetRelayMtu(devId, relayMtu);
                                 SendDeviceLogging();
                                 break;
 
                             case MESSAGE_ID.AGENT_UNINITIALIZE_MSG:
-                                cmd.AddParameterDWORD((uint)MESSAGE_ID.AGENT_INITIALIZE_MSG);
-                                SendCommand(cmd);
+                                SendInitialize();
                                 break;
 
                             case MESSAGE_ID.AGENT_LOGGING_ON_MSG:
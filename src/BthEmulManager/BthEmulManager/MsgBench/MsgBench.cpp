@@ -0,0 +1,332 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmark of the message queue serialization. Encodes and decodes the HCI
+// frames the way the driver and the agent do and writes the throughput as
+// key=value lines, one line per case, so the results can be compared by scripts.
+// The H4 deframer checks run first and write a check=name result=ok|fail line each.
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include "MsgQueueDef.h"
+#include "H4Deframer.h"
+
+#define BENCH_DEFAULT_OUTPUT     L"\\Temp\\MsgBench.txt"
+#define BENCH_MIN_DURATION       1000     // ms each case runs at least.
+#define BENCH_ROUND_FRAMES       1024     // frames between the clock reads.
+
+// frame sizes of the mix: HCI command header, the largest HCI event and an ACL frame
+// of FBT_HCI_DATA_MAX_SIZE. the mix case cycles through all of them.
+const size_t g_frameSizes[] = { 4, 257, 1024 };
+#define BENCH_FRAME_SIZES        ( sizeof( g_frameSizes ) / sizeof( g_frameSizes[0] ) )
+
+unsigned char g_frame[1024];
+unsigned char g_buffer[MSG_BUFFER_SIZE];
+volatile DWORD g_dwSink = 0;   // keeps the decoded data alive for the optimizer.
+
+#define DEFRAMER_MAX_FRAME       64       // small, so the garbage ACL lengths below exceed it.
+#define DEFRAMER_BUFFER_SIZE     128
+
+// H4 stream of the deframer checks: a command, an event with parameters and an ACL frame.
+const unsigned char g_h4Frames[] = {
+   H4_COMMAND_PACKET, 0x03, 0x0c, 0x00,
+   H4_EVENT_PACKET, 0x0e, 0x04, 0x01, 0x03, 0x0c, 0x00,
+   H4_ACL_DATA_PACKET, 0x01, 0x20, 0x05, 0x00, 0x10, 0x11, 0x12, 0x13, 0x14
+};
+const size_t g_h4FrameSizes[] = { 4, 7, 10 };
+#define DEFRAMER_FRAMES          ( sizeof( g_h4FrameSizes ) / sizeof( g_h4FrameSizes[0] ) )
+
+// garbage put before every frame by the resync check: bytes that can't start a frame
+// and an ACL header whose length, taken from the next frame, exceeds DEFRAMER_MAX_FRAME.
+const unsigned char g_h4Garbage[] = { 0x00, 0xff, H4_ACL_DATA_PACKET, 0xff, 0xff };
+
+typedef size_t ( *BENCH_ROUND )( const size_t* pSizes, size_t count );
+
+/**
+@func void | EncodeDataRound | Encodes BENCH_ROUND_FRAMES frames as HCI_DATA_PACKET messages.
+@parm const size_t* | pSizes | Frame sizes to cycle through.
+@parm size_t | count | Number of the sizes.
+@rdesc Returns the number of the frame bytes.
+*/
+size_t EncodeDataRound( const size_t* pSizes, size_t count )
+{
+   size_t bytes = 0;
+   for ( int i = 0; i < BENCH_ROUND_FRAMES; ++i ) {
+      size_t size = pSizes[i % count];
+      size_t header = HciDataMsg::encodeHeader( g_buffer, size, i );
+      memcpy( g_buffer + header, g_frame, size );
+      bytes += size;
+   }
+   g_dwSink += g_buffer[0];
+   return bytes;
+}
+
+/**
+@func void | DecodeDataRound | Decodes BENCH_ROUND_FRAMES HCI_DATA_PACKET messages in place.
+@parm const size_t* | pSizes | Frame sizes to cycle through.
+@parm size_t | count | Number of the sizes.
+@rdesc Returns the number of the frame bytes.
+*/
+size_t DecodeDataRound( const size_t* pSizes, size_t count )
+{
+   size_t bytes = 0;
+   size_t length = 0;
+   for ( int i = 0; i < BENCH_ROUND_FRAMES; ++i ) {
+      size_t size = pSizes[i % count];
+      // the header is re-encoded to get the decoded length right, it's a few stores.
+      size_t header = HciDataMsg::encodeHeader( g_buffer, size, i );
+      const unsigned char* pData = HciDataMsg::decode( g_buffer, header + size, length );
+      if ( pData ) {
+         g_dwSink += pData[length - 1];
+         bytes += length;
+      }
+   }
+   return bytes;
+}
+
+/**
+@func void | WriteBatchRound | Appends BENCH_ROUND_FRAMES frames to HCI_DATA_BATCH_PACKET messages, a full message is started again.
+@parm const size_t* | pSizes | Frame sizes to cycle through.
+@parm size_t | count | Number of the sizes.
+@rdesc Returns the number of the frame bytes.
+*/
+size_t WriteBatchRound( const size_t* pSizes, size_t count )
+{
+   size_t bytes = 0;
+   HciBatchWriter batch( g_buffer, sizeof( g_buffer ) );
+   for ( int i = 0; i < BENCH_ROUND_FRAMES; ++i ) {
+      size_t size = pSizes[i % count];
+      if ( !batch.append( g_frame, size ) ) {
+         g_dwSink += batch.count();
+         batch.reset();
+         batch.append( g_frame, size );
+      }
+      bytes += size;
+   }
+   g_dwSink += batch.count();
+   return bytes;
+}
+
+/**
+@func void | ReadBatchRound | Reads BENCH_ROUND_FRAMES frames from HCI_DATA_BATCH_PACKET messages in place.
+@parm const size_t* | pSizes | Frame sizes to cycle through.
+@parm size_t | count | Number of the sizes.
+@rdesc Returns the number of the frame bytes.
+*/
+size_t ReadBatchRound( const size_t* pSizes, size_t count )
+{
+   // the batch is written once per round, its frames are read again until the round is done.
+   HciBatchWriter batch( g_buffer, sizeof( g_buffer ) );
+   for ( size_t i = 0; batch.append( g_frame, pSizes[i % count] ); ++i ) {
+   }
+
+   HciBatchReader reader;
+   size_t bytes = 0;
+   int frames = 0;
+   while ( frames < BENCH_ROUND_FRAMES ) {
+      reader.attach( batch.data(), batch.length() );
+      size_t length = 0;
+      const unsigned char* pData = NULL;
+      while ( frames < BENCH_ROUND_FRAMES && NULL != ( pData = reader.next( length ) ) ) {
+         g_dwSink += pData[length - 1];
+         bytes += length;
+         ++frames;
+      }
+   }
+   return bytes;
+}
+
+/**
+@func bool | DeframeStream | Feeds the stream to H4Deframer in chunks and compares the frames it returns with g_h4Frames.
+@parm const unsigned char* | pStream | H4 stream.
+@parm size_t | size | Stream size.
+@parm size_t | chunk | Number of the bytes committed at a time, the frames are split across the chunks.
+@parm size_t | skipped | Number of the garbage bytes in the stream.
+@rdesc Returns true if all the frames came out intact and exactly the garbage bytes were skipped.
+*/
+bool DeframeStream( const unsigned char* pStream, size_t size, size_t chunk, size_t skipped )
+{
+   unsigned char buffer[DEFRAMER_BUFFER_SIZE];
+   H4Deframer deframer( buffer, sizeof( buffer ), DEFRAMER_MAX_FRAME,
+      H4Deframer::typeBit( H4_COMMAND_PACKET ) | H4Deframer::typeBit( H4_ACL_DATA_PACKET ) |
+      H4Deframer::typeBit( H4_SCO_DATA_PACKET ) | H4Deframer::typeBit( H4_EVENT_PACKET ) );
+
+   size_t pos = 0;
+   size_t frames = 0;
+   size_t offset = 0;
+   while ( pos < size ) {
+      size_t room = 0;
+      unsigned char* pWrite = deframer.GetWriteBuffer( room );
+      size_t length = size - pos;
+      if ( length > chunk ) {
+         length = chunk;
+      }
+      if ( length > room ) {
+         length = room;
+      }
+      memcpy( pWrite, pStream + pos, length );
+      deframer.Commit( length );
+      pos += length;
+
+      size_t frameSize = 0;
+      const unsigned char* pFrame = NULL;
+      while ( NULL != ( pFrame = deframer.Next( frameSize ) ) ) {
+         if ( frames >= DEFRAMER_FRAMES || frameSize != g_h4FrameSizes[frames] ||
+              0 != memcmp( pFrame, g_h4Frames + offset, frameSize ) ) {
+            return false;
+         }
+         offset += frameSize;
+         ++frames;
+      }
+   }
+   return DEFRAMER_FRAMES == frames && skipped == deframer.GetSkipped() && 0 == deframer.GetPending();
+}
+
+/**
+@func int | RunDeframerChecks | Checks that H4Deframer puts together the frames split across the reads and resyncs on garbage, for every chunk size.
+@parm FILE* | pFile | Output file.
+@rdesc Returns the number of the failed checks.
+*/
+int RunDeframerChecks( FILE* pFile )
+{
+   unsigned char stream[sizeof( g_h4Frames ) + DEFRAMER_FRAMES * sizeof( g_h4Garbage )];
+   size_t size = 0;
+   size_t offset = 0;
+   for ( size_t i = 0; i < DEFRAMER_FRAMES; ++i ) {
+      memcpy( stream + size, g_h4Garbage, sizeof( g_h4Garbage ) );
+      size += sizeof( g_h4Garbage );
+      memcpy( stream + size, g_h4Frames + offset, g_h4FrameSizes[i] );
+      size += g_h4FrameSizes[i];
+      offset += g_h4FrameSizes[i];
+   }
+
+   struct DEFRAMER_CHECK {
+      LPCSTR szName;
+      const unsigned char* pStream;
+      size_t size;
+      size_t skipped;
+   };
+   const DEFRAMER_CHECK checks[] = {
+      { "deframer_split", g_h4Frames, sizeof( g_h4Frames ), 0 },
+      { "deframer_resync", stream, size, DEFRAMER_FRAMES * sizeof( g_h4Garbage ) }
+   };
+
+   int failed = 0;
+   for ( size_t c = 0; c < sizeof( checks ) / sizeof( checks[0] ); ++c ) {
+      // chunk sizes from a byte at a time to the whole stream at once.
+      size_t chunk = 1;
+      for ( ; chunk <= checks[c].size; ++chunk ) {
+         if ( !DeframeStream( checks[c].pStream, checks[c].size, chunk, checks[c].skipped ) ) {
+            break;
+         }
+      }
+      bool ok = chunk > checks[c].size;
+      fprintf( pFile, "check=%s frames=%u skipped=%u result=%s",
+         checks[c].szName, (unsigned int)DEFRAMER_FRAMES, (unsigned int)checks[c].skipped, ok ? "ok" : "fail" );
+      if ( !ok ) {
+         fprintf( pFile, " chunk=%u", (unsigned int)chunk );
+         ++failed;
+      }
+      fprintf( pFile, "\n" );
+      fflush( pFile );
+   }
+   return failed;
+}
+
+/**
+@func void | RunCase | Runs the round until BENCH_MIN_DURATION ms pass and writes the result line.
+@parm FILE* | pFile | Output file.
+@parm LPCSTR | szName | Case name.
+@parm BENCH_ROUND | pfnRound | Round function.
+@parm LPCSTR | szMix | Frame mix name.
+@parm const size_t* | pSizes | Frame sizes to cycle through.
+@parm size_t | count | Number of the sizes.
+*/
+void RunCase( FILE* pFile, LPCSTR szName, BENCH_ROUND pfnRound, LPCSTR szMix, const size_t* pSizes, size_t count )
+{
+   // warm up the caches.
+   pfnRound( pSizes, count );
+
+   double bytes = 0;
+   LARGE_INTEGER freq, start, now;
+   QueryPerformanceFrequency( &freq );
+   QueryPerformanceCounter( &start );
+
+   DWORD dwRounds = 0;
+   double elapsed = 0;
+   do {
+      bytes += pfnRound( pSizes, count );
+      ++dwRounds;
+      QueryPerformanceCounter( &now );
+      elapsed = (double)( now.QuadPart - start.QuadPart ) / freq.QuadPart;
+   } while ( elapsed * 1000 < BENCH_MIN_DURATION );
+
+   double frames = (double)dwRounds * BENCH_ROUND_FRAMES;
+
+   fprintf( pFile, "bench=%s mix=%s wire=%d frames=%.0f elapsed_ms=%.1f frames_per_sec=%.0f ns_per_frame=%.1f mb_per_sec=%.2f\n",
+      szName, szMix, WireCodec::VERSION, frames, elapsed * 1000, frames / elapsed, elapsed * 1e9 / frames, bytes / elapsed / ( 1024 * 1024 ) );
+   fflush( pFile );
+}
+
+/**
+@func int | WinMain | This function is called by the system as the initial entry point for Windows CE-based applications.
+@parm HINSTANCE | hInstance | Handle to the current instance of the application.
+@parm HINSTANCE | hPrevInstance | Handle to the previous instance of the application. For a Win32-based application, this parameter is always NULL.
+@parm LPTSTR | lpCmdLine | Output file name, BENCH_DEFAULT_OUTPUT if it's empty.
+@parm int | nCmdShow | Specifies how the window is to be shown.
+@rdesc Returns zero on success, -1 if the output file can't be opened or -2 if a deframer check failed.
+*/
+int WINAPI WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLine, int nCmdShow )
+{
+   LPCTSTR szOutput = ( lpCmdLine && lpCmdLine[0] ) ? lpCmdLine : BENCH_DEFAULT_OUTPUT;
+   FILE* pFile = _tfopen( szOutput, _T("w") );
+   if ( !pFile ) {
+      return -1;
+   }
+
+   int failed = RunDeframerChecks( pFile );
+
+   for ( size_t i = 0; i < sizeof( g_frame ); ++i ) {
+      g_frame[i] = (unsigned char)i;
+   }
+
+   struct BENCH_CASE {
+      LPCSTR szName;
+      BENCH_ROUND pfnRound;
+   };
+   const BENCH_CASE cases[] = {
+      { "data_encode", EncodeDataRound },
+      { "data_decode", DecodeDataRound },
+      { "batch_write", WriteBatchRound },
+      { "batch_read", ReadBatchRound }
+   };
+
+   for ( size_t c = 0; c < sizeof( cases ) / sizeof( cases[0] ); ++c ) {
+      for ( size_t i = 0; i < BENCH_FRAME_SIZES; ++i ) {
+         char szMix[16];
+         sprintf( szMix, "%u", (unsigned int)g_frameSizes[i] );
+         RunCase( pFile, cases[c].szName, cases[c].pfnRound, szMix, &g_frameSizes[i], 1 );
+      }
+      RunCase( pFile, cases[c].szName, cases[c].pfnRound, "mix", g_frameSizes, BENCH_FRAME_SIZES );
+   }
+
+   fclose( pFile );
+   return failed ? -2 : 0;
+}
@@ -23,22 +23,59 @@
 #include <bt_buffer.h>
 #include <bt_hcip.h>
 #include <Pkfuncs.h>
+#include "Transport.h"
+#include "H4Deframer.h"
+#include "ByteRing.h"
+#include "MsgQueueDef.h"
+#include "..\bthemulcom\bthemulcom.h"
 
-static HANDLE g_hFile = INVALID_HANDLE_VALUE;
-static HANDLE g_hWriteEvent = NULL;
-static HANDLE g_hReadEvent = NULL;
+static FileTransport g_port;
 static HCI_TransportCallback g_pfCallback = NULL;
 
 #define PACKET_SIZE_R       (4096)
 #define PACKET_SIZE_W       (4096)
 
+// with the ACL MTU negotiated the packets are sized after it, but never below the largest
+// SCO packet. the events are smaller.
+#define ACL_HEADER_SIZE     4
+#define MIN_PACKET_SIZE     ( 3 + 255 )
+
 #define DEFAULT_BTE_NAME    L"BTE1:"
 
+// the port is read in large chunks, the frames are split from the chunks by the deframer.
+// the buffer holds two largest frames, so a whole frame is read behind a partial one.
+#define MAX_FRAME_SIZE      ( 1 + 4 + PACKET_SIZE_R )
+static unsigned char g_readBuffer[2 * MAX_FRAME_SIZE];
+static H4Deframer g_deframer( g_readBuffer, sizeof( g_readBuffer ), MAX_FRAME_SIZE,
+   H4Deframer::typeBit( H4_ACL_DATA_PACKET ) | H4Deframer::typeBit( H4_SCO_DATA_PACKET ) | H4Deframer::typeBit( H4_EVENT_PACKET ) );
+
 #define READ_BUFFER_HEADER    4
 #define READ_BUFFER_TRAILER   0
 #define WRITE_BUFFER_HEADER   4
 #define WRITE_BUFFER_TRAILER  0
 
+// HCI_WritePacket copies the frames to the write queue and returns, the write thread writes
+// them to the port. the queue is bounded, the stack waits only when it's full. a failed write
+// is reported with DEVICE_ERROR and fails the next HCI_WritePacket.
+#define WRITE_QUEUE_SIZE    ( 16 * 1024 )
+// the write in progress is aborted when the connection is closed, it ends within the write
+// timeout of the port anyway.
+#define WRITE_THREAD_STOP_TIMEOUT   5000
+static unsigned char g_writeQueueBuffer[WRITE_QUEUE_SIZE];
+static ByteRing g_writeQueue( g_writeQueueBuffer, sizeof( g_writeQueueBuffer ) );
+static unsigned char g_writeBuffer[1 + PACKET_SIZE_W];   // the frame taken from the queue.
+static CRITICAL_SECTION g_writeSection;      // serializes the producers of the write queue.
+static HANDLE g_hStopEvent = NULL;
+static HANDLE g_hWriteThread = NULL;
+static DWORD g_dwWriteThreadId = 0;
+static LONG g_lWriteError = ERROR_SUCCESS;
+static DWORD WINAPI WriteThread( LPVOID lpParam );
+static BOOL StopWriteThread();
+static DWORD g_dwInstance = 0;   // index of the BTE device opened, the handshake events are named after it.
+static DWORD GetPortInstance( LPCWSTR szPortName );
+static BOOL WaitForAgent();
+static void SetConnectionClosed( BOOL bClosed );
+
 #ifndef _countof
 #define _countof(array) (sizeof(array)/sizeof(array[0]))
 #endif
@@ -61,9 +98,11 @@ BOOL APIENTRY DllMain( HANDLE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 		DebugInit();
 		IFDBG( DebugOut( DEBUG_OUTPUT, L"DllMain: DLL_PROCESS_ATTACH\n" ) );
 		DisableThreadLibraryCalls( (HMODULE)hModule );
+		InitializeCriticalSection( &g_writeSection );
 		break;
 	case DLL_PROCESS_DETACH:
 		IFDBG( DebugOut( DEBUG_OUTPUT, L"DllMain: DLL_PROCESS_DETACH\n" ) );
+		DeleteCriticalSection( &g_writeSection );
 		DebugDeInit();		
 		break;
 	}
@@ -121,6 +160,15 @@ int HCI_ReadHciParameters( HCI_PARAMETERS* pParms )
     pParms->iWriteBufferTrailer     = WRITE_BUFFER_TRAILER;
     pParms->uiFlags                 = 0;
 
+    // the registry settings below still override the negotiated sizes.
+    DWORD dwAclMtu = ReadMsgAclMtu( REG_KEY_NAME );
+    if ( dwAclMtu ) {
+       int iPacketSize = max( (int)( ACL_HEADER_SIZE + dwAclMtu ), MIN_PACKET_SIZE );
+       pParms->iMaxSizeRead = min( iPacketSize, PACKET_SIZE_R );
+       pParms->iMaxSizeWrite = min( iPacketSize, PACKET_SIZE_W );
+       IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadHciParameters ACL MTU: %d, packet size: %d\n", dwAclMtu, iPacketSize ) );
+    }
+
     HKEY hk;
      if ( RegOpenKeyEx( HKEY_LOCAL_MACHINE, L"Software\\Microsoft\\Bluetooth\\hci", 0, KEY_READ, &hk ) == ERROR_SUCCESS ) { 
         DWORD dwType = 0;
@@ -239,7 +287,7 @@ int HCI_StartHardware()
 {
     IFDBG( DebugOut( DEBUG_OUTPUT, L"+HCI_StartHardware\n" ) );
     
-    if ( g_hFile != INVALID_HANDLE_VALUE ) {
+    if ( g_port.IsOpen() ) {
         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_StartHardware (already started)\n" ) );
         return TRUE;
     }
@@ -262,7 +310,7 @@ int HCI_StopHardware()
 {
     IFDBG( DebugOut( DEBUG_OUTPUT, L"+HCI_StopHardware\n" ) );
     
-    if ( g_hFile == INVALID_HANDLE_VALUE ) {
+    if ( !g_port.IsOpen() ) {
         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_StopHardware (already stopped)\n" ) );
         return TRUE;
     }
@@ -285,17 +333,21 @@ int HCI_OpenConnection()
 {
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+HCI_OpenConnection\n" ) );
 
-   // sleep a little. see async.cpp::Initialize
-   Sleep( 500 );
-
    int nRet = TRUE;
 
-   if ( g_hFile != INVALID_HANDLE_VALUE ) {
+   if ( g_port.IsOpen() ) {
 		nRet = FALSE;
 		IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
 		return nRet;
    }
 
+   // the write thread of the previous connection may have not stopped in time.
+   if ( !StopWriteThread() ) {
+      nRet = FALSE;
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
+      return nRet;
+   }
+
    WCHAR szPortName[_MAX_PATH];
    wcscpy( szPortName, DEFAULT_BTE_NAME );
 
@@ -321,30 +373,32 @@ int HCI_OpenConnection()
       RegCloseKey( hk );
    }
 
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"Opening port %s (rate %d) for I/O with unit\n", szPortName, dwBaud ) );
+   // wait until the agent has the driver and its channels up. see AgentAsync.cpp::Initialize
+   g_dwInstance = GetPortInstance( szPortName );
+   if ( !WaitForAgent() ) {
+      nRet = FALSE;
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Agent isn't ready: 0x%08x\n", GetLastError() ) );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
+      return nRet;
+   }
 
-   g_hFile = CreateFile( szPortName,
-      GENERIC_READ | GENERIC_WRITE,
-      0,                            // comm devices must be opened w/exclusive-access
-      NULL,                         // no security attrs
-      OPEN_EXISTING,                // comm devices must use OPEN_EXISTING
-      FILE_ATTRIBUTE_NORMAL,        // overlapped I/O 
-      NULL                          // hTemplate must be NULL for comm devices  
-      );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"Opening port %s (rate %d) for I/O with unit\n", szPortName, dwBaud ) );
 
-   if ( g_hFile == INVALID_HANDLE_VALUE ) {
+   if ( !g_port.Open( szPortName ) ) {
       nRet = FALSE;
       IFDBG( DebugOut( DEBUG_OUTPUT, L"CreateFile ret: 0x%08x\n", GetLastError() ) );
 	   IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
 	   return nRet;
    }
 
+   // the data of the previous connection isn't used.
+   g_deframer.Reset();
+
    // purge any information in the buffer
-   if ( !PurgeComm( g_hFile, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR ) ) {
+   if ( !PurgeComm( g_port.GetHandle(), PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR ) ) {
       nRet = FALSE;
       IFDBG( DebugOut( DEBUG_OUTPUT, L"PurgeComm ret: 0x%08x\n", GetLastError() ) );
-      CloseHandle( g_hFile );
-      g_hFile = INVALID_HANDLE_VALUE;
+      g_port.Close();
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
       return nRet;
    }
@@ -352,7 +406,7 @@ int HCI_OpenConnection()
    /* 2009-04-13 Dm.Klionsky 
    Commented out the following calls. The default COM port values should be all rights.
 
-   if ( !SetupComm( g_hFile, 20000, 20000 ) ) {
+   if ( !SetupComm( g_port.GetHandle(), 20000, 20000 ) ) {
       // Ignore this failure
       IFDBG( DebugOut( DEBUG_OUTPUT, L"SetupComm ret: 0x%08x\n", GetLastError() ) );
    }
@@ -364,11 +418,10 @@ int HCI_OpenConnection()
    commTimeOuts.WriteTotalTimeoutMultiplier = 0;
    commTimeOuts.WriteTotalTimeoutConstant = 1000;
 
-   if ( !SetCommTimeouts( g_hFile, &commTimeOuts ) ) {
+   if ( !SetCommTimeouts( g_port.GetHandle(), &commTimeOuts ) ) {
       nRet = FALSE;
       IFDBG( DebugOut( DEBUG_OUTPUT, L"SetCommTimeouts ret: 0x%08x\n", GetLastError() ) );
-      CloseHandle( g_hFile );
-      g_hFile = INVALID_HANDLE_VALUE;
+      g_port.Close();
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
       return nRet;
    }
@@ -398,18 +451,33 @@ int HCI_OpenConnection()
    dcb.XonLim = 3000;
    dcb.XoffLim = 9000;
 
-   if ( !SetCommState( g_hFile, &dcb ) ) {
+   if ( !SetCommState( g_port.GetHandle(), &dcb ) ) {
       nRet = FALSE;
       IFDBG( DebugOut( DEBUG_OUTPUT, L"SetCommState ret: 0x%08x\n", GetLastError() ) );
-      CloseHandle( g_hFile );
-      g_hFile = INVALID_HANDLE_VALUE;
+      g_port.Close();
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
       return nRet;
    }
    */
 
-   g_hWriteEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
-   g_hReadEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+   // start the write thread.
+   g_writeQueue.Reset();
+   InterlockedExchange( &g_lWriteError, ERROR_SUCCESS );
+   g_hStopEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+   if ( !g_hStopEvent || !g_writeQueue.CreateEvents() ) {
+      nRet = FALSE;
+   } else {
+      g_hWriteThread = CreateThread( NULL, 0, WriteThread, NULL, 0, &g_dwWriteThreadId );
+      nRet = ( NULL != g_hWriteThread );
+   }
+
+   if ( !nRet ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"CreateThread ret: 0x%08x\n", GetLastError() ) );
+      StopWriteThread();
+      g_port.Close();
+   } else {
+      SetConnectionClosed( FALSE );
+   }
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_OpenConnection ret: %d\n", nRet ) );
    return nRet;
@@ -424,18 +492,22 @@ void HCI_CloseConnection()
 {
     IFDBG( DebugOut( DEBUG_OUTPUT, L"+HCI_CloseConnection\n" ) );
 
-    if ( g_hFile == INVALID_HANDLE_VALUE ) {
+    if ( !g_port.IsOpen() ) {
         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_CloseConnection - not active\n" ) );
         return;
     }
 
-    CloseHandle( g_hFile );
-    CloseHandle( g_hWriteEvent );
-    CloseHandle( g_hReadEvent );
+    // the write thread is stopped first, its pending write is aborted. the close aborts the
+    // read in progress, the port is closed when it returns.
+    StopWriteThread();
+    g_port.Close();
 
-    g_hFile = INVALID_HANDLE_VALUE;
-    g_hWriteEvent = NULL;
-    g_hReadEvent = NULL;    
+    // the agent may activate the next driver now, the driver has got the close.
+    if ( INVALID_HANDLE_VALUE == g_port.GetHandle() ) {
+        SetConnectionClosed( TRUE );
+    } else {
+        IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_CloseConnection - the read in progress hasn't returned\n" ) );
+    }
 
     IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_CloseConnection\n" ) );
 
@@ -446,50 +518,157 @@ static BOOL WriteCommPort( unsigned char* pBuffer, unsigned int cSize )
 {
    //IFDBG( DebugOut( DEBUG_OUTPUT, L"+WriteCommPort cSize: %d\n", cSize ) );
 
-   DWORD dwFilledSoFar = 0;
-   while ((int)dwFilledSoFar < cSize) {
-      DWORD dwWrit = 0;
-      if ( ( !WriteFile( g_hFile, &(pBuffer[dwFilledSoFar]), cSize - dwFilledSoFar, &dwWrit, NULL ) ) && ( dwWrit == 0 ) ) {
-         if ( g_hFile != INVALID_HANDLE_VALUE ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteFile ret: 0x%08x\n", GetLastError() ) );
-         }
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-WriteCommPort \n" ) );
-			return FALSE;
+   // the transport writes the whole buffer.
+   PacketSegment segment = { pBuffer, cSize };
+   if ( !g_port.Send( &segment, 1, INFINITE ) ) {
+      if ( g_port.IsOpen() ) {
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteFile ret: 0x%08x\n", GetLastError() ) );
       }
-
-      dwFilledSoFar += dwWrit;
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-WriteCommPort \n" ) );
+		return FALSE;
    }
 
    //IFDBG( DebugOut( DEBUG_OUTPUT, L"-WriteCommPort \n" ) );
 	return TRUE;
 }
 
-static BOOL ReadCommPort( unsigned char* pBuffer, DWORD dwLen )
+/**
+@func DWORD | WriteThread | Writes the frames queued by HCI_WritePacket to the port one by one.
+@parm LPVOID | lpParam | Not used.
+@rdesc The function should return a value that indicates its success or failure. 
+@remark A failed write stops the thread and is reported to the stack with DEVICE_ERROR.
+*/
+static DWORD WINAPI WriteThread( LPVOID lpParam )
 {
-   //IFDBG( DebugOut( DEBUG_OUTPUT, L"+ReadCommPort dwLen: %d\n", dwLen ) );
-	
-   DWORD dwFilledSoFar = 0;
-   while ( dwFilledSoFar < dwLen ) {
-      DWORD dwRead = 0;
-      if ( ( !ReadFile( g_hFile, &pBuffer[dwFilledSoFar], dwLen - dwFilledSoFar, &dwRead, NULL ) ) && ( dwRead == 0 ) ) {
-         if ( g_hFile != INVALID_HANDLE_VALUE ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadFile ret: 0x%08x\n", GetLastError() ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+WriteThread\n" ) );
+
+   DWORD dwRes = 0;
+   while ( g_writeQueue.WaitForData( g_hStopEvent, INFINITE ) ) {
+      // the frames are queued whole, so the rest of the frame is there with its size.
+      DWORD dwSize = 0;
+      if ( sizeof( dwSize ) != g_writeQueue.Read( &dwSize, sizeof( dwSize ) ) || dwSize > sizeof( g_writeBuffer ) ) {
+         InterlockedExchange( &g_lWriteError, ERROR_INVALID_DATA );
+         break;
+      }
+      g_writeQueue.Read( g_writeBuffer, dwSize );
+
+      if ( !WriteCommPort( g_writeBuffer, dwSize ) ) {
+         InterlockedExchange( &g_lWriteError, ERROR_WRITE_FAULT );
+         break;
+      }
+   }
+
+   // the failure is not reported if the connection is being closed.
+   if ( ERROR_SUCCESS != g_lWriteError && WAIT_OBJECT_0 != WaitForSingleObject( g_hStopEvent, 0 ) ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteThread - writing failed: %d\n", g_lWriteError ) );
+      if ( g_pfCallback ) {
+         g_pfCallback( DEVICE_ERROR, NULL );
+      }
+   }
+
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-WriteThread ret: %lu\n", dwRes ) ); 
+   return dwRes;
+}
+
+/**
+@func BOOL | StopWriteThread | Stops the write thread and drops the frames not written yet.
+@rdesc Returns FALSE if the thread didn't stop within WRITE_THREAD_STOP_TIMEOUT ms. It's left running with its events then and is waited for again by the next call.
+*/
+static BOOL StopWriteThread()
+{
+   if ( g_hStopEvent ) {
+      SetEvent( g_hStopEvent );
+   }
+
+   if ( g_hWriteThread ) {
+      // the stack may close the connection from the DEVICE_ERROR callback of the write thread.
+      if ( GetCurrentThreadId() != g_dwWriteThreadId ) {
+         // the driver ends the write waiting for the remote result.
+         if ( g_port.IsOpen() ) {
+            PurgeComm( g_port.GetHandle(), PURGE_TXABORT | PURGE_TXCLEAR );
          }
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-ReadCommPort \n" ) );
-			return FALSE;
-        }
-    dwFilledSoFar += dwRead;
-    }
+         if ( WAIT_OBJECT_0 != WaitForSingleObject( g_hWriteThread, WRITE_THREAD_STOP_TIMEOUT ) ) {
+            IFDBG( DebugOut( DEBUG_OUTPUT, L"StopWriteThread - the thread didn't stop\n" ) );
+            return FALSE;
+         }
+      }
+      CloseHandle( g_hWriteThread );
+      g_hWriteThread = NULL;
+      g_dwWriteThreadId = 0;
+   }
 
-   //IFDBG( DebugOut( DEBUG_OUTPUT, L"-ReadCommPort \n" ) );
-	return TRUE;
+   if ( g_hStopEvent ) {
+      CloseHandle( g_hStopEvent );
+      g_hStopEvent = NULL;
+   }
+
+   g_writeQueue.CloseEvents();
+   return TRUE;
+}
+
+/**
+@func DWORD | GetPortInstance | Returns the driver instance of the port, the index of the BTE device.
+@parm LPCWSTR | szPortName | Port name, e.g. BTE1:.
+@rdesc Returns 0 if the port is not a BTE device.
+*/
+static DWORD GetPortInstance( LPCWSTR szPortName )
+{
+   size_t prefix = wcslen( DEVICE_PREFIX );
+   if ( 0 != _wcsnicmp( szPortName, DEVICE_PREFIX, prefix ) ) {
+      return 0;
+   }
+   return (DWORD)_wtol( szPortName + prefix );
+}
+
+/**
+@func BOOL | WaitForAgent | Waits until the agent has the driver instance of the port and its channels up.
+@rdesc Returns TRUE if the agent is ready, FALSE if it didn't get ready within HANDSHAKE_TIMEOUT ms.
+*/
+static BOOL WaitForAgent()
+{
+   WCHAR szName[MAX_PATH];
+   _stprintf( szName, _T("%s-%lu"), READY_EVENT_NAME, g_dwInstance );
+   HANDLE hReadyEvent = CreateEvent( NULL, TRUE, FALSE, szName );
+   if ( !hReadyEvent ) {
+      return FALSE;
+   }
+
+   DWORD dwWait = WaitForSingleObject( hReadyEvent, HANDSHAKE_TIMEOUT );
+   CloseHandle( hReadyEvent );
+
+   if ( WAIT_TIMEOUT == dwWait ) {
+      SetLastError( ERROR_TIMEOUT );
+   }
+   return ( WAIT_OBJECT_0 == dwWait );
 }
 
 /**
-@func int | HCI_WritePacket | This function is called by HCI to write a packet. This function calls directly into the active transport driver.
+@func void | SetConnectionClosed | Tells the agent whether the transport has a connection open.
+@parm BOOL | bClosed | TRUE if the connection is closed.
+@rdesc None.
+*/
+static void SetConnectionClosed( BOOL bClosed )
+{
+   // the event lives while the agent holds it, so it's opened just for the update.
+   WCHAR szName[MAX_PATH];
+   _stprintf( szName, _T("%s-%lu"), CLOSED_EVENT_NAME, g_dwInstance );
+   HANDLE hClosedEvent = CreateEvent( NULL, TRUE, TRUE, szName );
+   if ( hClosedEvent ) {
+      if ( bClosed ) {
+         SetEvent( hClosedEvent );
+      } else {
+         ResetEvent( hClosedEvent );
+      }
+      CloseHandle( hClosedEvent );
+   }
+}
+
+/**
+@func int | HCI_WritePacket | This function is called by HCI to write a packet. The packet is queued and written by the write thread.
 @parm HCI_TYPE | peType | Defines the HCI type.
 @parm BD_BUFFER* | pBuff | Pointer to the Bluetooth device buffer.
 @rdesc TRUE on successful completion. FALSE if error has occurred. If this function returns FALSE, the stack interface to hardware will immediately be brought down by calling HCI_CloseConnection. 
+@remark The function waits only if the write queue is full. It fails if a previous write has failed.
 @remark Routine exported by a transport driver.
 */
 int HCI_WritePacket( HCI_TYPE eType, BD_BUFFER* pBuff ) 
@@ -504,19 +683,43 @@ int HCI_WritePacket( HCI_TYPE eType, BD_BUFFER* pBuff )
       return FALSE;
    }
 
-   if ( g_hFile == INVALID_HANDLE_VALUE ) {
+   if ( !g_port.IsOpen() ) {
       DebugOut( DEBUG_OUTPUT, L"HCI_WritePacket - not active\n" );
       return FALSE;
    }    
 
+   if ( ERROR_SUCCESS != g_lWriteError ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket - previous writing failed: %d\n", g_lWriteError ) );
+      return FALSE;
+   }
+
    pBuff->pBuffer[--pBuff->cStart] = (unsigned char)eType;
 
-   if ( !WriteCommPort(pBuff->pBuffer + pBuff->cStart, BufferTotal( pBuff ) ) ) {
-      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket - writing failed\n" ) );
+   // the write thread takes the frame to g_writeBuffer, a larger one would never be written.
+   DWORD dwSize = BufferTotal( pBuff );
+   if ( dwSize > sizeof( g_writeBuffer ) ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket - packet too big: %d\n", dwSize ) );
       return FALSE;
    }
 
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket : DONE type 0x%02x len %d\n", eType, BufferTotal(pBuff) ) );
+   // the stack reuses the buffer after the call, so the frame is copied to the queue with its
+   // size. both go straight from the stack's buffer.
+   PacketSegment segments[2] = {
+      { &dwSize, sizeof( dwSize ) },
+      { pBuff->pBuffer + pBuff->cStart, dwSize }
+   };
+   DWORD dwEntry = sizeof( dwSize ) + dwSize;
+
+   EnterCriticalSection( &g_writeSection );
+   BOOL bRet = g_writeQueue.WaitForSpace( dwEntry, g_hStopEvent, INFINITE ) && g_writeQueue.Write( segments, 2 );
+   LeaveCriticalSection( &g_writeSection );
+
+   if ( !bRet ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket - queueing failed\n" ) );
+      return FALSE;
+   }
+
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_WritePacket : QUEUED type 0x%02x len %d\n", eType, dwSize ) );
    return TRUE;
 }
 
@@ -525,18 +728,19 @@ int HCI_WritePacket( HCI_TYPE eType, BD_BUFFER* pBuff )
 @parm HCI_TYPE* | peType | Pointer to the HCI type. These values can be DATA_PACKET_ACL, DATA_PACKET_SCO, or EVENT_PACKET.
 @parm BD_BUFFER* | pBuff | Pointer to the packet buffer.
 @rdesc TRUE on successful completion. FALSE if error has occurred. If this function returns FALSE, the stack interface to hardware will immediately be brought down by calling HCI_CloseConnection. 
+@remark The frames are taken from the deframer, the port is read only when the deframer has no complete frame. The garbage in the stream is skipped.
 @remark Routine exported by a transport driver.  
 */
 int HCI_ReadPacket( HCI_TYPE* peType, BD_BUFFER* pBuff ) 
 {
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+HCI_ReadPacket\n" ) );
 
-   if ( g_hFile == INVALID_HANDLE_VALUE ) {
+   if ( !g_port.IsOpen() ) {
       IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - not active\n" ) );
       return FALSE;
    }
 
-   pBuff->cStart = 3;
+   pBuff->cStart = READ_BUFFER_HEADER;
    pBuff->cEnd = pBuff->cSize;
 
    if ( BufferTotal( pBuff ) < 257 ) {
@@ -544,113 +748,53 @@ int HCI_ReadPacket( HCI_TYPE* peType, BD_BUFFER* pBuff )
       return FALSE;
    }
 
-   if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart, 1 ) ) {
-      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - failed to read 1st byte\n" ) );
-      return FALSE;
-   }
-
-   ++pBuff->cStart;
-
-   switch ( pBuff->pBuffer[pBuff->cStart - 1] ) {   
-      case COMMAND_PACKET:    // Command packet
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - unexpected packet type: COMMAND_PACKET\n" ) );
-         break;
-
-      case DATA_PACKET_ACL:   // ACL packet
-         if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart, 4 ) ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: no data\n" ) );
-            return FALSE;
+   size_t skipped = g_deframer.GetSkipped();
+   size_t size = 0;
+   const unsigned char* pFrame = NULL;
+   while ( NULL == ( pFrame = g_deframer.Next( size ) ) ) {
+      // read as much as there is, the rest of the frames read are kept for the next calls.
+      size_t room = 0;
+      unsigned char* pChunk = g_deframer.GetWriteBuffer( room );
+      DWORD dwRead = 0;
+      if ( !g_port.Receive( pChunk, (DWORD)room, &dwRead, INFINITE ) ) {
+         if ( g_port.IsOpen() ) {
+            IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadFile ret: 0x%08x\n", GetLastError() ) );
+         } else if ( INVALID_HANDLE_VALUE == g_port.GetHandle() ) {
+            // the read has outlived HCI_CloseConnection and closed the port.
+            SetConnectionClosed( TRUE );
          }
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - failed: no data\n" ) );
+         return FALSE;
+      }
+      g_deframer.Commit( dwRead );
+   }
 
-         pBuff->cEnd = pBuff->cStart + 4 + (pBuff->pBuffer[pBuff->cStart + 2] | (pBuff->pBuffer[pBuff->cStart + 3] << 8 ) );
-
-         if( pBuff->cEnd > pBuff->cSize) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: buffer too small\n" ) );
-            return FALSE;
-         }
+   if ( g_deframer.GetSkipped() != skipped ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - skipped %d garbage bytes\n", g_deframer.GetSkipped() - skipped ) );
+   }
 
-         if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart + 4, BufferTotal( pBuff ) - 4 ) )
-            return FALSE;
+   // the packet type is returned apart, the buffer gets the rest of the frame.
+   pBuff->cEnd = pBuff->cStart + size - 1;
+   if ( pBuff->cEnd > pBuff->cSize ) {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - failed: buffer too small\n" ) );
+      return FALSE;
+   }
+   memcpy( pBuff->pBuffer + pBuff->cStart, pFrame + 1, size - 1 );
 
+   switch ( pFrame[0] ) {
+      case H4_ACL_DATA_PACKET:
          *peType = DATA_PACKET_ACL;
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"Packet received HCI_TYPE: 0x%02x\n", *peType ) );
-         IFDBG( DumpBuff( DEBUG_OUTPUT, pBuff->pBuffer + pBuff->cStart, BufferTotal( pBuff ) ) );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket\n" ) );
-         return TRUE;
-
-      case DATA_PACKET_SCO:   // SCO packet
-         if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart, 3 ) ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: no data\n" ) );
-            return FALSE;
-         }
-
-         pBuff->cEnd = pBuff->cStart + 3 + pBuff->pBuffer[pBuff->cStart + 2];
-
-         if( pBuff->cEnd > pBuff->cSize ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: buffer too small\n" ) );
-            return FALSE;
-         }
-
-         if( !ReadCommPort( pBuff->pBuffer + pBuff->cStart + 3, BufferTotal( pBuff ) - 3 ) ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: no data 2\n" ) );
-            return FALSE;
-         }
-
+         break;
+      case H4_SCO_DATA_PACKET:
          *peType = DATA_PACKET_SCO;
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"Packet received HCI_TYPE: 0x%02x\n", *peType ) );
-         IFDBG( DumpBuff( DEBUG_OUTPUT, pBuff->pBuffer + pBuff->cStart, BufferTotal( pBuff ) ) );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket\n" ) );
-         return TRUE;
-
-      case EVENT_PACKET:   // HCI Event         
-         if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart, 2 ) ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: no data\n" ) );
-            return FALSE;
-         }
-
-         pBuff->cEnd = pBuff->cStart + 2 + pBuff->pBuffer[pBuff->cStart + 1];
-
-         if ( pBuff->cEnd > pBuff->cSize ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: buffer too small\n" ) );
-            return FALSE;
-         }
-
-         if ( !ReadCommPort( pBuff->pBuffer + pBuff->cStart + 2, BufferTotal( pBuff ) - 2 ) ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"HCI_ReadPacket - failed: no data 2\n" ) );
-            return FALSE;
-         }
-
-         *peType = EVENT_PACKET;
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"Packet received HCI_TYPE: 0x%02x\n", *peType ) );
-         IFDBG( DumpBuff( DEBUG_OUTPUT, pBuff->pBuffer + pBuff->cStart, BufferTotal( pBuff ) ) );
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket\n" ) );
-         return TRUE;
-   }
-
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket - unknown packet type\n" ) );
-
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"Dumping the failing buffer...\n" ) );
-   unsigned char buff[128];
-   buff[0] = pBuff->pBuffer[pBuff->cStart - 1];
-   int buff_size = 128;
-   int buff_offset = 1;
-
-   while ( buff_offset < buff_size ) {
-      DWORD dwRead = 0;
-      if ( ( !ReadFile( g_hFile, &buff[buff_offset], buff_size - buff_offset, &dwRead, NULL ) ) && ( dwRead == 0 ) ) {
-         if( g_hFile != INVALID_HANDLE_VALUE ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadFile ret: 0x%08x\n", GetLastError() ) );
-         }
          break;
-      }
-
-      if ( dwRead == 0 )
+      default:
+         *peType = EVENT_PACKET;
          break;
-
-      buff_offset += dwRead;
    }
 
-   IFDBG( DumpBuff( DEBUG_OUTPUT, buff, buff_offset ) );
-
-   return FALSE;
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"Packet received HCI_TYPE: 0x%02x\n", *peType ) );
+   IFDBG( DumpBuff( DEBUG_OUTPUT, pBuff->pBuffer + pBuff->cStart, BufferTotal( pBuff ) ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-HCI_ReadPacket\n" ) );
+   return TRUE;
 }
\ No newline at end of file
@@ -25,6 +25,7 @@
 #include <svsutil.hxx>
 #include "bthemulcom.h"
 #include "MsgQueueDef.h"
+#include "ByteRing.h"
 
 extern "C" int svsutil_AssertBroken( TCHAR *lpszFile, int iLine ) { return 0; }
 
@@ -33,17 +34,124 @@ extern "C" int svsutil_AssertBroken( TCHAR *lpszFile, int iLine ) { return 0; }
 	#define DEBUGCHK    SVSUTIL_ASSERT
 #endif
 
-#define DEVICE_CONTEXT	0x1450
-#define OPEN_CONTEXT    0x1451
+#define BTE_CONTEXT_SIGNATURE    0x1450
+
+// HCI frames of the messages read ahead by the read thread, BTE_Read is served from there.
+#define READ_CACHE_SIZE    ( 16 * 1024 )
+#define READ_THREAD_RETRY_TIMEOUT   100
+C_ASSERT( READ_CACHE_SIZE >= 2 * MSG_BUFFER_SIZE );
+
+// the read timeouts until the application sets its own: wait for the first byte like the
+// blocking read always did.
+#define DEFAULT_READ_INTERVAL_TIMEOUT     MAXDWORD
+#define DEFAULT_READ_TOTAL_MULTIPLIER     MAXDWORD
+#define DEFAULT_READ_TOTAL_CONSTANT       MSG_QUEUE_READ_TIMEOUT
+
+// state of one driver instance. BTE_Init returns it as the device context and BTE_Open as
+// the open context, the instance can be opened once at a time. every instance has its own
+// channels, so several emulated adapters can run side by side.
+struct BTE_CONTEXT {
+   BTE_CONTEXT( DWORD dwInst ) : readCache( cache, sizeof( cache ) ) {
+      dwSignature = BTE_CONTEXT_SIGNATURE;
+      dwInstance = dwInst;
+      memset( &guidClass, 0, sizeof( guidClass ) );
+      _stprintf( szDeviceName, _T("%s%lu:"), DEVICE_PREFIX, dwInstance );
+      lOpened = FALSE;
+      hReadThread = NULL;
+      hQuitEvent = NULL;
+      dwWriteWindow = MSG_DEFAULT_WRITE_WINDOW;
+      dwWriteSeq = 0;
+      dwWriteAckSeq = 0;
+      dwWriteError = ERROR_SUCCESS;
+      hAbortEvent = NULL;
+      dwAbortGeneration = 0;
+      hReadAbortEvent = NULL;
+      dwReadAbortGeneration = 0;
+      InitializeCriticalSection( &csComm );
+      InitializeCriticalSection( &csWrite );
+      InitializeCriticalSection( &csRead );
+      dwCoalesceLanes = MSG_DEFAULT_COALESCE_LANES;
+      dwCoalesceDelay = MSG_DEFAULT_COALESCE_DELAY;
+      dwCoalesceSize = MSG_DEFAULT_COALESCE_SIZE;
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         batches[lane].attach( batchBuffers[lane], sizeof( batchBuffers[lane] ) );
+         dwBatchStart[lane] = 0;
+      }
+      hFlushEvent = NULL;
+      hFlushThread = NULL;
+      hCommEvent = NULL;
+      dwWaitMask = 0;
+      dwCommEvents = 0;
+      dwWaitGeneration = 0;
+      ResetTimeouts();
+   }
+
+   ~BTE_CONTEXT() {
+      DeleteCriticalSection( &csComm );
+      DeleteCriticalSection( &csWrite );
+      DeleteCriticalSection( &csRead );
+   }
+
+   void ResetTimeouts() {
+      memset( &timeouts, 0, sizeof( timeouts ) );
+      timeouts.ReadIntervalTimeout = DEFAULT_READ_INTERVAL_TIMEOUT;
+      timeouts.ReadTotalTimeoutMultiplier = DEFAULT_READ_TOTAL_MULTIPLIER;
+      timeouts.ReadTotalTimeoutConstant = DEFAULT_READ_TOTAL_CONSTANT;
+   }
+
+   DWORD dwSignature;
+   DWORD dwInstance;                      // index of the BTE device.
+   GUID guidClass;
+   TCHAR szDeviceName[MAX_PATH];
+   LONG lOpened;
+   MSG_CHANNELS channels;
+   HANDLE hReadThread;
+   HANDLE hQuitEvent;
+   unsigned char buffer[MSG_BUFFER_SIZE]; // the message read from the lanes by the read thread.
+   unsigned char cache[READ_CACHE_SIZE];
+   ByteRing readCache;
+   CRITICAL_SECTION csRead;               // guards the reading side of the read cache against PURGE_RXCLEAR.
+   HANDLE hReadAbortEvent;                // signaled when PURGE_RXABORT or the deinitialization ends the reads waiting for data.
+   DWORD dwReadAbortGeneration;           // changed by PURGE_RXABORT, the reads started before it are ended.
+   DWORD dwWriteWindow;
+   DWORD dwWriteSeq;                      // number of the last HCI frame written.
+   DWORD dwWriteAckSeq;                   // number of the last HCI frame the result has been received for.
+   DWORD dwWriteError;                    // the first failed result not reported yet.
+   HANDLE hAbortEvent;                    // signaled when PURGE_TXABORT ends the writes waiting for their results.
+   DWORD dwAbortGeneration;               // changed by PURGE_TXABORT, the writes started before it are ended.
+   CRITICAL_SECTION csComm;               // guards the wait mask, the comm events and the timeouts.
+   HANDLE hCommEvent;                     // signaled when a comm event occurs or the pending wait is cancelled.
+   volatile DWORD dwWaitMask;
+   DWORD dwCommEvents;                    // the events occurred and not reported yet.
+   DWORD dwWaitGeneration;                // changed to cancel the pending wait.
+   COMMTIMEOUTS timeouts;
+   DWORD dwCoalesceLanes;                 // lanes the written frames are coalesced on, a bit per MSG_LANE.
+   DWORD dwCoalesceDelay;
+   DWORD dwCoalesceSize;
+   CRITICAL_SECTION csWrite;              // guards the batches and the write sequence against the flush thread.
+   unsigned char batchBuffers[MSG_LANE_COUNT][MSG_BUFFER_SIZE];
+   HciBatchWriter batches[MSG_LANE_COUNT];
+   DWORD dwBatchStart[MSG_LANE_COUNT];    // when the first frame of the batch has been written.
+   HANDLE hFlushEvent;                    // signaled when a batch gets its first frame.
+   HANDLE hFlushThread;
+
+private:
+   BTE_CONTEXT( const BTE_CONTEXT& context );
+   BTE_CONTEXT& operator=( const BTE_CONTEXT& context );
+};
 
 static HMODULE g_hModule = NULL;
-static GUID g_guidClass;
-static TCHAR g_szDeviceName[MAX_PATH];
-static HANDLE g_hReadThread = NULL;
-static HANDLE g_hQuitEvent = NULL;
-static unsigned char g_buffer[MSG_BUFFER_SIZE];
-static DWORD g_dwBufSize = 0;
-static DWORD g_dwBufReadPos = 0;
+
+/**
+@func BTE_CONTEXT* | GetContext | Validates the context returned from BTE_Init or BTE_Open.
+@parm DWORD | hContext | Context.
+@rdesc Returns the driver instance or NULL if the context is invalid.
+*/
+BTE_CONTEXT* GetContext( DWORD hContext )
+{
+   BTE_CONTEXT* pContext = (BTE_CONTEXT*)hContext;
+   return ( pContext && BTE_CONTEXT_SIGNATURE == pContext->dwSignature ) ? pContext : NULL;
+}
 
 /**
 @func BOOL | ConvertStringToGuid | Converts a string into a GUID.
@@ -110,11 +218,12 @@ BOOL NeedAdvertiseInterface( LPCTSTR szRegKey )
 }
 
 /**
-@func BOOL | AdvertiseInterface | Reads device name and its guid from the given registry key and advertises the driver's interface.
+@func BOOL | AdvertiseInterface | Reads device guid from the given registry key and advertises the interface of the driver instance.
 @parm LPCTSTR | szRegKey | Driver's registry key.
+@parm BTE_CONTEXT* | pContext | Driver instance.
 @rdesc Returns TRUE on success.
 */
-BOOL AdvertiseInterface( LPCTSTR szRegKey )
+BOOL AdvertiseInterface( LPCTSTR szRegKey, BTE_CONTEXT* pContext )
 {
 	IFDBG( DebugOut( DEBUG_OUTPUT, L"+AdvertiseInterface\n" ) );
    
@@ -135,22 +244,13 @@ BOOL AdvertiseInterface( LPCTSTR szRegKey )
 			bRet = ConvertStringToGuid( szTemp, &guidTemp );
 			DEBUGCHK(bRet);
 			if( bRet ) {
-				g_guidClass = guidTemp;
+				pContext->guidClass = guidTemp;
 			}
       } else {
          IFDBG( DebugOut( DEBUG_OUTPUT, L"RegQueryValueEx %s %s ret: 0x%08x\n", REG_KEY_NAME, DEVLOAD_ICLASS_VALNAME, dwStatus ) );
       }
 
-		// figure out what device name to advertise.
-		dwSize = sizeof( szTemp );
-		dwStatus = RegQueryValueEx( hk, DEVLOAD_DEVNAME_VALNAME, NULL, &dwType, (LPBYTE)szTemp, &dwSize );
-		szTemp[MAX_PATH-1] = 0;
-		if( dwStatus == ERROR_SUCCESS && dwType == DEVLOAD_DEVNAME_VALTYPE ) {
-			memset( g_szDeviceName, 0, sizeof( g_szDeviceName ) );
-			_tcscpy( g_szDeviceName, szTemp );			
-      } else {
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"RegQueryValueEx %s %s ret: 0x%08x\n", REG_KEY_NAME, DEVLOAD_DEVNAME_VALNAME, dwStatus ) );
-      }
+		// the device name is the one the instance has been registered with.
 
 		// release the registry key.
 		RegCloseKey( hk );
@@ -161,7 +261,7 @@ BOOL AdvertiseInterface( LPCTSTR szRegKey )
 
 	// now advertise the interface.
 	if( bRet ) {
-		bRet = AdvertiseInterface( &g_guidClass, g_szDeviceName, TRUE );
+		bRet = AdvertiseInterface( &pContext->guidClass, pContext->szDeviceName, TRUE );
 		DEBUGCHK( bRet );
 	}
     
@@ -170,27 +270,25 @@ BOOL AdvertiseInterface( LPCTSTR szRegKey )
 }
 
 /**
-@func BOOL | WritePacket | Writes the given packet to the message queue.
-@parm const Packet& | packet | Packet object const reference.
+@func BOOL | WritePacket | Writes the given message segments to the lane as one message.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm int | lane | MSG_LANE value.
+@parm const PacketSegment* | pSegments | Message segments.
+@parm size_t | count | Number of segments.
 @rdesc Returns TRUE on success.
 */
-BOOL WritePacket( const Packet& packet )
+BOOL WritePacket( BTE_CONTEXT* pContext, int lane, const PacketSegment* pSegments, size_t count )
 {
    //IFDBG( DebugOut( DEBUG_OUTPUT, L"+WritePacket\n" ) );
    
    BOOL bRet = FALSE;
 
-   DEBUGCHK( g_hWriteQueue );
-   if ( g_hWriteQueue ) {
-      unsigned char buffer[MSG_BUFFER_SIZE] = {0};
-      size_t size = packet.serialize( buffer, packet.length() );
-      //IFDBG( DebugOut( DEBUG_OUTPUT, L"Data to queue:\n") );
-      //IFDBG( DumpBuff( DEBUG_OUTPUT, buffer, size ) );
-
-      bRet = WriteMsgQueue( g_hWriteQueue, buffer, size, MSG_QUEUE_WRITE_TIMEOUT, 0 );
+   DEBUGCHK( pContext->channels.pTransports[lane] );
+   if ( pContext->channels.pTransports[lane] ) {
+      bRet = pContext->channels.pTransports[lane]->Send( pSegments, count, MSG_QUEUE_WRITE_TIMEOUT );
       DEBUGCHK( bRet );
       if ( !bRet ) {
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"WriteMsgQueue ret: 0x%08x\n", GetLastError() ) );
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"Send ret: 0x%08x\n", GetLastError() ) );
       }
    }   
 
@@ -199,31 +297,432 @@ BOOL WritePacket( const Packet& packet )
 }
 
 /**
-@func BOOL | ReadPacket | Reads data from the message queue to the given packet.
-@parm Packet& | packet | Packet object reference.
+@func BOOL | WriteControlMsg | Writes the MESSAGE_PACKET message with the given id to the message queue.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm int | id | MESSAGE_ID value.
+@rdesc Returns TRUE on success.
+*/
+BOOL WriteControlMsg( BTE_CONTEXT* pContext, int id )
+{
+   unsigned char buffer[ControlMsg::SIZE];
+   PacketSegment segment = { buffer, ControlMsg::encode( buffer, id ) };
+   return WritePacket( pContext, MSG_CONTROL_LANE, &segment, 1 );
+}
+
+/**
+@func BOOL | FlushBatch | Writes the coalesced frames of the lane as one batch message.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm int | lane | MSG_LANE value.
+@rdesc Returns TRUE on success.
+@remark The caller holds csWrite. The frames are numbered when the batch is written, the frames of a failed batch get no numbers and the failure is reported by the next BTE_Write.
+*/
+BOOL FlushBatch( BTE_CONTEXT* pContext, int lane )
+{
+   HciBatchWriter& batch = pContext->batches[lane];
+   if ( 0 == batch.count() ) {
+      return TRUE;
+   }
+
+   batch.number( pContext->dwWriteSeq + 1 );
+   PacketSegment segment = { batch.data(), batch.length() };
+   BOOL bRet = WritePacket( pContext, lane, &segment, 1 );
+   if ( bRet ) {
+      pContext->dwWriteSeq += batch.count();
+   } else {
+      DWORD dwLastError = GetLastError();
+      if ( ERROR_SUCCESS == pContext->dwWriteError ) {
+         pContext->dwWriteError = dwLastError;
+      }
+      SetLastError( dwLastError );
+   }
+
+   batch.reset();
+   return bRet;
+}
+
+/**
+@func BOOL | FlushBatches | Writes the coalesced frames of all the lanes.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc Returns TRUE on success.
+*/
+BOOL FlushBatches( BTE_CONTEXT* pContext )
+{
+   BOOL bRet = TRUE;
+   if ( pContext->dwCoalesceLanes ) {
+      EnterCriticalSection( &pContext->csWrite );
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         if ( !FlushBatch( pContext, lane ) ) {
+            bRet = FALSE;
+         }
+      }
+      LeaveCriticalSection( &pContext->csWrite );
+   }
+
+   return bRet;
+}
+
+/**
+@func BOOL | AppendToBatch | Coalesces the HCI frame into the batch of the lane.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm int | lane | MSG_LANE value.
+@parm const void* | pFrame | HCI frame.
+@parm DWORD | dwSize | HCI frame size.
 @rdesc Returns TRUE on success.
+@remark The batch is written when it reaches the coalesce size, otherwise the flush thread writes it at the deadline.
+*/
+BOOL AppendToBatch( BTE_CONTEXT* pContext, int lane, const void* pFrame, DWORD dwSize )
+{
+   EnterCriticalSection( &pContext->csWrite );
+
+   HciBatchWriter& batch = pContext->batches[lane];
+   BOOL bRet = TRUE;
+   if ( !batch.append( pFrame, dwSize ) ) {
+      // the batch is full, it goes out and the frame starts the next one.
+      bRet = FlushBatch( pContext, lane ) && batch.append( pFrame, dwSize );
+   }
+
+   if ( bRet ) {
+      if ( 1 == batch.count() ) {
+         pContext->dwBatchStart[lane] = GetTickCount();
+         SetEvent( pContext->hFlushEvent );
+      }
+      if ( batch.length() >= pContext->dwCoalesceSize ) {
+         bRet = FlushBatch( pContext, lane );
+      }
+   }
+
+   LeaveCriticalSection( &pContext->csWrite );
+   return bRet;
+}
+
+/**
+@func DWORD | FlushThread | Writes the coalesced batches when their deadline elapses.
+@parm LPVOID | lpParam | Driver instance.
+@rdesc The function should return a value that indicates its success or failure. 
+*/
+DWORD WINAPI FlushThread( LPVOID lpParam )
+{
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+FlushThread\n" ) );
+
+   DWORD dwRes = 0;
+   BTE_CONTEXT* pContext = (BTE_CONTEXT*)lpParam;
+   HANDLE handles[] = { pContext->hQuitEvent, pContext->hFlushEvent };
+
+   DWORD dwWait = INFINITE;
+   for (;;) {
+      DWORD dwRet = WaitForMultipleObjects( 2, handles, FALSE, dwWait );
+      if ( WAIT_TIMEOUT != dwRet && WAIT_OBJECT_0 + 1 != dwRet ) {
+         break;
+      }
+
+      // write the batches past their deadline, wait for the closest deadline of the others.
+      dwWait = INFINITE;
+      EnterCriticalSection( &pContext->csWrite );
+      DWORD dwNow = GetTickCount();
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         if ( pContext->batches[lane].count() ) {
+            DWORD dwElapsed = dwNow - pContext->dwBatchStart[lane];
+            if ( dwElapsed >= pContext->dwCoalesceDelay ) {
+               FlushBatch( pContext, lane );
+            } else if ( pContext->dwCoalesceDelay - dwElapsed < dwWait ) {
+               dwWait = pContext->dwCoalesceDelay - dwElapsed;
+            }
+         }
+      }
+      LeaveCriticalSection( &pContext->csWrite );
+   }
+
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-FlushThread ret: %lu\n", dwRes ) ); 
+   return dwRes;
+}
+
+/**
+@func BOOL | WriteFrame | Writes the HCI frame to the lane or coalesces it if the lane is coalesced.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm int | lane | MSG_LANE value.
+@parm const void* | pFrame | HCI frame.
+@parm DWORD | dwSize | HCI frame size.
+@rdesc Returns TRUE on success.
+*/
+BOOL WriteFrame( BTE_CONTEXT* pContext, int lane, const void* pFrame, DWORD dwSize )
+{
+   if ( pContext->dwCoalesceLanes & ( 1 << lane ) ) {
+      return AppendToBatch( pContext, lane, pFrame, dwSize );
+   }
+
+   // the frames coalesced before go out first, so the frames keep the order they are written in.
+   BOOL bRet = FlushBatches( pContext );
+   if ( bRet ) {
+      // the frame is numbered and written under csWrite like the batches, so the numbers
+      // follow the order the frames go out in. a failed frame gets no number.
+      EnterCriticalSection( &pContext->csWrite );
+      DWORD dwSeq = pContext->dwWriteSeq + 1;
+      // the caller's buffer is referenced, not copied, until the message is written.
+      unsigned char header[HciDataMsg::HEADER_SIZE];
+      PacketSegment segments[2] = {
+         { header, HciDataMsg::encodeHeader( header, dwSize, dwSeq ) },
+         { pFrame, dwSize }
+      };
+      bRet = WritePacket( pContext, lane, segments, 2 );
+      if ( bRet ) {
+         pContext->dwWriteSeq = dwSeq;
+      }
+      LeaveCriticalSection( &pContext->csWrite );
+   }
+
+   return bRet;
+}
+
+/**
+@func DWORD | TotalTimeout | Computes the total timeout of a read or a write from the COMMTIMEOUTS values.
+@parm DWORD | dwMultiplier | Timeout per byte.
+@parm DWORD | dwConstant | Constant part of the timeout.
+@parm DWORD | dwCount | Number of bytes read or written.
+@rdesc Returns INFINITE if both values are 0. The sum saturates short of INFINITE, a large timeout must not turn into no timeout.
+*/
+DWORD TotalTimeout( DWORD dwMultiplier, DWORD dwConstant, DWORD dwCount )
+{
+   if ( 0 == dwMultiplier && 0 == dwConstant ) {
+      return INFINITE;
+   }
+
+   DWORD dwMax = INFINITE - 1;
+   if ( dwCount && dwMultiplier > dwMax / dwCount ) {
+      return dwMax;
+   }
+   DWORD dwTotal = dwMultiplier * dwCount;
+   return ( dwConstant > dwMax - dwTotal ) ? dwMax : dwTotal + dwConstant;
+}
+
+/**
+@func void | AbortWrites | Ends the writes waiting for their results.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc None.
+@remark The writes started later are not affected.
+*/
+void AbortWrites( BTE_CONTEXT* pContext )
+{
+   EnterCriticalSection( &pContext->csWrite );
+   ++pContext->dwAbortGeneration;
+   SetEvent( pContext->hAbortEvent );
+   LeaveCriticalSection( &pContext->csWrite );
+}
+
+/**
+@func BOOL | IsWriteAborted | Checks if the write has been aborted by AbortWrites.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm DWORD | dwAbortGeneration | dwAbortGeneration of the instance when the write has started.
+@rdesc Returns TRUE if the write has been aborted.
+*/
+BOOL IsWriteAborted( BTE_CONTEXT* pContext, DWORD dwAbortGeneration )
+{
+   EnterCriticalSection( &pContext->csWrite );
+   BOOL bRet = ( dwAbortGeneration != pContext->dwAbortGeneration );
+   if ( !bRet ) {
+      // the abort has been meant for the writes before this one.
+      ResetEvent( pContext->hAbortEvent );
+   }
+   LeaveCriticalSection( &pContext->csWrite );
+   return bRet;
+}
+
+/**
+@func void | AbortReads | Ends the reads waiting for data.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc None.
+@remark The reads started later are not affected.
+*/
+void AbortReads( BTE_CONTEXT* pContext )
+{
+   EnterCriticalSection( &pContext->csRead );
+   ++pContext->dwReadAbortGeneration;
+   SetEvent( pContext->hReadAbortEvent );
+   LeaveCriticalSection( &pContext->csRead );
+}
+
+/**
+@func BOOL | IsReadAborted | Checks if the read has been aborted by AbortReads.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm DWORD | dwAbortGeneration | dwReadAbortGeneration of the instance when the read has started.
+@rdesc Returns TRUE if the read has been aborted.
+*/
+BOOL IsReadAborted( BTE_CONTEXT* pContext, DWORD dwAbortGeneration )
+{
+   EnterCriticalSection( &pContext->csRead );
+   BOOL bRet = ( dwAbortGeneration != pContext->dwReadAbortGeneration );
+   if ( !bRet ) {
+      // the abort has been meant for the reads before this one.
+      ResetEvent( pContext->hReadAbortEvent );
+   }
+   LeaveCriticalSection( &pContext->csRead );
+   return bRet;
+}
+
+/**
+@func DWORD | ReadFromCache | Reads what the read cache has, up to the given size.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm void* | pBuffer | Buffer to read the data to.
+@parm DWORD | dwCount | Buffer size.
+@rdesc Returns the number of bytes read.
+*/
+DWORD ReadFromCache( BTE_CONTEXT* pContext, void* pBuffer, DWORD dwCount )
+{
+   EnterCriticalSection( &pContext->csRead );
+   DWORD dwRead = pContext->readCache.Read( pBuffer, dwCount );
+   LeaveCriticalSection( &pContext->csRead );
+   return dwRead;
+}
+
+/**
+@func void | ClearCache | Drops the data of the read cache, PURGE_RXCLEAR.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc None.
+*/
+void ClearCache( BTE_CONTEXT* pContext )
+{
+   EnterCriticalSection( &pContext->csRead );
+   pContext->readCache.Reset();
+   LeaveCriticalSection( &pContext->csRead );
+}
+
+/**
+@func DWORD | TakeWriteError | Returns the failed write result not reported yet and clears it.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc Returns ERROR_SUCCESS if no write has failed.
+*/
+DWORD TakeWriteError( BTE_CONTEXT* pContext )
+{
+   EnterCriticalSection( &pContext->csWrite );
+   DWORD dwWriteError = pContext->dwWriteError;
+   pContext->dwWriteError = ERROR_SUCCESS;
+   LeaveCriticalSection( &pContext->csWrite );
+   return dwWriteError;
+}
+
+/**
+@func BOOL | CollectWriteResults | Reads the results of the written HCI frames from the error queue.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm DWORD | dwMaxOutstanding | Number of frames that may stay without result. The function waits for the results of the others, the available ones are read anyway.
+@parm DWORD | dwTimeout | Time to wait for the results, the total write timeout of the port.
+@parm DWORD | dwAbortGeneration | dwAbortGeneration of the instance when the write has started.
+@rdesc Returns FALSE if the error queue can't be read. GetLastError returns ERROR_TIMEOUT if the results didn't come in time and ERROR_OPERATION_ABORTED if the write has been aborted with PURGE_TXABORT.
+@remark The first failed result is kept in dwWriteError of the instance until it's reported by BTE_Write.
 */
-BOOL ReadPacket( Packet& packet )
+BOOL CollectWriteResults( BTE_CONTEXT* pContext, DWORD dwMaxOutstanding, DWORD dwTimeout, DWORD dwAbortGeneration )
+{
+   DWORD dwStart = GetTickCount();
+   for (;;) {
+      // the coalesced frames count as outstanding, they're numbered when their batch is written.
+      EnterCriticalSection( &pContext->csWrite );
+      DWORD dwWriteSeq = pContext->dwWriteSeq;
+      DWORD dwCoalesced = 0;
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         dwCoalesced += pContext->batches[lane].count();
+      }
+      LeaveCriticalSection( &pContext->csWrite );
+
+      BOOL bWait = ( dwWriteSeq - pContext->dwWriteAckSeq + dwCoalesced > dwMaxOutstanding );
+      if ( bWait && dwCoalesced > 0 ) {
+         // the results of the coalesced frames never come while they wait for the deadline.
+         FlushBatches( pContext );
+         continue;
+      }
+
+      if ( dwWriteSeq == pContext->dwWriteAckSeq ) {
+         break;
+      }
+
+      if ( bWait ) {
+         DWORD dwWait = INFINITE;
+         if ( INFINITE != dwTimeout ) {
+            DWORD dwElapsed = GetTickCount() - dwStart;
+            dwWait = ( dwElapsed >= dwTimeout ) ? 0 : dwTimeout - dwElapsed;
+         }
+
+         HANDLE handles[] = { pContext->channels.hErrorQueue, pContext->hAbortEvent };
+         DWORD dwRet = WaitForMultipleObjects( 2, handles, FALSE, dwWait );
+         if ( WAIT_OBJECT_0 + 1 == dwRet ) {
+            if ( IsWriteAborted( pContext, dwAbortGeneration ) ) {
+               SetLastError( ERROR_OPERATION_ABORTED );
+               return FALSE;
+            }
+            continue;
+         } else if ( WAIT_TIMEOUT == dwRet ) {
+            SetLastError( ERROR_TIMEOUT );
+            return FALSE;
+         } else if ( WAIT_OBJECT_0 != dwRet ) {
+            IFDBG( DebugOut( DEBUG_OUTPUT, L"WaitForMultipleObjects ret: 0x%08x\n", GetLastError() ) );
+            return FALSE;
+         }
+      }
+
+      unsigned char buffer[ErrorMsg::SIZE];
+      DWORD dwNumberOfBytesRead = 0;
+      DWORD dwFlags = 0;
+      BOOL bRet = ReadMsgQueue( pContext->channels.hErrorQueue, buffer, sizeof( buffer ), &dwNumberOfBytesRead, 0, &dwFlags );
+      if ( !bRet ) {
+         if ( ERROR_TIMEOUT == GetLastError() && !bWait ) {
+            // no more results yet.
+            break;
+         }
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadMsgQueue ret: 0x%08x\n", GetLastError() ) );
+         return FALSE;
+      }
+
+      DWORD dwLastError = 0;
+      DWORD dwSeq = 0;
+      if ( !ErrorMsg::decode( buffer, dwNumberOfBytesRead, dwLastError, dwSeq ) ) {
+         continue;
+      }
+
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Last error received: 0x%08x seq: %lu\n", dwLastError, dwSeq ) );
+      // the agent serves the lanes by priority, so the results may come out of the write order.
+      // a result acknowledges the frames before it, the result of a frame acknowledged that way
+      // still reports its error.
+      if ( 0 == dwSeq || dwWriteSeq - dwSeq >= 0x80000000 ) {
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"Unexpected seq: %lu\n", dwSeq ) );
+         continue;
+      }
+
+      if ( dwSeq - pContext->dwWriteAckSeq <= dwWriteSeq - pContext->dwWriteAckSeq ) {
+         pContext->dwWriteAckSeq = dwSeq;
+      }
+      EnterCriticalSection( &pContext->csWrite );
+      if ( ERROR_SUCCESS != dwLastError && ERROR_SUCCESS == pContext->dwWriteError ) {
+         pContext->dwWriteError = dwLastError;
+      }
+      LeaveCriticalSection( &pContext->csWrite );
+   }
+
+   return TRUE;
+}
+
+/**
+@func BOOL | ReadPacket | Reads a message from the highest priority lane that has one to the given buffer.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm void* | pBuffer | Buffer to read the message to.
+@parm DWORD | dwSize | Buffer size.
+@parm DWORD& | dwReaded | Size of the message read.
+@rdesc Returns TRUE on success. GetLastError returns ERROR_OPERATION_ABORTED if the driver is being deinitialized.
+*/
+BOOL ReadPacket( BTE_CONTEXT* pContext, void* pBuffer, DWORD dwSize, DWORD& dwReaded )
 {
    //IFDBG( DebugOut( DEBUG_OUTPUT, L"+ReadPacket\n" ) );  
 
    BOOL bRet = FALSE;
 
-   DEBUGCHK( g_hReadQueue );
-   if ( g_hReadQueue ) {
-      unsigned char buffer[MSG_BUFFER_SIZE] = {0};
-      DWORD dwReaded = 0;
-      DWORD dwFlags = 0;
+   DEBUGCHK( pContext->channels.pTransports[MSG_CONTROL_LANE] );
+   if ( pContext->channels.pTransports[MSG_CONTROL_LANE] ) {
+      dwReaded = 0;
 
-      bRet = ReadMsgQueue( g_hReadQueue, buffer, MSG_BUFFER_SIZE, &dwReaded, MSG_QUEUE_READ_TIMEOUT, &dwFlags );
-      DEBUGCHK( bRet );
+      bRet = ReceiveFromLanes( pContext->channels, pBuffer, dwSize, &dwReaded, MSG_QUEUE_READ_TIMEOUT, pContext->hQuitEvent );
+      DEBUGCHK( bRet || ERROR_OPERATION_ABORTED == GetLastError() );
       if ( bRet ) {
          //IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from queue:\n" ) );
-         //IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)buffer, dwReaded ) );
-         size_t size = packet.deserialize( buffer, dwReaded );
-         bRet = ( size > 0 );
-      } else {
-         IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadMsgQueue ret: 0x%08x\n", GetLastError() ) );
+         //IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwReaded ) );
+         bRet = ( dwReaded > 0 );
+      } else if ( ERROR_OPERATION_ABORTED != GetLastError() ) {
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"ReceiveFromLanes ret: 0x%08x\n", GetLastError() ) );
       }
    }
 
@@ -231,6 +730,266 @@ BOOL ReadPacket( Packet& packet )
    return bRet;
 }
 
+/**
+@func void | SignalCommEvent | Records the comm event and wakes up the pending IOCTL_SERIAL_WAIT_ON_MASK if the event is waited for.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm DWORD | dwEvent | EV_ value.
+@rdesc None.
+*/
+void SignalCommEvent( BTE_CONTEXT* pContext, DWORD dwEvent )
+{
+   // nobody waits for the event most of the time, the lock is skipped then.
+   if ( pContext->dwWaitMask & dwEvent ) {
+      EnterCriticalSection( &pContext->csComm );
+      if ( pContext->dwWaitMask & dwEvent ) {
+         pContext->dwCommEvents |= dwEvent;
+         SetEvent( pContext->hCommEvent );
+      }
+      LeaveCriticalSection( &pContext->csComm );
+   }
+}
+
+/**
+@func void | CancelCommWait | Completes the pending IOCTL_SERIAL_WAIT_ON_MASK with no events.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc None.
+@remark The caller holds csComm.
+*/
+void CancelCommWait( BTE_CONTEXT* pContext )
+{
+   ++pContext->dwWaitGeneration;
+   pContext->dwCommEvents = 0;
+   SetEvent( pContext->hCommEvent );
+}
+
+/**
+@func BOOL | WaitOnMask | Waits until one of the events of the wait mask occurs.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm DWORD& | dwEvents | The events occurred, 0 if the wait has been cancelled by a new wait mask or the close.
+@rdesc Returns FALSE if the driver is being deinitialized or the wait mask is empty.
+*/
+BOOL WaitOnMask( BTE_CONTEXT* pContext, DWORD& dwEvents )
+{
+   EnterCriticalSection( &pContext->csComm );
+   DWORD dwGeneration = pContext->dwWaitGeneration;
+   BOOL bRet = ( 0 != pContext->dwWaitMask );
+   LeaveCriticalSection( &pContext->csComm );
+   if ( !bRet ) {
+      SetLastError( ERROR_INVALID_PARAMETER );
+   }
+
+   dwEvents = 0;
+   while ( bRet ) {
+      EnterCriticalSection( &pContext->csComm );
+      BOOL bDone = ( dwGeneration != pContext->dwWaitGeneration );
+      if ( !bDone ) {
+         dwEvents = pContext->dwCommEvents & pContext->dwWaitMask;
+         pContext->dwCommEvents = 0;
+         bDone = ( 0 != dwEvents );
+      }
+      LeaveCriticalSection( &pContext->csComm );
+
+      if ( bDone ) {
+         break;
+      }
+
+      HANDLE handles[] = { pContext->hCommEvent, pContext->hQuitEvent };
+      if ( WAIT_OBJECT_0 != WaitForMultipleObjects( 2, handles, FALSE, INFINITE ) ) {
+         SetLastError( ERROR_OPERATION_ABORTED );
+         bRet = FALSE;
+      }
+   }
+
+   return bRet;
+}
+
+/**
+@func DWORD | ReadCache | Reads the HCI frames from the read cache honouring the read timeouts.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm void* | pBuffer | Buffer to read the data to.
+@parm DWORD | dwCount | Buffer size.
+@rdesc Returns the number of bytes read, 0 if the timeouts have elapsed first. The read ends with what it has got if it's aborted with PURGE_RXABORT.
+@remark The timeouts have the meaning of COMMTIMEOUTS. MAXDWORD interval with zero total timeouts returns what is cached at once, MAXDWORD interval and multiplier return on the first byte.
+The interval timeout ends the read if no byte comes within it after the first one, the total timeout ends it anyway. With all the timeouts zero the whole buffer is waited for.
+*/
+DWORD ReadCache( BTE_CONTEXT* pContext, void* pBuffer, DWORD dwCount )
+{
+   EnterCriticalSection( &pContext->csComm );
+   COMMTIMEOUTS timeouts = pContext->timeouts;
+   LeaveCriticalSection( &pContext->csComm );
+
+   EnterCriticalSection( &pContext->csRead );
+   DWORD dwAbortGeneration = pContext->dwReadAbortGeneration;
+   LeaveCriticalSection( &pContext->csRead );
+
+   BOOL bFirstByte = FALSE;
+   DWORD dwInterval = 0;
+   DWORD dwTotal = INFINITE;
+   if ( MAXDWORD == timeouts.ReadIntervalTimeout ) {
+      if ( 0 == timeouts.ReadTotalTimeoutMultiplier && 0 == timeouts.ReadTotalTimeoutConstant ) {
+         return ReadFromCache( pContext, pBuffer, dwCount );
+      }
+      bFirstByte = ( MAXDWORD == timeouts.ReadTotalTimeoutMultiplier );
+   } else {
+      dwInterval = timeouts.ReadIntervalTimeout;
+   }
+
+   if ( bFirstByte ) {
+      dwTotal = timeouts.ReadTotalTimeoutConstant;
+   } else {
+      dwTotal = TotalTimeout( timeouts.ReadTotalTimeoutMultiplier, timeouts.ReadTotalTimeoutConstant, dwCount );
+   }
+
+   DWORD dwStart = GetTickCount();
+   DWORD dwReadTotal = 0;
+   for ( ;; ) {
+      dwReadTotal += ReadFromCache( pContext, (unsigned char*)pBuffer + dwReadTotal, dwCount - dwReadTotal );
+      if ( dwReadTotal == dwCount || ( bFirstByte && dwReadTotal > 0 ) ) {
+         break;
+      }
+
+      DWORD dwWait = INFINITE;
+      if ( INFINITE != dwTotal ) {
+         DWORD dwElapsed = GetTickCount() - dwStart;
+         if ( dwElapsed >= dwTotal ) {
+            break;
+         }
+         dwWait = dwTotal - dwElapsed;
+      }
+      if ( dwInterval && dwReadTotal > 0 && dwInterval < dwWait ) {
+         dwWait = dwInterval;
+      }
+
+      // the read thread wakes the read up when it caches the next frame.
+      if ( !pContext->readCache.WaitForData( pContext->hReadAbortEvent, dwWait ) ) {
+         if ( ERROR_OPERATION_ABORTED == GetLastError() && !IsReadAborted( pContext, dwAbortGeneration ) ) {
+            continue;
+         }
+         break;
+      }
+   }
+
+   return dwReadTotal;
+}
+
+/**
+@func void | CacheMessage | Puts the HCI frames of the message to the read cache.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@parm const unsigned char* | pBuffer | Message.
+@parm DWORD | dwSize | Message size.
+@remark The cache must have room for the whole message.
+*/
+void CacheMessage( BTE_CONTEXT* pContext, const unsigned char* pBuffer, DWORD dwSize )
+{
+   int type = -1;
+   size_t size = 0;
+   const unsigned char* pData = NULL;
+   MsgHeader::decode( pBuffer, dwSize, type );
+   if ( HCI_DATA_PACKET == type ) {
+      pData = HciDataMsg::decode( pBuffer, dwSize, size );
+      if ( pData && size > 0 ) {
+         pContext->readCache.Write( pData, size );
+      } else {
+         IFDBG( DebugOut( DEBUG_OUTPUT, L"No data\n" ) );
+      }
+   } else if ( HCI_DATA_BATCH_PACKET == type ) {
+      HciBatchReader batch( pBuffer, dwSize );
+      while ( NULL != ( pData = batch.next( size ) ) ) {
+         pContext->readCache.Write( pData, size );
+      }
+   } else {
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Unexpected packet type: 0x%08x\n", type ) );
+   }
+}
+
+/**
+@func DWORD | ReadThread | The read-ahead thread, drains the lanes into the read cache while the cache has room for a message.
+@parm LPVOID | lpParam | Driver instance.
+@rdesc The function should return a value that indicates its success or failure. 
+*/
+DWORD WINAPI ReadThread( LPVOID lpParam )
+{
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+ReadThread\n" ) );
+
+   DWORD dwRes = 0;
+   BTE_CONTEXT* pContext = (BTE_CONTEXT*)lpParam;
+
+   while ( pContext->readCache.WaitForSpace( MSG_BUFFER_SIZE, pContext->hQuitEvent, INFINITE ) ) {
+      DWORD dwReaded = 0;
+      if ( !ReadPacket( pContext, pContext->buffer, MSG_BUFFER_SIZE, dwReaded ) ) {
+         // don't spin on a broken lane.
+         if ( ERROR_OPERATION_ABORTED == GetLastError() || WAIT_OBJECT_0 == WaitForSingleObject( pContext->hQuitEvent, READ_THREAD_RETRY_TIMEOUT ) ) {
+            break;
+         }
+         continue;
+      }
+
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from queue:\n" ) );
+      IFDBG( DumpBuff( DEBUG_OUTPUT, pContext->buffer, dwReaded ) );
+      CacheMessage( pContext, pContext->buffer, dwReaded );
+      SignalCommEvent( pContext, EV_RXCHAR );
+   }
+
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-ReadThread ret: %lu\n", dwRes ) ); 
+   return dwRes;
+}
+
+/**
+@func void | StopContext | Stops the read thread of the driver instance and closes its channels.
+@parm BTE_CONTEXT* | pContext | Driver instance.
+@rdesc None.
+*/
+void StopContext( BTE_CONTEXT* pContext )
+{
+   // stop the read-ahead and flush threads before the lanes are closed, and the reads waiting for data.
+   if ( pContext->hQuitEvent ) {
+      SetEvent( pContext->hQuitEvent );
+   }
+   if ( pContext->hReadAbortEvent ) {
+      AbortReads( pContext );
+   }
+
+   if ( pContext->hReadThread ) {
+      WaitForSingleObject( pContext->hReadThread, INFINITE );
+      CloseHandle( pContext->hReadThread );
+      pContext->hReadThread = NULL;
+   }
+
+   if ( pContext->hFlushThread ) {
+      WaitForSingleObject( pContext->hFlushThread, INFINITE );
+      CloseHandle( pContext->hFlushThread );
+      pContext->hFlushThread = NULL;
+   }
+
+   if ( pContext->hFlushEvent ) {
+      CloseHandle( pContext->hFlushEvent );
+      pContext->hFlushEvent = NULL;
+   }
+
+   if ( pContext->hQuitEvent ) {
+      CloseHandle( pContext->hQuitEvent );
+      pContext->hQuitEvent = NULL;
+   }
+
+   if ( pContext->hCommEvent ) {
+      CloseHandle( pContext->hCommEvent );
+      pContext->hCommEvent = NULL;
+   }
+
+   if ( pContext->hAbortEvent ) {
+      CloseHandle( pContext->hAbortEvent );
+      pContext->hAbortEvent = NULL;
+   }
+
+   if ( pContext->hReadAbortEvent ) {
+      CloseHandle( pContext->hReadAbortEvent );
+      pContext->hReadAbortEvent = NULL;
+   }
+
+   pContext->readCache.CloseEvents();
+   CloseMsgQueues( pContext->channels );
+}
+
 /**
 @func BOOL | DllMain | This function is an optional method of entry into a DLL.
 @parm HANDLE | hModule | Handle to the DLL. 
@@ -262,39 +1021,82 @@ BOOL APIENTRY DllMain( HANDLE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 
 /**
 @func HANDLE | BTE_INIT | Serial device initialization.
-@parm ULONG	| uIdentifier | Port identifier.  The device loader passes in the registry key that contains information about the active device.
-@rdesc Returns a pointer to the serial head which is passed into the BTE_OPEN and BTE_DEINIT entry points as a device handle.
+@parm DWORD | dwInstance | Index of the BTE device. The agent passes it in as dwInfo of RegisterDevice.
+@rdesc Returns a pointer to the driver instance which is passed into the BTE_OPEN and BTE_DEINIT entry points as a device handle.
 @remark This routine is called at device load time in order to perform any initialization. Typically the init routine does as little as possible, postponing memory allocation and device power-on to Open time.
 @remark Routine exported by a device driver.  
 */
-DWORD BTE_Init( LPCTSTR pContext, LPCVOID lpvBusContext )
+DWORD BTE_Init( DWORD dwInstance, LPCVOID lpvBusContext )
 {
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Init\n" ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Init instance: %lu\n", dwInstance ) );
 
-   DWORD dwRet = 0;   
-   BOOL bRet = CreateMsgQueues();
-   DEBUGCHK( bRet );
+   DWORD dwRet = 0;
+   BTE_CONTEXT* pContext = NULL;
+   BOOL bRet = ( dwInstance >= 1 && dwInstance <= DEVICE_MAX_INDEX );
    if ( bRet ) {
-      if ( NeedAdvertiseInterface( REG_KEY_NAME ) ) {
-         bRet = AdvertiseInterface( REG_KEY_NAME );
-         DEBUGCHK( bRet );
+      pContext = new BTE_CONTEXT( dwInstance );
+      bRet = ( NULL != pContext );
+      if ( !bRet ) {
+         SetLastError( ERROR_OUTOFMEMORY );
+      }
+   } else {
+      SetLastError( ERROR_INVALID_PARAMETER );
+   }
+
+   if ( bRet ) {
+      bRet = CreateMsgQueues( pContext->channels, dwInstance, ReadMsgQueueDepth( REG_KEY_NAME ), ReadMsgTransport( REG_KEY_NAME ) );
+      DEBUGCHK( bRet );
+      pContext->dwWriteWindow = ReadMsgWriteWindow( REG_KEY_NAME );
+      pContext->dwCoalesceLanes = ReadMsgCoalesceLanes( REG_KEY_NAME );
+      pContext->dwCoalesceDelay = ReadMsgCoalesceDelay( REG_KEY_NAME );
+      pContext->dwCoalesceSize = ReadMsgCoalesceSize( REG_KEY_NAME );
+   }
+   
+   if ( bRet ) {
+      // start the read-ahead thread.
+      pContext->hQuitEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+      pContext->hCommEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+      pContext->hAbortEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+      pContext->hReadAbortEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+      bRet = ( NULL != pContext->hQuitEvent && NULL != pContext->hCommEvent && NULL != pContext->hAbortEvent && NULL != pContext->hReadAbortEvent && pContext->readCache.CreateEvents() );
+      if ( bRet ) {
+         pContext->hReadThread = CreateThread( NULL, 0, ReadThread, pContext, 0, NULL );
+         bRet = ( NULL != pContext->hReadThread );
+      }
+      // start the flush thread if the writes are coalesced.
+      if ( bRet && pContext->dwCoalesceLanes ) {
+         pContext->hFlushEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+         bRet = ( NULL != pContext->hFlushEvent );
          if ( bRet ) {
-            dwRet = DEVICE_CONTEXT;
+            pContext->hFlushThread = CreateThread( NULL, 0, FlushThread, pContext, 0, NULL );
+            bRet = ( NULL != pContext->hFlushThread );
          }
-      } else {
-         dwRet = DEVICE_CONTEXT;
       }
+      DEBUGCHK( bRet );
+   }
+
+   if ( bRet && NeedAdvertiseInterface( REG_KEY_NAME ) ) {
+      bRet = AdvertiseInterface( REG_KEY_NAME, pContext );
+      DEBUGCHK( bRet );
+   }
+
+   if ( bRet ) {
+      dwRet = (DWORD)pContext;
    } else {
-      IFDBG( DebugOut( DEBUG_OUTPUT, L"CreateMsgQueues ret: 0x%08x\n", GetLastError() ) );
+      IFDBG( DebugOut( DEBUG_OUTPUT, L"Initialization failed: 0x%08x\n", GetLastError() ) );
+      if ( pContext ) {
+         StopContext( pContext );
+         delete pContext;
+      }
    }
 
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"-BTE_Init ret: %lu\n", dwRet ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-BTE_Init ret: 0x%08x\n", dwRet ) );
    return dwRet;
 }
 
 /**
 @func BOOL | BTE_Deinit | De-initialize serial port.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hDeviceContext | Context pointer returned from BTE_Init.
 @rdesc None.
 @remark Routine exported by a device driver.  
 */
@@ -303,20 +1105,18 @@ BOOL BTE_Deinit( DWORD hDeviceContext )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Deinit\n" ) );
    
    BOOL bRet = FALSE;
-   if ( hDeviceContext == DEVICE_CONTEXT ) {
+   BTE_CONTEXT* pContext = GetContext( hDeviceContext );
+   if ( pContext ) {
+      bRet = TRUE;
       if ( NeedAdvertiseInterface( REG_KEY_NAME ) ) {
-         bRet = AdvertiseInterface( &g_guidClass, g_szDeviceName, FALSE );
+         bRet = AdvertiseInterface( &pContext->guidClass, pContext->szDeviceName, FALSE );
          DEBUGCHK( bRet );
       }
 
-      CloseMsgQueue( g_hWriteQueue );
-      g_hWriteQueue = NULL;
-
-      CloseMsgQueue( g_hReadQueue );     
-      g_hReadQueue = NULL;
-
-      CloseMsgQueue( g_hErrorQueue );
-      g_hErrorQueue = NULL;
+      StopContext( pContext );
+      delete pContext;
+   } else {
+      SetLastError( ERROR_INVALID_HANDLE );
    }
 
    IFDBG( DebugOut( DEBUG_OUTPUT, L"-BTE_Deinit ret: %d\n", bRet ) );
@@ -325,11 +1125,11 @@ BOOL BTE_Deinit( DWORD hDeviceContext )
 
 /**
 @func HANDLE | BTE_Open | Serial port driver initialization.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hDeviceContext | Context pointer returned from BTE_Init.
 @parm DWORD | dwAccess | requested access ( combination of GENERIC_READ and GENERIC_WRITE )
 @parm DWORD | dwShareMode | requested share mode ( combination of FILE_SHARE_READ and FILE_SHARE_WRITE )
 @rdesc Returns a DWORD which will be passed to Read, Write, etc or NULL if unable to open device.
-@remark This routine must be called by the user to open the serial device. The HANDLE returned must be used by the application in all subsequent calls to the serial driver. This routine starts the thread which handles the serial events.
+@remark This routine must be called by the user to open the serial device. The HANDLE returned must be used by the application in all subsequent calls to the serial driver. The instance can be opened once at a time.
 @remark Routine exported by a device driver.  
 */
 DWORD BTE_Open( DWORD hDeviceContext, DWORD AccessCode, DWORD ShareMode )
@@ -337,27 +1137,39 @@ DWORD BTE_Open( DWORD hDeviceContext, DWORD AccessCode, DWORD ShareMode )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Open\n" ) );
 
    DWORD dwRet = 0;   
-   if ( hDeviceContext == DEVICE_CONTEXT ) {
-      // send acknowledgement packet.
-      Packet packet;
-      packet.writeInt( MESSAGE_PACKET );
-      packet.writeInt( COM_OPEN_MSG );
-      if ( WritePacket( packet ) ) {
-         dwRet = OPEN_CONTEXT;
+   BTE_CONTEXT* pContext = GetContext( hDeviceContext );
+   if ( pContext ) {
+      if ( !InterlockedExchange( &pContext->lOpened, TRUE ) ) {
+         // a failed write of the previous session isn't reported anymore.
+         TakeWriteError( pContext );
+         // neither are the wait mask and the timeouts of the previous session used.
+         EnterCriticalSection( &pContext->csComm );
+         pContext->dwWaitMask = 0;
+         pContext->dwCommEvents = 0;
+         pContext->ResetTimeouts();
+         LeaveCriticalSection( &pContext->csComm );
+
+         // send acknowledgement packet.
+         if ( WriteControlMsg( pContext, COM_OPEN_MSG ) ) {
+            dwRet = (DWORD)pContext;
+         } else {
+            InterlockedExchange( &pContext->lOpened, FALSE );
+            SetLastError( ERROR_TIMEOUT );
+         }
       } else {
-         SetLastError( ERROR_TIMEOUT );
+         SetLastError( ERROR_BUSY );
       }
    } else {
       SetLastError( ERROR_INVALID_HANDLE );
    }
 
-   IFDBG( DebugOut( DEBUG_OUTPUT, L"-BTE_Open ret: %lu\n", dwRet ) );
+   IFDBG( DebugOut( DEBUG_OUTPUT, L"-BTE_Open ret: 0x%08x\n", dwRet ) );
    return dwRet;
 }
 
 /**
 @func BOOL | BTE_Close | Close the serial device.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hOpenContext | Context pointer returned from BTE_Open.
 @rdesc TRUE if success; FALSE if failure
 @remark This routine is called by the device manager to close the device.
 @remark Routine exported by a device driver.  
@@ -367,16 +1179,22 @@ BOOL BTE_Close( DWORD hOpenContext )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Close\n" ) );
    
    BOOL bRet = FALSE;
-   if ( hOpenContext == OPEN_CONTEXT ) {
+   BTE_CONTEXT* pContext = GetContext( hOpenContext );
+   if ( pContext ) {
+      // the coalesced frames go out before the goodbye packet.
+      FlushBatches( pContext );
       // send goodbye packet.
-      Packet packet;
-      packet.writeInt( MESSAGE_PACKET );
-      packet.writeInt( COM_CLOSE_MSG );
-      if ( WritePacket( packet ) ) {
+      if ( WriteControlMsg( pContext, COM_CLOSE_MSG ) ) {
          bRet = TRUE;
       } else {
          SetLastError( ERROR_TIMEOUT );
       }
+
+      // complete the pending wait of the closing application.
+      EnterCriticalSection( &pContext->csComm );
+      CancelCommWait( pContext );
+      LeaveCriticalSection( &pContext->csComm );
+      InterlockedExchange( &pContext->lOpened, FALSE );
    } else {
       SetLastError( ERROR_INVALID_HANDLE );
    }
@@ -387,7 +1205,7 @@ BOOL BTE_Close( DWORD hOpenContext )
 
 /**
 @func BOOL | BTE_IOControl | Device IO control routine.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hOpenContext | Context pointer returned from BTE_Open.
 @parm DWORD | dwIoControlCode | IO control code to be performed
 @parm PBYTE | pBufIn | Input data to the device
 @parm DWORD | dwLenIn | Number of bytes being passed in
@@ -403,7 +1221,8 @@ BOOL BTE_IOControl( DWORD hOpenContext, DWORD dwIoControlCode, PBYTE pBufIn, DWO
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_IOControl\n" ) );
    
    BOOL bRet = FALSE;
-   if ( hOpenContext == OPEN_CONTEXT ) {
+   BTE_CONTEXT* pContext = GetContext( hOpenContext );
+   if ( pContext ) {
 
       LPCWSTR szIOControlCode = L"UNKNOWN_CODE";
       switch( dwIoControlCode ) {
@@ -434,7 +1253,112 @@ BOOL BTE_IOControl( DWORD hOpenContext, DWORD dwIoControlCode, PBYTE pBufIn, DWO
       IFDBG( DebugOut( DEBUG_OUTPUT, L"ControlCode: %lu (%s)\n", dwIoControlCode, szIOControlCode ) );
       IFDBG( DumpBuff( DEBUG_OUTPUT, pBufIn, dwLenIn ) );
       
+      // the events, the queue status and the timeouts are served from the read cache,
+      // the other codes have no meaning for the emulated port and just succeed.
       bRet = TRUE;
+      switch( dwIoControlCode ) {
+         case IOCTL_SERIAL_SET_WAIT_MASK:
+            if ( pBufIn && dwLenIn >= sizeof( DWORD ) ) {
+               EnterCriticalSection( &pContext->csComm );
+               // the pending wait completes with no events, like the new mask were set with SetCommMask.
+               CancelCommWait( pContext );
+               pContext->dwWaitMask = *(DWORD*)pBufIn;
+               // the data cached before is reported to the next wait, so it's not missed.
+               if ( ( pContext->dwWaitMask & EV_RXCHAR ) && pContext->readCache.GetUsed() > 0 ) {
+                  pContext->dwCommEvents |= EV_RXCHAR;
+               }
+               LeaveCriticalSection( &pContext->csComm );
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_GET_WAIT_MASK:
+            if ( pBufOut && dwLenOut >= sizeof( DWORD ) ) {
+               *(DWORD*)pBufOut = pContext->dwWaitMask;
+               if ( pdwActualOut ) {
+                  *pdwActualOut = sizeof( DWORD );
+               }
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_WAIT_ON_MASK:
+            if ( pBufOut && dwLenOut >= sizeof( DWORD ) ) {
+               DWORD dwEvents = 0;
+               bRet = WaitOnMask( pContext, dwEvents );
+               *(DWORD*)pBufOut = dwEvents;
+               if ( pdwActualOut ) {
+                  *pdwActualOut = sizeof( DWORD );
+               }
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_GET_COMMSTATUS:
+            if ( pBufOut && dwLenOut >= sizeof( SERIAL_DEV_STATUS ) ) {
+               SERIAL_DEV_STATUS* pStatus = (SERIAL_DEV_STATUS*)pBufOut;
+               memset( pStatus, 0, sizeof( SERIAL_DEV_STATUS ) );
+               // the writes go to the lanes at once, nothing stays in the output queue.
+               pStatus->ComStat.cbInQue = pContext->readCache.GetUsed();
+               if ( pdwActualOut ) {
+                  *pdwActualOut = sizeof( SERIAL_DEV_STATUS );
+               }
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_SET_TIMEOUTS:
+            if ( pBufIn && dwLenIn >= sizeof( COMMTIMEOUTS ) ) {
+               EnterCriticalSection( &pContext->csComm );
+               pContext->timeouts = *(COMMTIMEOUTS*)pBufIn;
+               LeaveCriticalSection( &pContext->csComm );
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_PURGE:
+            if ( pBufIn && dwLenIn >= sizeof( DWORD ) ) {
+               DWORD dwFlags = *(DWORD*)pBufIn;
+               // nothing is buffered on the write side but the writes waiting for their results.
+               if ( dwFlags & PURGE_TXABORT ) {
+                  AbortWrites( pContext );
+               }
+               if ( dwFlags & PURGE_RXABORT ) {
+                  AbortReads( pContext );
+               }
+               if ( dwFlags & PURGE_RXCLEAR ) {
+                  ClearCache( pContext );
+               }
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+
+         case IOCTL_SERIAL_GET_TIMEOUTS:
+            if ( pBufOut && dwLenOut >= sizeof( COMMTIMEOUTS ) ) {
+               EnterCriticalSection( &pContext->csComm );
+               *(COMMTIMEOUTS*)pBufOut = pContext->timeouts;
+               LeaveCriticalSection( &pContext->csComm );
+               if ( pdwActualOut ) {
+                  *pdwActualOut = sizeof( COMMTIMEOUTS );
+               }
+            } else {
+               SetLastError( ERROR_INVALID_PARAMETER );
+               bRet = FALSE;
+            }
+            break;
+      }
    } else {
       SetLastError( ERROR_INVALID_HANDLE );
    }
@@ -467,10 +1391,10 @@ void BTE_PowerDown( DWORD hDeviceContext )
 
 /**
 @func ULONG | BTE_Read | Allows application to receive characters from serial port. This routine sets the buffer and bufferlength to be used by the reading thread. It also enables reception and controlling when to return to the user. It writes to the referent of the fourth argument the number of bytes transacted. It returns the status of the call.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hOpenContext | Context pointer returned from BTE_Open.
 @parm PUCHAR | pTargetBuffer | Pointer to valid memory.
 @parm ULONG | uBufferLength | Size in bytes of pTargetBuffer.
-@rdesc This routine returns: -1 if error, or number of bytes read.
+@rdesc This routine returns: -1 if error, or number of bytes read, 0 if the read timeouts have elapsed.
 @remark Routine exported by a device driver.  
 */
 DWORD BTE_Read( DWORD hOpenContext, LPVOID pBuffer, DWORD dwCount )
@@ -478,56 +1402,19 @@ DWORD BTE_Read( DWORD hOpenContext, LPVOID pBuffer, DWORD dwCount )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Read len: %d\n", dwCount ) );
 
    DWORD dwRet = -1;
-   if ( hOpenContext == OPEN_CONTEXT ) {
+   BTE_CONTEXT* pContext = GetContext( hOpenContext );
+   if ( pContext ) {
       
       DEBUGCHK( pBuffer != NULL && dwCount > 0 );
       if ( pBuffer != NULL && dwCount > 0 ) {
-         // if any data in cash buffer ?
-         DWORD dwDataSize = g_dwBufSize - g_dwBufReadPos;
-         if ( dwDataSize > 0 ) { // data exist
-            DWORD dwToRead = dwCount > dwDataSize ? dwDataSize : dwCount;
-            memcpy( pBuffer, g_buffer + g_dwBufReadPos, dwToRead );
+         // the caller's buffer is filled from the read cache across the frame boundaries.
+         // the read thread keeps the cache filled, the read waits only if the cache is empty.
+         DWORD dwReadTotal = ReadCache( pContext, pBuffer, dwCount );
+         dwRet = dwReadTotal;
 
+         if ( dwReadTotal > 0 ) {
             IFDBG( DebugOut( DEBUG_OUTPUT, L"Output buffer:\n" ) );
-            IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwToRead ) );
-
-            g_dwBufReadPos += dwToRead;
-            dwRet = dwToRead;
-         } else { // no data. read data from the queue...
-            //IFDBG( DebugOut( DEBUG_OUTPUT, L"Buffer read to:\n" ) );
-            //IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwCount ) );
-            Packet packet;
-            if ( ReadPacket( packet ) ) {
-               int type = packet.readInt();
-               if ( HCI_DATA_PACKET == type ) {
-                  // store data to cash buffer.
-                  memset( g_buffer, 0, MSG_BUFFER_SIZE );
-                  g_dwBufSize = 0;
-                  g_dwBufReadPos = 0;
-                  g_dwBufSize = packet.readUCharArray( (unsigned char*)g_buffer, MSG_BUFFER_SIZE );
-                  IFDBG( DebugOut( DEBUG_OUTPUT, L"Data from queue:\n" ) );
-                  IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)g_buffer, g_dwBufSize ) );
-
-                  // if any data in cash buffer again ?
-                  dwDataSize = g_dwBufSize - g_dwBufReadPos;
-                  if ( dwDataSize > 0 ) { // data exist
-                     DWORD dwToRead = dwCount > dwDataSize ? dwDataSize : dwCount;
-                     memcpy( pBuffer, g_buffer + g_dwBufReadPos, dwToRead );
-
-                     IFDBG( DebugOut( DEBUG_OUTPUT, L"Output buffer:\n" ) );
-                     IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwToRead ) );
-
-                     g_dwBufReadPos += dwToRead;
-                     dwRet = dwToRead;
-                  } else {
-                     SetLastError( ERROR_NO_DATA );
-                  }
-               } else {
-                  SetLastError( ERROR_BAD_COMMAND );
-               }
-            } else {
-               SetLastError( ERROR_TIMEOUT );
-            }
+            IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwReadTotal ) );
          }
       } else {
          SetLastError( ERROR_INVALID_HANDLE );
@@ -542,10 +1429,11 @@ DWORD BTE_Read( DWORD hOpenContext, LPVOID pBuffer, DWORD dwCount )
 
 /**
 @func ULONG | BTE_Write | Allows application to transmit bytes to the serial port.
-@parm HANDLE | hOpenContext | Context pointer returned from BTE_Init.
+@parm HANDLE | hOpenContext | Context pointer returned from BTE_Open.
 @parm PUCHAR | pSourceBytes | Buffer containing data.
 @parm ULONG | uNumberOfBytes | Maximum length to write.
 @rdesc Returns -1 for error, otherwise the number of bytes written.  The length returned is guaranteed to be the length requested unless an error condition occurs.
+@remark With the write window greater than 1 the write completes without waiting for the remote result. A failed result is returned by the next write, which is not sent then.
 @remark Routine exported by a device driver.  
 */
 DWORD BTE_Write( DWORD hOpenContext, LPVOID pBuffer, DWORD dwCount )
@@ -553,31 +1441,44 @@ DWORD BTE_Write( DWORD hOpenContext, LPVOID pBuffer, DWORD dwCount )
    IFDBG( DebugOut( DEBUG_OUTPUT, L"+BTE_Write\n" ) );
    
    DWORD dwRet = -1;
-   if ( hOpenContext == OPEN_CONTEXT ) {
+   BTE_CONTEXT* pContext = GetContext( hOpenContext );
+   if ( pContext ) {
       IFDBG( DebugOut( DEBUG_OUTPUT, L"Write buffer:\n") );
       IFDBG( DumpBuff( DEBUG_OUTPUT, (unsigned char*)pBuffer, dwCount ) );
-      Packet packet;
-      packet.writeInt( HCI_DATA_PACKET );
-      packet.writeUCharArray( (unsigned char*)pBuffer, dwCount );
-      if ( WritePacket( packet ) ) {
-         // check the remote operation return code.
-         DWORD dwLastError = 0;
-         DWORD dwNumberOfBytesRead = 0;
-         DWORD dwFlags = 0;
-         BOOL bRet = ReadMsgQueue( g_hErrorQueue, &dwLastError, sizeof(DWORD), &dwNumberOfBytesRead, MSG_QUEUE_WRITE_TIMEOUT, &dwFlags );
-         DEBUGCHK( bRet );
-         if ( !bRet ) {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"ReadMsgQueue ret: 0x%08x\n", GetLastError() ) );
-         } else {
-            IFDBG( DebugOut( DEBUG_OUTPUT, L"Last error received: 0x%08x\n", dwLastError ) );
-            if ( dwLastError == ERROR_SUCCESS ) {
-               dwRet = dwCount;
-            } else {
-               SetLastError( dwLastError );
-            }
+      // the waits for the results end at the total write timeout of the port or the purge.
+      EnterCriticalSection( &pContext->csWrite );
+      DWORD dwAbortGeneration = pContext->dwAbortGeneration;
+      LeaveCriticalSection( &pContext->csWrite );
+      EnterCriticalSection( &pContext->csComm );
+      DWORD dwTimeout = TotalTimeout( pContext->timeouts.WriteTotalTimeoutMultiplier, pContext->timeouts.WriteTotalTimeoutConstant, dwCount );
+      LeaveCriticalSection( &pContext->csComm );
+
+      // make room for the frame in the write window.
+      BOOL bRet = CollectWriteResults( pContext, pContext->dwWriteWindow - 1, dwTimeout, dwAbortGeneration );
+      DWORD dwLastError = GetLastError();
+      DEBUGCHK( bRet || ERROR_TIMEOUT == dwLastError || ERROR_OPERATION_ABORTED == dwLastError );
+      DWORD dwWriteError = TakeWriteError( pContext );
+      if ( ERROR_SUCCESS != dwWriteError ) {
+         // report the failed write.
+         SetLastError( dwWriteError );
+      } else if ( !bRet ) {
+         SetLastError( dwLastError );
+      } else if ( dwCount > (DWORD)HciDataMsg::MAX_DATA_SIZE ) {
+         SetLastError( ERROR_INSUFFICIENT_BUFFER );
+      } else if ( 0 == dwCount ) {
+         // nothing to send, the desktop doesn't return results for empty frames.
+         dwRet = 0;
+      } else if ( WriteFrame( pContext, GetFrameLane( pBuffer, dwCount ), pBuffer, dwCount ) ) {
+         // check the remote operation return code. in the stop-and-wait mode it's waited for,
+         // otherwise only the results already received are read.
+         bRet = CollectWriteResults( pContext, ( 1 == pContext->dwWriteWindow ) ? 0 : pContext->dwWriteWindow, dwTimeout, dwAbortGeneration );
+         DEBUGCHK( bRet || ERROR_TIMEOUT == GetLastError() || ERROR_OPERATION_ABORTED == GetLastError() );
+         dwWriteError = ( 1 == pContext->dwWriteWindow ) ? TakeWriteError( pContext ) : ERROR_SUCCESS;
+         if ( ERROR_SUCCESS != dwWriteError ) {
+            SetLastError( dwWriteError );
+         } else if ( bRet || 1 != pContext->dwWriteWindow ) {
+            dwRet = dwCount;
          }
-      } else {
-         SetLastError( ERROR_TIMEOUT );
       }
    } else {
       SetLastError( ERROR_INVALID_USER_BUFFER );
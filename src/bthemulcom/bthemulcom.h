@@ -25,5 +25,15 @@
 #define SETTINGS_FILENAME                 _T("bthemul.rgs")
 #define DEVICE_PREFIX                     _T("BTE")
 #define REG_KEY_NAME                      _T("Drivers\\BTE")
+#define DEVICE_MAX_INDEX                  9     // BTE1: to BTE9:, one per emulated adapter.
+
+// startup handshake between the agent and the HCI transport. the agent sets the ready event
+// once the driver and its channels are up and resets it before it tears them down. the
+// transport keeps the closed event set while it has no connection open. both sides wait
+// HANDSHAKE_TIMEOUT ms at most. the events are named after the driver instance like the
+// channels, "<name>-<instance>", so the instances don't see each other's handshake.
+#define READY_EVENT_NAME                  _T("BthEmulReady")
+#define CLOSED_EVENT_NAME                 _T("BthEmulClosed")
+#define HANDSHAKE_TIMEOUT                 5000
 
 #endif //__BTH_EMUL_COM_H__
\ No newline at end of file
@@ -0,0 +1,236 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ByteRing.h"
+#include "Transport.h"
+#include <assert.h>
+
+ByteRing::ByteRing( void* buffer, DWORD dwSize )
+{
+   assert( buffer && dwSize && !( dwSize & ( dwSize - 1 ) ) );
+   _data = (unsigned char*)buffer;
+   _size = dwSize;
+   _head = 0;
+   _tail = 0;
+   _consumerWaiting = 0;
+   _producerWaiting = 0;
+   _hDataEvent = NULL;
+   _hSpaceEvent = NULL;
+}
+
+ByteRing::~ByteRing()
+{
+   CloseEvents();
+}
+
+BOOL ByteRing::CreateEvents()
+{
+   CloseEvents();
+
+   _hDataEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+   _hSpaceEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+   if ( !_hDataEvent || !_hSpaceEvent )
+   {
+      CloseEvents();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void ByteRing::CloseEvents()
+{
+   if ( _hDataEvent )
+   {
+      CloseHandle( _hDataEvent );
+      _hDataEvent = NULL;
+   }
+
+   if ( _hSpaceEvent )
+   {
+      CloseHandle( _hSpaceEvent );
+      _hSpaceEvent = NULL;
+   }
+}
+
+DWORD ByteRing::GetSize() const
+{
+   return _size;
+}
+
+DWORD ByteRing::GetUsed() const
+{
+   return (DWORD)_head - (DWORD)_tail;
+}
+
+DWORD ByteRing::GetFree() const
+{
+   return _size - GetUsed();
+}
+
+void ByteRing::Reset()
+{
+   // release the space and wake the producer up if it's waiting.
+   InterlockedExchange( (LPLONG)&_tail, _head );
+   if ( _producerWaiting && InterlockedExchange( (LPLONG)&_producerWaiting, 0 ) )
+   {
+      SetEvent( _hSpaceEvent );
+   }
+}
+
+BOOL ByteRing::Write( const void* data, DWORD length )
+{
+   PacketSegment segment = { data, length };
+   return Write( &segment, 1 );
+}
+
+BOOL ByteRing::Write( const PacketSegment* pSegments, size_t count )
+{
+   DWORD length = 0;
+   for ( size_t i = 0; i < count; ++i )
+   {
+      length += pSegments[i].length;
+   }
+
+   if ( length > GetFree() )
+   {
+      return FALSE;
+   }
+
+   DWORD pos = (DWORD)_head;
+   for ( size_t i = 0; i < count; ++i )
+   {
+      copyTo( pos, pSegments[i].data, pSegments[i].length );
+      pos += pSegments[i].length;
+   }
+
+   // publish the data and wake the consumer up if it's waiting.
+   InterlockedExchange( (LPLONG)&_head, (LONG)pos );
+   if ( _consumerWaiting && InterlockedExchange( (LPLONG)&_consumerWaiting, 0 ) )
+   {
+      SetEvent( _hDataEvent );
+   }
+
+   return TRUE;
+}
+
+BOOL ByteRing::WaitForSpace( DWORD length, HANDLE hCancel, DWORD dwTimeout )
+{
+   // the consumer signals the event only if the waiting flag is set,
+   // so the space is checked again after the flag has been set.
+   while ( GetFree() < length )
+   {
+      InterlockedExchange( (LPLONG)&_producerWaiting, 1 );
+      if ( GetFree() >= length )
+      {
+         break;
+      }
+
+      if ( !wait( &_producerWaiting, _hSpaceEvent, hCancel, dwTimeout ) )
+      {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+DWORD ByteRing::Read( void* data, DWORD length )
+{
+   DWORD used = GetUsed();
+   if ( length > used )
+   {
+      length = used;
+   }
+
+   DWORD tail = (DWORD)_tail;
+   DWORD offset = tail & ( _size - 1 );
+   DWORD first = _size - offset;
+   if ( first > length )
+   {
+      first = length;
+   }
+
+   memcpy( data, _data + offset, first );
+   memcpy( (unsigned char*)data + first, _data, length - first );
+
+   // release the space and wake the producer up if it's waiting.
+   InterlockedExchange( (LPLONG)&_tail, (LONG)( tail + length ) );
+   if ( _producerWaiting && InterlockedExchange( (LPLONG)&_producerWaiting, 0 ) )
+   {
+      SetEvent( _hSpaceEvent );
+   }
+
+   return length;
+}
+
+BOOL ByteRing::WaitForData( HANDLE hCancel, DWORD dwTimeout )
+{
+   // the producer signals the event only if the waiting flag is set,
+   // so the ring is checked again after the flag has been set.
+   while ( 0 == GetUsed() )
+   {
+      InterlockedExchange( (LPLONG)&_consumerWaiting, 1 );
+      if ( 0 != GetUsed() )
+      {
+         break;
+      }
+
+      if ( !wait( &_consumerWaiting, _hDataEvent, hCancel, dwTimeout ) )
+      {
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+void ByteRing::copyTo( DWORD pos, const void* data, DWORD length )
+{
+   DWORD offset = pos & ( _size - 1 );
+   DWORD first = _size - offset;
+   if ( first > length )
+   {
+      first = length;
+   }
+
+   memcpy( _data + offset, data, first );
+   memcpy( _data, (const unsigned char*)data + first, length - first );
+}
+
+BOOL ByteRing::wait( volatile LONG* pWaiting, HANDLE hEvent, HANDLE hCancel, DWORD dwTimeout )
+{
+   HANDLE handles[] = { hEvent, hCancel };
+   DWORD dwRet = WaitForMultipleObjects( hCancel ? 2 : 1, handles, FALSE, dwTimeout );
+   if ( WAIT_OBJECT_0 != dwRet )
+   {
+      InterlockedExchange( (LPLONG)pWaiting, 0 );
+      if ( WAIT_OBJECT_0 + 1 == dwRet )
+      {
+         SetLastError( ERROR_OPERATION_ABORTED );
+      }
+      else if ( WAIT_TIMEOUT == dwRet )
+      {
+         SetLastError( ERROR_TIMEOUT );
+      }
+      return FALSE;
+   }
+
+   return TRUE;
+}
\ No newline at end of file
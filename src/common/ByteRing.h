@@ -0,0 +1,82 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BYTE_RING_H__
+#define __BYTE_RING_H__
+
+#include <windows.h>
+
+struct PacketSegment;
+
+// Single-producer/single-consumer ring of bytes over the caller's buffer.
+// The positions are free running counters, so the producer only moves the
+// head and the consumer only moves the tail. With the events created the sides
+// can wait for each other, an event is signaled only when the other side waits.
+class ByteRing
+{
+public:
+   // size must be a power of two.
+   ByteRing( void* buffer, DWORD dwSize );
+   ~ByteRing();
+
+public:
+   // creates the events the sides wait on.
+   BOOL CreateEvents();
+   void CloseEvents();
+
+   DWORD GetSize() const;
+   DWORD GetUsed() const;
+   DWORD GetFree() const;
+
+public: // producer methods.
+   // writes all the data or nothing if it doesn't fit.
+   BOOL Write( const void* data, DWORD length );
+   // writes all the segments one after another or nothing if they don't fit. the consumer
+   // sees them at once.
+   BOOL Write( const PacketSegment* pSegments, size_t count );
+   // waits until there is room for length bytes or hCancel is signaled.
+   BOOL WaitForSpace( DWORD length, HANDLE hCancel, DWORD dwTimeout );
+
+public: // consumer methods.
+   // reads up to length bytes, returns the number of bytes read.
+   DWORD Read( void* data, DWORD length );
+   // waits until there is data or hCancel is signaled.
+   BOOL WaitForData( HANDLE hCancel, DWORD dwTimeout );
+   // drops the data written so far.
+   void Reset();
+
+private:
+   ByteRing( const ByteRing& ring );
+   ByteRing& operator=( const ByteRing& ring );
+
+   void copyTo( DWORD pos, const void* data, DWORD length );
+   BOOL wait( volatile LONG* pWaiting, HANDLE hEvent, HANDLE hCancel, DWORD dwTimeout );
+
+private:
+   unsigned char* _data;
+   DWORD _size;
+   volatile LONG _head;    // write position. moved by the producer only.
+   volatile LONG _tail;    // read position. moved by the consumer only.
+   volatile LONG _consumerWaiting;
+   volatile LONG _producerWaiting;
+   HANDLE _hDataEvent;
+   HANDLE _hSpaceEvent;
+};
+
+#endif //__BYTE_RING_H__
\ No newline at end of file
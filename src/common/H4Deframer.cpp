@@ -0,0 +1,136 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "H4Deframer.h"
+#include <string.h>
+#include <assert.h>
+
+H4Deframer::H4Deframer( void* buffer, size_t size, size_t maxFrameSize, unsigned int typeMask )
+{
+   assert( buffer && size >= maxFrameSize );
+   _data = (unsigned char*)buffer;
+   _size = size;
+   _maxFrameSize = maxFrameSize;
+   _typeMask = typeMask;
+   _readPos = 0;
+   _writePos = 0;
+   _skipped = 0;
+}
+
+size_t H4Deframer::headerSize( unsigned char type ) const
+{
+   if ( type > H4_EVENT_PACKET || !( _typeMask & typeBit( type ) ) )
+   {
+      return 0;
+   }
+
+   switch ( type )
+   {
+   case H4_COMMAND_PACKET:    // opcode, 8 bit length.
+   case H4_SCO_DATA_PACKET:   // handle, 8 bit length.
+      return 3;
+   case H4_ACL_DATA_PACKET:   // handle, 16 bit length.
+      return 4;
+   case H4_EVENT_PACKET:      // event code, 8 bit length.
+      return 2;
+   default:
+      return 0;
+   }
+}
+
+unsigned char* H4Deframer::GetWriteBuffer( size_t& room )
+{
+   // move the partial frame to the start, so the rest of it is read behind it.
+   if ( _readPos > 0 )
+   {
+      memmove( _data, _data + _readPos, _writePos - _readPos );
+      _writePos -= _readPos;
+      _readPos = 0;
+   }
+
+   room = _size - _writePos;
+   return _data + _writePos;
+}
+
+void H4Deframer::Commit( size_t length )
+{
+   assert( length <= _size - _writePos );
+   _writePos += length;
+}
+
+const unsigned char* H4Deframer::Next( size_t& length )
+{
+   while ( _readPos < _writePos )
+   {
+      const unsigned char* frame = _data + _readPos;
+      size_t available = _writePos - _readPos;
+      size_t header = headerSize( frame[0] );
+      if ( 0 == header )
+      {
+         // not a packet type, resync on the next byte.
+         ++_readPos;
+         ++_skipped;
+         continue;
+      }
+
+      if ( available < 1 + header )
+      {
+         break;
+      }
+
+      size_t payload = ( H4_ACL_DATA_PACKET == frame[0] ) ? ( frame[3] | ( frame[4] << 8 ) ) : frame[header];
+      size_t frameSize = 1 + header + payload;
+      if ( frameSize > _maxFrameSize )
+      {
+         // the length can't be right, the type byte has been garbage.
+         ++_readPos;
+         ++_skipped;
+         continue;
+      }
+
+      if ( available < frameSize )
+      {
+         break;
+      }
+
+      _readPos += frameSize;
+      length = frameSize;
+      return frame;
+   }
+
+   length = 0;
+   return NULL;
+}
+
+size_t H4Deframer::GetSkipped() const
+{
+   return _skipped;
+}
+
+size_t H4Deframer::GetPending() const
+{
+   return _writePos - _readPos;
+}
+
+void H4Deframer::Reset()
+{
+   _readPos = 0;
+   _writePos = 0;
+   _skipped = 0;
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __H4_DEFRAMER_H__
+#define __H4_DEFRAMER_H__
+
+#include <stddef.h>
+
+// H4 packet types, the first byte of the HCI frame.
+enum H4_PACKET_TYPE {
+   H4_COMMAND_PACKET = 1,
+   H4_ACL_DATA_PACKET,
+   H4_SCO_DATA_PACKET,
+   H4_EVENT_PACKET
+};
+
+// Incremental H4 deframer over the caller's buffer. The stream is read in large
+// chunks right into the buffer and split into complete frames, one read may carry
+// several frames and a frame may span several reads. A byte that can't start an
+// accepted frame is skipped, so the deframer resyncs on garbage by itself.
+// It uses no platform calls.
+class H4Deframer
+{
+public:
+   // typeMask has a bit per accepted H4_PACKET_TYPE. frames longer than maxFrameSize
+   // are taken for garbage, the buffer must hold at least one such frame.
+   H4Deframer( void* buffer, size_t size, size_t maxFrameSize, unsigned int typeMask );
+
+public:
+   static unsigned int typeBit( int type ) { return 1u << type; }
+
+   // returns where the next chunk of the stream is read to and the room there.
+   unsigned char* GetWriteBuffer( size_t& room );
+   // accounts the bytes read to the write buffer.
+   void Commit( size_t length );
+   // returns the next complete frame starting with the packet type or NULL if more
+   // data is needed. the frame stays valid until the next GetWriteBuffer call.
+   const unsigned char* Next( size_t& length );
+
+   // returns the number of the garbage bytes skipped so far.
+   size_t GetSkipped() const;
+   // returns the number of the bytes buffered and not returned as frames yet.
+   size_t GetPending() const;
+   // drops the buffered data.
+   void Reset();
+
+private:
+   H4Deframer( const H4Deframer& deframer );
+   H4Deframer& operator=( const H4Deframer& deframer );
+
+   size_t headerSize( unsigned char type ) const;
+
+private:
+   unsigned char* _data;
+   size_t _size;
+   size_t _maxFrameSize;
+   unsigned int _typeMask;
+   size_t _readPos;
+   size_t _writePos;
+   size_t _skipped;
+};
+
+#endif //__H4_DEFRAMER_H__
\ No newline at end of file
@@ -20,7 +20,8 @@
 #ifndef __MSG_QUEUE_DEF_H__
 #define __MSG_QUEUE_DEF_H__
 
-#include "Packet.h"
+#include "Transport.h"
+#include "H4Deframer.h"
 
 #define ERROR_QUEUE_NAME               _T("{2EDAE8CC-DACE-4dc5-B7B3-ADB5318B61B5}")
 
@@ -35,16 +36,74 @@
 #endif
 
 #define MSG_QUEUE_WRITE_TIMEOUT     INFINITE
-#define MSG_BUFFER_SIZE             Packet::BUFFER_SIZE
+#define MSG_BUFFER_SIZE             ( 4 * 1024 )
+C_ASSERT( MSG_BUFFER_SIZE <= MsgQueueTransport::MAX_MESSAGE_SIZE );
 
-static HANDLE g_hReadQueue = NULL;
-static HANDLE g_hWriteQueue = NULL;
-static HANDLE g_hErrorQueue = NULL;
+// number of messages the queue can hold. each message in the queue takes one credit
+// from the writer, the reader gives it back by reading the message.
+#define MSG_QUEUE_DEPTH_VALNAME     _T("QueueDepth")
+#define MSG_QUEUE_DEFAULT_DEPTH     1
+#define MSG_QUEUE_MAX_DEPTH         64
+
+// number of HCI writes the driver may have in flight before it waits for their results.
+// 1 is stop-and-wait, every write waits for its own result.
+#define MSG_WRITE_WINDOW_VALNAME    _T("WriteWindow")
+#define MSG_DEFAULT_WRITE_WINDOW    1
+#define MSG_MAX_WRITE_WINDOW        MSG_QUEUE_MAX_DEPTH
+
+// lanes the driver coalesces the written HCI frames on, a bit per MSG_LANE. the frames are
+// collected into one batch message until it holds CoalesceSize bytes or its first frame is
+// CoalesceDelay ms old. the control and SCO lanes are never coalesced, the commands go out
+// at once and the SCO packets keep the even pace they are written at.
+#define MSG_COALESCE_LANES_VALNAME  _T("CoalesceLanes")
+#define MSG_DEFAULT_COALESCE_LANES  0
+#define MSG_COALESCE_DELAY_VALNAME  _T("CoalesceDelay")
+#define MSG_DEFAULT_COALESCE_DELAY  1
+#define MSG_MAX_COALESCE_DELAY      100
+#define MSG_COALESCE_SIZE_VALNAME   _T("CoalesceSize")
+#define MSG_DEFAULT_COALESCE_SIZE   MSG_BUFFER_SIZE
+
+// largest ACL payload the relay carries in one frame. the agent negotiates it from the
+// controller's buffer size and the size of a batched frame, the HCI transport advertises
+// the matching packet sizes to the stack. 0 means it's not negotiated yet.
+#define MSG_ACL_MTU_VALNAME         _T("AclMtu")
+#define MSG_MAX_ACL_MTU             ( HciBatchMsg::MAX_FRAME_SIZE - 1 - 4 )   // H4 type and ACL header.
+
+// transport of the read and write channels. the error queue is always a message queue.
+#define MSG_TRANSPORT_VALNAME       _T("Transport")
+#define MSG_TRANSPORT_QUEUE         0     // CE message queues.
+#define MSG_TRANSPORT_SHM           1     // shared memory rings.
+#define SHM_RING_SIZE               ( 64 * 1024 )
+
+// the read and write channels are split into lanes, each lane has its own queue or ring.
+// the readers serve the lanes in strict priority order, so the commands, events and control
+// messages never wait behind the data. the ACL lane can't starve, the control traffic is
+// small and the SCO data is limited by the air rate.
+enum MSG_LANE {
+   MSG_CONTROL_LANE = 0,   // control messages, HCI commands and events.
+   MSG_SCO_LANE,           // HCI SCO data.
+   MSG_ACL_LANE,           // HCI ACL data.
+   MSG_LANE_COUNT
+};
+
+// the lanes and the error queue of one driver instance. the names of the queues and
+// the rings include the instance number, so several instances can run side by side.
+struct MSG_CHANNELS {
+   MSG_CHANNELS() : hErrorQueue( NULL ) {
+      memset( pTransports, 0, sizeof( pTransports ) );
+   }
+
+   MsgQueueTransport queueTransports[MSG_LANE_COUNT];
+   ShmTransport shmTransports[MSG_LANE_COUNT];
+   Transport* pTransports[MSG_LANE_COUNT];   // the lanes, NULL until created first time.
+   HANDLE hErrorQueue;
+};
 
 enum PACKET_TYPE {
    HCI_DATA_PACKET = 0,
    HCI_DATA_ERROR_PACKET,
-   MESSAGE_PACKET
+   MESSAGE_PACKET,
+   HCI_DATA_BATCH_PACKET   // message queue only. several HCI frames in one message.
 };
 
 // messages ids for PACKET_TYPE::MESSAGE_PACKET
@@ -62,30 +121,299 @@ enum MESSAGE_ID {
    COM_CLOSE_MSG
 };
 
-BOOL CreateMsgQueues() {
+#include "MsgSchema.h"
+
+/**
+@func DWORD | ReadMsgQueueValue | Reads the message queue setting from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@parm LPCTSTR | szValName | Value name.
+@parm DWORD | dwDefault | Default value.
+@rdesc Returns the value or dwDefault if it's not set.
+*/
+DWORD ReadMsgQueueValue( LPCTSTR szRegKey, LPCTSTR szValName, DWORD dwDefault ) {
+   DWORD dwResult = dwDefault;
+
+   HKEY hk = NULL;
+   DWORD dwStatus = RegOpenKeyEx( HKEY_LOCAL_MACHINE, szRegKey, 0, 0, &hk );
+   if( dwStatus == ERROR_SUCCESS ) {
+      DWORD dwType, dwSize, dwValue;
+      dwSize = sizeof( dwValue );
+      dwStatus = RegQueryValueEx( hk, szValName, NULL, &dwType, (LPBYTE)&dwValue, &dwSize );
+      if( dwStatus == ERROR_SUCCESS && dwType == REG_DWORD ) {
+         dwResult = dwValue;
+      }
+
+      // release the registry key.
+      RegCloseKey( hk );
+      hk = NULL;
+   }
+
+   return dwResult;
+}
+
+/**
+@func BOOL | WriteMsgQueueValue | Writes the message queue setting to the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@parm LPCTSTR | szValName | Value name.
+@parm DWORD | dwValue | Value.
+@rdesc Returns TRUE on success.
+*/
+BOOL WriteMsgQueueValue( LPCTSTR szRegKey, LPCTSTR szValName, DWORD dwValue ) {
+   HKEY hk = NULL;
+   DWORD dwStatus = RegOpenKeyEx( HKEY_LOCAL_MACHINE, szRegKey, 0, 0, &hk );
+   if( dwStatus == ERROR_SUCCESS ) {
+      dwStatus = RegSetValueEx( hk, szValName, 0, REG_DWORD, (const BYTE*)&dwValue, sizeof( dwValue ) );
+
+      // release the registry key.
+      RegCloseKey( hk );
+      hk = NULL;
+   }
+
+   return ( dwStatus == ERROR_SUCCESS );
+}
+
+/**
+@func DWORD | ReadMsgQueueDepth | Reads the message queue depth from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the queue depth or MSG_QUEUE_DEFAULT_DEPTH if it's not set.
+*/
+DWORD ReadMsgQueueDepth( LPCTSTR szRegKey ) {
+   DWORD dwDepth = ReadMsgQueueValue( szRegKey, MSG_QUEUE_DEPTH_VALNAME, MSG_QUEUE_DEFAULT_DEPTH );
+   if ( !dwDepth ) {
+      return MSG_QUEUE_DEFAULT_DEPTH;
+   }
+
+   return dwDepth < MSG_QUEUE_MAX_DEPTH ? dwDepth : MSG_QUEUE_MAX_DEPTH;
+}
+
+/**
+@func DWORD | ReadMsgWriteWindow | Reads the driver's write window from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the write window or MSG_DEFAULT_WRITE_WINDOW if it's not set.
+*/
+DWORD ReadMsgWriteWindow( LPCTSTR szRegKey ) {
+   DWORD dwWindow = ReadMsgQueueValue( szRegKey, MSG_WRITE_WINDOW_VALNAME, MSG_DEFAULT_WRITE_WINDOW );
+   if ( !dwWindow ) {
+      return MSG_DEFAULT_WRITE_WINDOW;
+   }
+
+   return dwWindow < MSG_MAX_WRITE_WINDOW ? dwWindow : MSG_MAX_WRITE_WINDOW;
+}
+
+/**
+@func DWORD | ReadMsgCoalesceLanes | Reads the lanes the driver coalesces the writes on from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the lane bits, the control and SCO lane bits are always clear.
+*/
+DWORD ReadMsgCoalesceLanes( LPCTSTR szRegKey ) {
+   DWORD dwLanes = ReadMsgQueueValue( szRegKey, MSG_COALESCE_LANES_VALNAME, MSG_DEFAULT_COALESCE_LANES );
+   return dwLanes & ( ( 1 << MSG_LANE_COUNT ) - 1 ) & ~( ( 1 << MSG_CONTROL_LANE ) | ( 1 << MSG_SCO_LANE ) );
+}
+
+/**
+@func DWORD | ReadMsgCoalesceDelay | Reads the deadline of the coalesced writes from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the deadline in ms or MSG_DEFAULT_COALESCE_DELAY if it's not set.
+*/
+DWORD ReadMsgCoalesceDelay( LPCTSTR szRegKey ) {
+   DWORD dwDelay = ReadMsgQueueValue( szRegKey, MSG_COALESCE_DELAY_VALNAME, MSG_DEFAULT_COALESCE_DELAY );
+   if ( !dwDelay ) {
+      return MSG_DEFAULT_COALESCE_DELAY;
+   }
+
+   return dwDelay < MSG_MAX_COALESCE_DELAY ? dwDelay : MSG_MAX_COALESCE_DELAY;
+}
+
+/**
+@func DWORD | ReadMsgCoalesceSize | Reads the size the coalesced writes are sent at from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the size in bytes or MSG_DEFAULT_COALESCE_SIZE if it's not set.
+*/
+DWORD ReadMsgCoalesceSize( LPCTSTR szRegKey ) {
+   DWORD dwSize = ReadMsgQueueValue( szRegKey, MSG_COALESCE_SIZE_VALNAME, MSG_DEFAULT_COALESCE_SIZE );
+   if ( !dwSize ) {
+      return MSG_DEFAULT_COALESCE_SIZE;
+   }
+
+   return dwSize < MSG_DEFAULT_COALESCE_SIZE ? dwSize : MSG_DEFAULT_COALESCE_SIZE;
+}
+
+/**
+@func DWORD | ReadMsgTransport | Reads the channel transport from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns MSG_TRANSPORT_SHM or MSG_TRANSPORT_QUEUE.
+*/
+DWORD ReadMsgTransport( LPCTSTR szRegKey ) {
+   DWORD dwTransport = ReadMsgQueueValue( szRegKey, MSG_TRANSPORT_VALNAME, MSG_TRANSPORT_QUEUE );
+   return ( MSG_TRANSPORT_SHM == dwTransport ) ? MSG_TRANSPORT_SHM : MSG_TRANSPORT_QUEUE;
+}
+
+/**
+@func DWORD | NegotiateAclMtu | Returns the ACL MTU the relay uses with the controller.
+@parm DWORD | dwControllerMtu | Controller's ACL buffer size, 0 if it's unknown.
+@rdesc Returns the smaller of the controller's MTU and MSG_MAX_ACL_MTU, or 0 if the controller's one is unknown.
+*/
+DWORD NegotiateAclMtu( DWORD dwControllerMtu ) {
+   return dwControllerMtu < MSG_MAX_ACL_MTU ? dwControllerMtu : MSG_MAX_ACL_MTU;
+}
+
+/**
+@func DWORD | ReadMsgAclMtu | Reads the negotiated ACL MTU from the registry.
+@parm LPCTSTR | szRegKey | Driver's registry key.
+@rdesc Returns the MTU or 0 if it's not negotiated.
+*/
+DWORD ReadMsgAclMtu( LPCTSTR szRegKey ) {
+   return NegotiateAclMtu( ReadMsgQueueValue( szRegKey, MSG_ACL_MTU_VALNAME, 0 ) );
+}
+
+/**
+@func int | GetFrameLane | Returns the lane the HCI frame is sent over.
+@parm const void* | pFrame | HCI frame starting with the H4 packet type.
+@parm size_t | size | HCI frame size.
+@rdesc Returns MSG_LANE value.
+*/
+int GetFrameLane( const void* pFrame, size_t size ) {
+   switch ( size > 0 ? *(const unsigned char*)pFrame : 0 ) {
+   case H4_COMMAND_PACKET:
+   case H4_EVENT_PACKET:
+      return MSG_CONTROL_LANE;
+
+   case H4_SCO_DATA_PACKET:
+      return MSG_SCO_LANE;
+
+   default:
+      return MSG_ACL_LANE;
+   }
+}
+
+/**
+@func BOOL | CreateMsgQueues | Creates or opens the read and write channels and the error queue of the driver instance.
+@parm MSG_CHANNELS& | channels | Channels to create.
+@parm DWORD | dwInstance | Driver instance number, the index of the BTE device.
+@parm DWORD | dwDepth | Number of messages each queue can hold. Used only by the side that creates the queues.
+@parm DWORD | dwTransport | Transport of the read and write channels. Both sides must use the same one.
+@rdesc Returns TRUE on success.
+*/
+BOOL CreateMsgQueues( MSG_CHANNELS& channels, DWORD dwInstance, DWORD dwDepth = MSG_QUEUE_DEFAULT_DEPTH, DWORD dwTransport = MSG_TRANSPORT_QUEUE ) {
+   BOOL bRet = TRUE;
+   for ( int lane = 0; lane < MSG_LANE_COUNT && bRet; ++lane ) {
+      // the lanes are named after the channels.
+      TCHAR szReadName[MAX_PATH];
+      TCHAR szWriteName[MAX_PATH];
+      _stprintf( szReadName, _T("%s-%lu-%d"), READ_QUEUE_NAME, dwInstance, lane );
+      _stprintf( szWriteName, _T("%s-%lu-%d"), WRITE_QUEUE_NAME, dwInstance, lane );
+
+      if ( MSG_TRANSPORT_SHM == dwTransport ) {
+         bRet = channels.shmTransports[lane].Open( szReadName, szWriteName, SHM_RING_SIZE );
+         channels.pTransports[lane] = &channels.shmTransports[lane];
+      } else {
+         bRet = channels.queueTransports[lane].Open( szReadName, szWriteName, dwDepth, MSG_BUFFER_SIZE );
+         channels.pTransports[lane] = &channels.queueTransports[lane];
+      }
+   }
+   ASSERT( bRet );
+   if ( !bRet ) {
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         if ( channels.pTransports[lane] ) {
+            channels.pTransports[lane]->Close();
+            channels.pTransports[lane] = NULL;
+         }
+      }
+      return FALSE;
+   }
+
+   // the error queue holds the results of all the writes the driver may have in flight.
    MSGQUEUEOPTIONS msgQO; 
    memset( &msgQO, 0, sizeof( msgQO ) );
    msgQO.dwSize = sizeof( msgQO );
    msgQO.dwFlags = MSGQUEUE_ALLOW_BROKEN;
-   msgQO.dwMaxMessages = 1; /* just one message in the queue */
-   msgQO.cbMaxMessage = MSG_BUFFER_SIZE;
-   msgQO.bReadAccess = FALSE;
-   g_hWriteQueue = CreateMsgQueue( WRITE_QUEUE_NAME, &msgQO );
-   ASSERT( NULL != g_hWriteQueue );
-
-   msgQO.bReadAccess = TRUE;
-   g_hReadQueue = CreateMsgQueue( READ_QUEUE_NAME, &msgQO );
-   ASSERT( NULL != g_hReadQueue );
-
+   msgQO.dwMaxMessages = MSG_MAX_WRITE_WINDOW;
+   msgQO.cbMaxMessage = ErrorMsg::SIZE;
 #ifdef REMOTE_AGENT
    msgQO.bReadAccess = FALSE;
 #else
    msgQO.bReadAccess = TRUE;
 #endif
-   g_hErrorQueue = CreateMsgQueue( ERROR_QUEUE_NAME, &msgQO );
-   ASSERT( NULL != g_hErrorQueue );
+   TCHAR szErrorName[MAX_PATH];
+   _stprintf( szErrorName, _T("%s-%lu"), ERROR_QUEUE_NAME, dwInstance );
+   channels.hErrorQueue = CreateMsgQueue( szErrorName, &msgQO );
+   ASSERT( NULL != channels.hErrorQueue );
+
+   return ( channels.hErrorQueue != NULL );
+}
+
+/**
+@func void | CloseMsgQueues | Closes the read and write channels and the error queue.
+@parm MSG_CHANNELS& | channels | Channels to close.
+*/
+void CloseMsgQueues( MSG_CHANNELS& channels ) {
+   // the transports stay selected, the calls just fail until they're created again.
+   for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+      if ( channels.pTransports[lane] ) {
+         channels.pTransports[lane]->Close();
+      }
+   }
+
+   if ( channels.hErrorQueue ) {
+      CloseMsgQueue( channels.hErrorQueue );
+      channels.hErrorQueue = NULL;
+   }
+}
+
+/**
+@func BOOL | ReceiveFromLanes | Receives the message from the highest priority lane that has one.
+@parm MSG_CHANNELS& | channels | Channels to receive from.
+@parm void* | pBuffer | Buffer to receive the message to.
+@parm DWORD | dwSize | Buffer size.
+@parm DWORD* | pdwRead | Size of the message received.
+@parm DWORD | dwTimeout | Time to wait for a message on any lane.
+@parm HANDLE | hCancel | Event that stops the wait, may be NULL.
+@rdesc Returns TRUE on success. GetLastError returns ERROR_TIMEOUT if no message came in time and ERROR_OPERATION_ABORTED if hCancel has been signaled.
+*/
+BOOL ReceiveFromLanes( MSG_CHANNELS& channels, void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout, HANDLE hCancel = NULL ) {
+   DWORD dwStart = GetTickCount();
+   for (;;) {
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         if ( !channels.pTransports[lane] ) {
+            SetLastError( ERROR_INVALID_HANDLE );
+            return FALSE;
+         }
+         if ( channels.pTransports[lane]->Receive( pBuffer, dwSize, pdwRead, 0 ) ) {
+            return TRUE;
+         }
+         if ( ERROR_TIMEOUT != GetLastError() ) {
+            return FALSE;
+         }
+      }
+
+      DWORD dwWait = INFINITE;
+      if ( INFINITE != dwTimeout ) {
+         DWORD dwElapsed = GetTickCount() - dwStart;
+         if ( dwElapsed >= dwTimeout ) {
+            SetLastError( ERROR_TIMEOUT );
+            return FALSE;
+         }
+         dwWait = dwTimeout - dwElapsed;
+      }
+
+      // the handles are taken before each wait, the shared memory rings signal only a waiting side.
+      HANDLE handles[MSG_LANE_COUNT + 1];
+      for ( int lane = 0; lane < MSG_LANE_COUNT; ++lane ) {
+         handles[lane] = channels.pTransports[lane]->GetReceiveEvent();
+      }
+      handles[MSG_LANE_COUNT] = hCancel;
 
-   return ( g_hWriteQueue != NULL && g_hReadQueue != NULL && g_hErrorQueue != NULL );
+      DWORD dwRet = WaitForMultipleObjects( MSG_LANE_COUNT + ( hCancel ? 1 : 0 ), handles, FALSE, dwWait );
+      if ( WAIT_OBJECT_0 + MSG_LANE_COUNT == dwRet ) {
+         SetLastError( ERROR_OPERATION_ABORTED );
+         return FALSE;
+      } else if ( WAIT_TIMEOUT == dwRet ) {
+         SetLastError( ERROR_TIMEOUT );
+         return FALSE;
+      } else if ( WAIT_FAILED == dwRet ) {
+         return FALSE;
+      }
+   }
 }
 
 #endif //__MSG_QUEUE_DEF_H__
\ No newline at end of file
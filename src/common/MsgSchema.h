@@ -0,0 +1,318 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MSG_SCHEMA_H__
+#define __MSG_SCHEMA_H__
+
+#include "WireCodec.h"
+
+// Message layouts of the message queue protocol. Each message is declared once
+// as a list of fields at fixed offsets, so encoding and decoding is a sequence of
+// plain stores and loads with a single length check per message.
+// Fields are stored in the little-endian wire format of WireCodec.
+// Must be included after the PACKET_TYPE and MESSAGE_ID declarations.
+
+template < typename T, size_t Offset >
+struct MsgField
+{
+   enum { OFFSET = Offset };
+   enum { SIZE = sizeof( typename WireType< T >::type ) };
+   enum { END = Offset + SIZE };
+
+   static void store( unsigned char* buffer, T value )
+   {
+      WireCodec::store( buffer + OFFSET, value );
+   }
+
+   static T load( const unsigned char* buffer )
+   {
+      return WireCodec::load< T >( buffer + OFFSET );
+   }
+};
+
+// common header of all the messages.
+struct MsgHeader
+{
+   typedef MsgField< int, 0 > Type;
+   enum { SIZE = Type::END };
+
+   static bool decode( const void* buffer, size_t size, int& type )
+   {
+      if ( size < SIZE ) return false;
+      type = Type::load( (const unsigned char*)buffer );
+      return true;
+   }
+};
+
+// PACKET_TYPE::MESSAGE_PACKET message.
+struct ControlMsg
+{
+   typedef MsgHeader::Type Type;
+   typedef MsgField< int, Type::END > Id;
+   enum { SIZE = Id::END };
+
+   static size_t encode( void* buffer, int id )
+   {
+      Type::store( (unsigned char*)buffer, MESSAGE_PACKET );
+      Id::store( (unsigned char*)buffer, id );
+      return SIZE;
+   }
+
+   static bool decode( const void* buffer, size_t size, int& id )
+   {
+      if ( size < SIZE ) return false;
+      id = Id::load( (const unsigned char*)buffer );
+      return true;
+   }
+};
+
+// PACKET_TYPE::HCI_DATA_PACKET message. The header is the type, the sequence number
+// and the WireCodec array length prefix, the data follows the header.
+// Seq is the number the driver gives the frame when it writes it, the agent returns
+// it with the result of the frame in ErrorMsg::Seq. The frames to the driver carry 0.
+struct HciDataMsg
+{
+   typedef MsgHeader::Type Type;
+   typedef MsgField< DWORD, Type::END > Seq;
+   enum { LENGTH_OFFSET = Seq::END };
+   enum { HEADER_SIZE = LENGTH_OFFSET + WireCodec::MAX_LENGTH_SIZE }; // maximum header size.
+   enum { MAX_DATA_SIZE = MSG_BUFFER_SIZE - HEADER_SIZE };
+
+   // returns the actual header size.
+   static size_t encodeHeader( void* buffer, size_t length, DWORD seq )
+   {
+      Type::store( (unsigned char*)buffer, HCI_DATA_PACKET );
+      Seq::store( (unsigned char*)buffer, seq );
+      return LENGTH_OFFSET + WireCodec::storeLength( (unsigned char*)buffer + LENGTH_OFFSET, length );
+   }
+
+   // returns pointer to the data inside the buffer or NULL if the message is truncated.
+   static const unsigned char* decode( const void* buffer, size_t size, size_t& length, DWORD& seq )
+   {
+      if ( size < LENGTH_OFFSET ) return NULL;
+      seq = Seq::load( (const unsigned char*)buffer );
+      const unsigned char* data = (const unsigned char*)buffer + LENGTH_OFFSET;
+      size -= LENGTH_OFFSET;
+      size_t size_length = WireCodec::loadLength( data, size, length );
+      if ( !size_length ) return NULL;
+      if ( length > size - size_length ) return NULL;
+      return data + size_length;
+   }
+
+   static const unsigned char* decode( const void* buffer, size_t size, size_t& length )
+   {
+      DWORD seq = 0;
+      return decode( buffer, size, length, seq );
+   }
+};
+
+// PACKET_TYPE::HCI_DATA_BATCH_PACKET message. The header is the type and the sequence
+// number of the first frame, the frames are numbered one after another. The header is
+// followed by the frames, each one is the WireCodec array length prefix followed by the
+// frame data.
+struct HciBatchMsg
+{
+   typedef MsgHeader::Type Type;
+   typedef MsgField< DWORD, Type::END > Seq;
+   enum { HEADER_SIZE = Seq::END };
+   enum { MAX_FRAME_SIZE = MSG_BUFFER_SIZE - HEADER_SIZE - WireCodec::MAX_LENGTH_SIZE };
+
+   static size_t encodeHeader( void* buffer, DWORD seq )
+   {
+      Type::store( (unsigned char*)buffer, HCI_DATA_BATCH_PACKET );
+      Seq::store( (unsigned char*)buffer, seq );
+      return HEADER_SIZE;
+   }
+
+   // returns size of the encoded frame.
+   static size_t frameSize( size_t length )
+   {
+      return WireCodec::lengthSize( length ) + length;
+   }
+};
+
+// Appends HCI frames to a batch message in a caller-owned buffer.
+class HciBatchWriter
+{
+public:
+   HciBatchWriter()
+      : _data( NULL ), _size( 0 ), _writePos( 0 ), _reservePos( 0 ), _count( 0 )
+   {
+   }
+
+   HciBatchWriter( void* buffer, size_t size )
+      : _data( (unsigned char*)buffer ), _size( size ), _writePos( 0 ), _reservePos( 0 ), _count( 0 )
+   {
+   }
+
+   void attach( void* buffer, size_t size )
+   {
+      _data = (unsigned char*)buffer;
+      _size = size;
+      reset();
+   }
+
+   // returns false if the frame does not fit into the rest of the buffer.
+   bool append( const void* data, size_t length )
+   {
+      unsigned char* dest = reserve( length );
+      if ( !dest ) return false;
+      memcpy( dest, data, length );
+      commit( length );
+      return true;
+   }
+
+   // returns where the data of the frame goes or NULL if it does not fit, so the frame can
+   // be written in place. the frame is added by commit(), another reserve() drops it.
+   unsigned char* reserve( size_t length )
+   {
+      size_t pos = _count ? _writePos : HciBatchMsg::HEADER_SIZE;
+      if ( _size < pos || _size - pos < HciBatchMsg::frameSize( length ) ) return NULL;
+      if ( !_count ) HciBatchMsg::encodeHeader( _data, 0 );
+      _reservePos = pos + WireCodec::storeLength( _data + pos, length );
+      return _data + _reservePos;
+   }
+
+   // adds the frame written to the reserved place.
+   void commit( size_t length )
+   {
+      _writePos = _reservePos + length;
+      ++_count;
+   }
+
+   // numbers the frames from seq on. the batch must have a frame.
+   void number( DWORD seq )
+   {
+      if ( _count ) HciBatchMsg::Seq::store( _data, seq );
+   }
+
+   size_t count() const { return _count; }
+   size_t length() const { return _writePos; }
+   const unsigned char* data() const { return _data; }
+   void reset() { _writePos = 0; _count = 0; }
+
+private:
+   HciBatchWriter( const HciBatchWriter& batch );
+   HciBatchWriter& operator=( const HciBatchWriter& batch );
+
+private:
+   unsigned char* _data;
+   size_t _size;
+   size_t _writePos;
+   size_t _reservePos;
+   size_t _count;
+};
+
+// Iterates HCI frames of a batch message in place.
+class HciBatchReader
+{
+public:
+   HciBatchReader() : _data( NULL ), _readPos( 0 ), _size( 0 ), _seq( 0 )
+   {
+   }
+
+   HciBatchReader( const void* buffer, size_t size )
+   {
+      attach( buffer, size );
+   }
+
+   void attach( const void* buffer, size_t size )
+   {
+      _data = (const unsigned char*)buffer;
+      _readPos = HciBatchMsg::HEADER_SIZE;
+      _size = ( size < HciBatchMsg::HEADER_SIZE ) ? 0 : size;
+      _seq = _size ? HciBatchMsg::Seq::load( _data ) : 0;
+   }
+
+   void detach()
+   {
+      _data = NULL;
+      _readPos = 0;
+      _size = 0;
+      _seq = 0;
+   }
+
+   // returns pointer to the next frame or NULL if there are no more ( or the rest is truncated ).
+   const unsigned char* next( size_t& length )
+   {
+      DWORD seq = 0;
+      return next( length, seq );
+   }
+
+   // returns the sequence number of the frame too.
+   const unsigned char* next( size_t& length, DWORD& seq )
+   {
+      if ( _readPos >= _size ) return NULL;
+      size_t size_length = WireCodec::loadLength( _data + _readPos, _size - _readPos, length );
+      if ( !size_length || _size - _readPos - size_length < length )
+      {
+         _readPos = _size;
+         return NULL;
+      }
+      const unsigned char* frame = _data + _readPos + size_length;
+      _readPos += size_length + length;
+      seq = _seq++;
+      return frame;
+   }
+
+private:
+   HciBatchReader( const HciBatchReader& batch );
+   HciBatchReader& operator=( const HciBatchReader& batch );
+
+private:
+   const unsigned char* _data;
+   size_t _readPos;
+   size_t _size;
+   DWORD _seq;                // sequence number of the next frame.
+};
+
+// error queue message. Seq is the number of the HCI frame the result belongs to, the
+// one the driver has sent the frame with. the driver numbers the frames from 1.
+struct ErrorMsg
+{
+   typedef MsgField< DWORD, 0 > Code;
+   typedef MsgField< DWORD, Code::END > Seq;
+   enum { SIZE = Seq::END };
+
+   static size_t encode( void* buffer, DWORD code, DWORD seq )
+   {
+      Code::store( (unsigned char*)buffer, code );
+      Seq::store( (unsigned char*)buffer, seq );
+      return SIZE;
+   }
+
+   static bool decode( const void* buffer, size_t size, DWORD& code, DWORD& seq )
+   {
+      if ( size < SIZE ) return false;
+      code = Code::load( (const unsigned char*)buffer );
+      seq = Seq::load( (const unsigned char*)buffer );
+      return true;
+   }
+};
+
+// the layouts are part of the wire format, the desktop and the device side must agree on them.
+C_ASSERT( MsgHeader::SIZE == sizeof( int ) );
+C_ASSERT( ControlMsg::SIZE == 2 * sizeof( int ) );
+C_ASSERT( HciDataMsg::HEADER_SIZE == sizeof( int ) + sizeof( DWORD ) + WireCodec::MAX_LENGTH_SIZE );
+C_ASSERT( HciBatchMsg::HEADER_SIZE == sizeof( int ) + sizeof( DWORD ) );
+C_ASSERT( ErrorMsg::SIZE == 2 * sizeof( DWORD ) );
+C_ASSERT( HciDataMsg::MAX_DATA_SIZE > 0 );
+C_ASSERT( HciBatchMsg::MAX_FRAME_SIZE == HciDataMsg::MAX_DATA_SIZE );
+
+#endif //__MSG_SCHEMA_H__
\ No newline at end of file
@@ -0,0 +1,367 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ShmRing.h"
+#include "Transport.h"
+#include <assert.h>
+
+ShmRing::ShmRing()
+{
+   _hMapping = NULL;
+   _header = NULL;
+   _data = NULL;
+   _mask = 0;
+   _hDataEvent = NULL;
+   _hSpaceEvent = NULL;
+}
+
+ShmRing::~ShmRing()
+{
+   Close();
+}
+
+BOOL ShmRing::Create( LPCTSTR szName, DWORD dwSize )
+{
+   assert( dwSize && !( dwSize & ( dwSize - 1 ) ) );
+   if ( !szName || !dwSize || ( dwSize & ( dwSize - 1 ) ) )
+   {
+      SetLastError( ERROR_INVALID_PARAMETER );
+      return FALSE;
+   }
+
+   Close();
+
+   TCHAR szObject[MAX_PATH];
+   _stprintf( szObject, _T("%s-ring"), szName );
+   _hMapping = CreateFileMapping( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof( Header ) + dwSize, szObject );
+   if ( !_hMapping )
+   {
+      return FALSE;
+   }
+
+   BOOL bExists = ( ERROR_ALREADY_EXISTS == GetLastError() );
+   _header = (Header*)MapViewOfFile( _hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+   if ( !_header )
+   {
+      Close();
+      return FALSE;
+   }
+
+   // the side that creates the section initializes it and publishes it ready, the other one
+   // waits for that and uses its size.
+   if ( !bExists )
+   {
+      _header->head = 0;
+      _header->tail = 0;
+      _header->consumerWaiting = 0;
+      _header->producerWaiting = 0;
+      _header->size = dwSize;
+      InterlockedExchange( (LPLONG)&_header->ready, READY_MAGIC );
+   }
+   else
+   {
+      DWORD dwStart = GetTickCount();
+      // the interlocked read orders the loads of the header after it.
+      while ( READY_MAGIC != InterlockedCompareExchange( (LPLONG)&_header->ready, 0, 0 ) )
+      {
+         if ( GetTickCount() - dwStart >= READY_TIMEOUT )
+         {
+            Close();
+            SetLastError( ERROR_TIMEOUT );
+            return FALSE;
+         }
+         Sleep( READY_RETRY_DELAY );
+      }
+   }
+
+   if ( !_header->size || ( _header->size & ( _header->size - 1 ) ) )
+   {
+      Close();
+      SetLastError( ERROR_INVALID_DATA );
+      return FALSE;
+   }
+
+   _data = (unsigned char*)( _header + 1 );
+   _mask = _header->size - 1;
+
+   _stprintf( szObject, _T("%s-data"), szName );
+   _hDataEvent = CreateEvent( NULL, FALSE, FALSE, szObject );
+
+   _stprintf( szObject, _T("%s-space"), szName );
+   _hSpaceEvent = CreateEvent( NULL, FALSE, FALSE, szObject );
+
+   if ( !_hDataEvent || !_hSpaceEvent )
+   {
+      Close();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void ShmRing::Close()
+{
+   if ( _hDataEvent )
+   {
+      CloseHandle( _hDataEvent );
+      _hDataEvent = NULL;
+   }
+
+   if ( _hSpaceEvent )
+   {
+      CloseHandle( _hSpaceEvent );
+      _hSpaceEvent = NULL;
+   }
+
+   if ( _header )
+   {
+      UnmapViewOfFile( _header );
+      _header = NULL;
+   }
+
+   if ( _hMapping )
+   {
+      CloseHandle( _hMapping );
+      _hMapping = NULL;
+   }
+
+   _data = NULL;
+   _mask = 0;
+}
+
+BOOL ShmRing::IsOpen() const
+{
+   return ( NULL != _header );
+}
+
+DWORD ShmRing::used() const
+{
+   return (DWORD)_header->head - (DWORD)_header->tail;
+}
+
+void ShmRing::copyTo( DWORD pos, const void* data, DWORD length )
+{
+   DWORD offset = pos & _mask;
+   DWORD first = _header->size - offset;
+   if ( first > length )
+   {
+      first = length;
+   }
+
+   memcpy( _data + offset, data, first );
+   memcpy( _data, (const unsigned char*)data + first, length - first );
+}
+
+void ShmRing::copyFrom( DWORD pos, void* data, DWORD length ) const
+{
+   DWORD offset = pos & _mask;
+   DWORD first = _header->size - offset;
+   if ( first > length )
+   {
+      first = length;
+   }
+
+   memcpy( data, _data + offset, first );
+   memcpy( (unsigned char*)data + first, _data, length - first );
+}
+
+BOOL ShmRing::wait( volatile LONG* pWaiting, HANDLE hEvent, DWORD dwStart, DWORD dwTimeout )
+{
+   DWORD dwWait = INFINITE;
+   if ( INFINITE != dwTimeout )
+   {
+      DWORD dwElapsed = GetTickCount() - dwStart;
+      if ( dwElapsed >= dwTimeout )
+      {
+         InterlockedExchange( (LPLONG)pWaiting, 0 );
+         SetLastError( ERROR_TIMEOUT );
+         return FALSE;
+      }
+      dwWait = dwTimeout - dwElapsed;
+   }
+
+   DWORD dwRet = WaitForSingleObject( hEvent, dwWait );
+   if ( WAIT_OBJECT_0 != dwRet )
+   {
+      InterlockedExchange( (LPLONG)pWaiting, 0 );
+      SetLastError( WAIT_TIMEOUT == dwRet ? ERROR_TIMEOUT : GetLastError() );
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+BOOL ShmRing::Write( const PacketSegment* pSegments, size_t count, DWORD dwTimeout )
+{
+   if ( !_header )
+   {
+      SetLastError( ERROR_INVALID_HANDLE );
+      return FALSE;
+   }
+
+   DWORD dwLength = 0;
+   for ( size_t i = 0; i < count; ++i )
+   {
+      dwLength += pSegments[i].length;
+   }
+
+   DWORD dwTotal = sizeof( DWORD ) + dwLength;
+   if ( dwTotal > _header->size )
+   {
+      SetLastError( ERROR_INSUFFICIENT_BUFFER );
+      return FALSE;
+   }
+
+   // wait for space. the consumer signals the event only if the waiting flag is set,
+   // so the space is checked again after the flag has been set.
+   DWORD dwStart = ( 0 == dwTimeout || INFINITE == dwTimeout ) ? 0 : GetTickCount();
+   while ( _header->size - used() < dwTotal )
+   {
+      InterlockedExchange( (LPLONG)&_header->producerWaiting, 1 );
+      if ( _header->size - used() >= dwTotal )
+      {
+         break;
+      }
+
+      if ( !wait( &_header->producerWaiting, _hSpaceEvent, dwStart, dwTimeout ) )
+      {
+         return FALSE;
+      }
+   }
+
+   DWORD head = (DWORD)_header->head;
+   copyTo( head, &dwLength, sizeof( dwLength ) );
+   DWORD pos = head + sizeof( dwLength );
+   for ( size_t i = 0; i < count; ++i )
+   {
+      copyTo( pos, pSegments[i].data, pSegments[i].length );
+      pos += pSegments[i].length;
+   }
+
+   // publish the message and wake the consumer up if it's waiting.
+   InterlockedExchange( (LPLONG)&_header->head, (LONG)pos );
+   if ( _header->consumerWaiting && InterlockedExchange( (LPLONG)&_header->consumerWaiting, 0 ) )
+   {
+      SetEvent( _hDataEvent );
+   }
+
+   return TRUE;
+}
+
+DWORD ShmRing::GetCredits( DWORD dwMessageSize ) const
+{
+   if ( !_header )
+   {
+      return 0;
+   }
+
+   return ( _header->size - used() ) / ( sizeof( DWORD ) + dwMessageSize );
+}
+
+HANDLE ShmRing::GetSpaceEvent( DWORD dwMessageSize )
+{
+   if ( _header )
+   {
+      InterlockedExchange( (LPLONG)&_header->producerWaiting, 1 );
+      if ( GetCredits( dwMessageSize ) )
+      {
+         SetEvent( _hSpaceEvent );
+      }
+   }
+
+   return _hSpaceEvent;
+}
+
+BOOL ShmRing::Read( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout )
+{
+   if ( pdwRead )
+   {
+      *pdwRead = 0;
+   }
+
+   if ( !_header )
+   {
+      SetLastError( ERROR_INVALID_HANDLE );
+      return FALSE;
+   }
+
+   // wait for data. the producer signals the event only if the waiting flag is set,
+   // so the ring is checked again after the flag has been set.
+   DWORD dwStart = ( 0 == dwTimeout || INFINITE == dwTimeout ) ? 0 : GetTickCount();
+   while ( 0 == used() )
+   {
+      InterlockedExchange( (LPLONG)&_header->consumerWaiting, 1 );
+      if ( 0 != used() )
+      {
+         break;
+      }
+
+      if ( !wait( &_header->consumerWaiting, _hDataEvent, dwStart, dwTimeout ) )
+      {
+         return FALSE;
+      }
+   }
+
+   if ( _header->consumerWaiting )
+   {
+      InterlockedExchange( (LPLONG)&_header->consumerWaiting, 0 );
+   }
+
+   BOOL bRet = TRUE;
+   DWORD tail = (DWORD)_header->tail;
+   DWORD dwLength = 0;
+   copyFrom( tail, &dwLength, sizeof( dwLength ) );
+   if ( dwLength > dwSize )
+   {
+      // the message doesn't fit and is dropped, like the message queue does.
+      SetLastError( ERROR_INSUFFICIENT_BUFFER );
+      bRet = FALSE;
+   }
+   else
+   {
+      copyFrom( tail + sizeof( dwLength ), pBuffer, dwLength );
+      if ( pdwRead )
+      {
+         *pdwRead = dwLength;
+      }
+   }
+
+   // release the space and wake the producer up if it's waiting.
+   InterlockedExchange( (LPLONG)&_header->tail, (LONG)( tail + sizeof( dwLength ) + dwLength ) );
+   if ( _header->producerWaiting && InterlockedExchange( (LPLONG)&_header->producerWaiting, 0 ) )
+   {
+      SetEvent( _hSpaceEvent );
+   }
+
+   return bRet;
+}
+
+HANDLE ShmRing::GetDataEvent()
+{
+   if ( _header )
+   {
+      InterlockedExchange( (LPLONG)&_header->consumerWaiting, 1 );
+      if ( 0 != used() )
+      {
+         SetEvent( _hDataEvent );
+      }
+   }
+
+   return _hDataEvent;
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <windows.h>
+
+struct PacketSegment;
+
+// Single-producer/single-consumer ring of messages in a named shared memory
+// section. Each message is a 32 bit length followed by the data, messages may
+// wrap around the end of the ring. The positions are free running counters, so
+// the producer only moves the head and the consumer only moves the tail.
+// The named events are signaled only when the other side is waiting, so a busy
+// consumer or producer costs no kernel calls.
+class ShmRing
+{
+public:
+   ShmRing();
+   ~ShmRing();
+
+public:
+   // creates or opens the ring. size must be a power of two. the side that opens the ring
+   // waits up to READY_TIMEOUT ms for the creator to initialize it.
+   BOOL Create( LPCTSTR szName, DWORD dwSize );
+   void Close();
+   BOOL IsOpen() const;
+
+public: // producer methods.
+   // writes the segments as one message.
+   BOOL Write( const PacketSegment* pSegments, size_t count, DWORD dwTimeout );
+   // returns the number of messages of the given size that can be written without blocking.
+   DWORD GetCredits( DWORD dwMessageSize ) const;
+   // returns event signaled when the consumer frees space for a message of the given size.
+   HANDLE GetSpaceEvent( DWORD dwMessageSize );
+
+public: // consumer methods.
+   BOOL Read( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout );
+   // returns event signaled when the producer writes data.
+   HANDLE GetDataEvent();
+
+private:
+   ShmRing( const ShmRing& ring );
+   ShmRing& operator=( const ShmRing& ring );
+
+private:
+   enum {
+      READY_MAGIC = 0x676e6952,        // "Ring", set by the creator once the header is initialized.
+      READY_TIMEOUT = 1000,
+      READY_RETRY_DELAY = 10
+   };
+
+   struct Header
+   {
+      volatile LONG head;              // write position. moved by the producer only.
+      volatile LONG tail;              // read position. moved by the consumer only.
+      volatile LONG consumerWaiting;   // set when the consumer waits for data.
+      volatile LONG producerWaiting;   // set when the producer waits for space.
+      DWORD size;
+      volatile LONG ready;             // READY_MAGIC, published last.
+   };
+
+   DWORD used() const;
+   void copyTo( DWORD pos, const void* data, DWORD length );
+   void copyFrom( DWORD pos, void* data, DWORD length ) const;
+   BOOL wait( volatile LONG* pWaiting, HANDLE hEvent, DWORD dwStart, DWORD dwTimeout );
+
+private:
+   HANDLE _hMapping;
+   Header* _header;
+   unsigned char* _data;
+   DWORD _mask;
+   HANDLE _hDataEvent;
+   HANDLE _hSpaceEvent;
+};
+
+#endif //__SHM_RING_H__
\ No newline at end of file
@@ -0,0 +1,453 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Transport.h"
+#include <msgqueue.h>
+
+//
+// Transport
+//
+
+BOOL Transport::Coalesce( const PacketSegment* pSegments, size_t count, void* pBuffer, size_t size, size_t* pLength )
+{
+   *pLength = 0;
+   for ( size_t i = 0; i < count; ++i )
+   {
+      if ( pSegments[i].length > size - *pLength )
+      {
+         *pLength = 0;
+         return FALSE;
+      }
+      memcpy( (unsigned char*)pBuffer + *pLength, pSegments[i].data, pSegments[i].length );
+      *pLength += pSegments[i].length;
+   }
+
+   return TRUE;
+}
+
+//
+// MsgQueueTransport
+//
+
+MsgQueueTransport::MsgQueueTransport()
+{
+   _hReadQueue = NULL;
+   _hWriteQueue = NULL;
+}
+
+MsgQueueTransport::~MsgQueueTransport()
+{
+   Close();
+}
+
+BOOL MsgQueueTransport::Open( LPCTSTR szReadName, LPCTSTR szWriteName, DWORD dwDepth, DWORD dwMaxMessage )
+{
+   Close();
+
+   MSGQUEUEOPTIONS msgQO;
+   memset( &msgQO, 0, sizeof( msgQO ) );
+   msgQO.dwSize = sizeof( msgQO );
+   msgQO.dwFlags = MSGQUEUE_ALLOW_BROKEN;
+   msgQO.dwMaxMessages = dwDepth;
+   msgQO.cbMaxMessage = dwMaxMessage;
+   msgQO.bReadAccess = FALSE;
+   _hWriteQueue = CreateMsgQueue( szWriteName, &msgQO );
+
+   msgQO.bReadAccess = TRUE;
+   _hReadQueue = CreateMsgQueue( szReadName, &msgQO );
+
+   if ( !_hWriteQueue || !_hReadQueue )
+   {
+      Close();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void MsgQueueTransport::Close()
+{
+   if ( _hWriteQueue )
+   {
+      CloseMsgQueue( _hWriteQueue );
+      _hWriteQueue = NULL;
+   }
+
+   if ( _hReadQueue )
+   {
+      CloseMsgQueue( _hReadQueue );
+      _hReadQueue = NULL;
+   }
+}
+
+BOOL MsgQueueTransport::IsOpen() const
+{
+   return ( NULL != _hWriteQueue && NULL != _hReadQueue );
+}
+
+BOOL MsgQueueTransport::Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout )
+{
+   // message queues have no gather write, so several segments are coalesced once
+   // on the stack. a single segment is written in place.
+   if ( 1 == count )
+   {
+      return WriteMsgQueue( _hWriteQueue, (LPVOID)pSegments[0].data, pSegments[0].length, dwTimeout, 0 );
+   }
+
+   unsigned char buffer[MAX_MESSAGE_SIZE];
+   size_t size = 0;
+   if ( !Coalesce( pSegments, count, buffer, sizeof( buffer ), &size ) )
+   {
+      SetLastError( ERROR_INSUFFICIENT_BUFFER );
+      return FALSE;
+   }
+
+   return WriteMsgQueue( _hWriteQueue, buffer, size, dwTimeout, 0 );
+}
+
+BOOL MsgQueueTransport::Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout )
+{
+   DWORD dwFlags = 0;
+   return ReadMsgQueue( _hReadQueue, pBuffer, dwSize, pdwRead, dwTimeout, &dwFlags );
+}
+
+DWORD MsgQueueTransport::GetCredits( DWORD dwMessageSize )
+{
+   // every message takes one queue entry whatever its size is.
+   MSGQUEUEINFO info;
+   memset( &info, 0, sizeof( info ) );
+   info.dwSize = sizeof( info );
+   if ( !GetMsgQueueInfo( _hWriteQueue, &info ) || info.dwCurrentMessages >= info.dwMaxMessages )
+   {
+      return 0;
+   }
+
+   return info.dwMaxMessages - info.dwCurrentMessages;
+}
+
+HANDLE MsgQueueTransport::GetReceiveEvent()
+{
+   return _hReadQueue;
+}
+
+HANDLE MsgQueueTransport::GetSendEvent( DWORD dwMessageSize )
+{
+   return _hWriteQueue;
+}
+
+//
+// ShmTransport
+//
+
+ShmTransport::ShmTransport()
+{
+}
+
+ShmTransport::~ShmTransport()
+{
+   Close();
+}
+
+BOOL ShmTransport::Open( LPCTSTR szReadName, LPCTSTR szWriteName, DWORD dwSize )
+{
+   if ( !_writeRing.Create( szWriteName, dwSize ) || !_readRing.Create( szReadName, dwSize ) )
+   {
+      Close();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+void ShmTransport::Close()
+{
+   _writeRing.Close();
+   _readRing.Close();
+}
+
+BOOL ShmTransport::IsOpen() const
+{
+   return ( _writeRing.IsOpen() && _readRing.IsOpen() );
+}
+
+BOOL ShmTransport::Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout )
+{
+   return _writeRing.Write( pSegments, count, dwTimeout );
+}
+
+BOOL ShmTransport::Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout )
+{
+   return _readRing.Read( pBuffer, dwSize, pdwRead, dwTimeout );
+}
+
+DWORD ShmTransport::GetCredits( DWORD dwMessageSize )
+{
+   return _writeRing.GetCredits( dwMessageSize );
+}
+
+HANDLE ShmTransport::GetReceiveEvent()
+{
+   return _readRing.GetDataEvent();
+}
+
+HANDLE ShmTransport::GetSendEvent( DWORD dwMessageSize )
+{
+   return _writeRing.GetSpaceEvent( dwMessageSize );
+}
+
+//
+// FileTransport
+//
+
+FileTransport::FileTransport()
+{
+   InitializeCriticalSection( &_cs );
+   _hFile = INVALID_HANDLE_VALUE;
+   _lUsers = 0;
+   _bClosing = FALSE;
+}
+
+FileTransport::~FileTransport()
+{
+   Close();
+   DeleteCriticalSection( &_cs );
+}
+
+BOOL FileTransport::Open( LPCTSTR szFileName )
+{
+   Close();
+
+   EnterCriticalSection( &_cs );
+   if ( INVALID_HANDLE_VALUE != _hFile )
+   {
+      // a call still uses the previous handle.
+      LeaveCriticalSection( &_cs );
+      SetLastError( ERROR_BUSY );
+      return FALSE;
+   }
+
+   _hFile = CreateFile( szFileName,
+      GENERIC_READ | GENERIC_WRITE,
+      0,                            // comm devices must be opened w/exclusive-access
+      NULL,                         // no security attrs
+      OPEN_EXISTING,                // comm devices must use OPEN_EXISTING
+      FILE_ATTRIBUTE_NORMAL,
+      NULL                          // hTemplate must be NULL for comm devices
+      );
+
+   BOOL bRet = ( INVALID_HANDLE_VALUE != _hFile );
+   LeaveCriticalSection( &_cs );
+   return bRet;
+}
+
+HANDLE FileTransport::GetHandle() const
+{
+   return _hFile;
+}
+
+void FileTransport::Close()
+{
+   EnterCriticalSection( &_cs );
+   if ( INVALID_HANDLE_VALUE == _hFile || _bClosing )
+   {
+      LeaveCriticalSection( &_cs );
+      return;
+   }
+
+   if ( 0 == _lUsers )
+   {
+      CloseHandle( _hFile );
+      _hFile = INVALID_HANDLE_VALUE;
+      LeaveCriticalSection( &_cs );
+      return;
+   }
+
+   // the last call closes the handle. the abort ends only the calls already in the device,
+   // so it's repeated for a call that is just entering it.
+   _bClosing = TRUE;
+   DWORD dwStart = GetTickCount();
+   while ( _bClosing && GetTickCount() - dwStart < CLOSE_TIMEOUT )
+   {
+      PurgeComm( _hFile, PURGE_RXABORT | PURGE_TXABORT );
+      LeaveCriticalSection( &_cs );
+      Sleep( RETRY_DELAY );
+      EnterCriticalSection( &_cs );
+   }
+   LeaveCriticalSection( &_cs );
+}
+
+BOOL FileTransport::IsOpen() const
+{
+   EnterCriticalSection( &_cs );
+   BOOL bRet = ( INVALID_HANDLE_VALUE != _hFile && !_bClosing );
+   LeaveCriticalSection( &_cs );
+   return bRet;
+}
+
+HANDLE FileTransport::acquire()
+{
+   HANDLE hFile = INVALID_HANDLE_VALUE;
+   EnterCriticalSection( &_cs );
+   if ( INVALID_HANDLE_VALUE != _hFile && !_bClosing )
+   {
+      hFile = _hFile;
+      ++_lUsers;
+   }
+   LeaveCriticalSection( &_cs );
+
+   if ( INVALID_HANDLE_VALUE == hFile )
+   {
+      SetLastError( ERROR_INVALID_HANDLE );
+   }
+   return hFile;
+}
+
+void FileTransport::release()
+{
+   EnterCriticalSection( &_cs );
+   if ( 0 == --_lUsers && _bClosing )
+   {
+      CloseHandle( _hFile );
+      _hFile = INVALID_HANDLE_VALUE;
+      _bClosing = FALSE;
+   }
+   LeaveCriticalSection( &_cs );
+}
+
+BOOL FileTransport::Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout )
+{
+   HANDLE hFile = acquire();
+   if ( INVALID_HANDLE_VALUE == hFile )
+   {
+      return FALSE;
+   }
+
+   BOOL bRet = TRUE;
+   DWORD dwStart = GetTickCount();
+   DWORD dwWritten = 0;
+   for ( size_t i = 0; i < count && bRet; ++i )
+   {
+      const unsigned char* pData = (const unsigned char*)pSegments[i].data;
+      DWORD dwFilledSoFar = 0;
+      while ( dwFilledSoFar < pSegments[i].length )
+      {
+         if ( dwWritten > 0 && INFINITE != dwTimeout && GetTickCount() - dwStart >= dwTimeout )
+         {
+            SetLastError( ERROR_TIMEOUT );
+            bRet = FALSE;
+            break;
+         }
+
+         DWORD dwWrit = 0;
+         if ( !WriteFile( hFile, pData + dwFilledSoFar, pSegments[i].length - dwFilledSoFar, &dwWrit, NULL ) && 0 == dwWrit )
+         {
+            bRet = FALSE;
+            break;
+         }
+
+         if ( 0 == dwWrit )
+         {
+            // the write timeout of the device has elapsed without taking anything.
+            SetLastError( ERROR_WRITE_FAULT );
+            bRet = FALSE;
+            break;
+         }
+
+         dwFilledSoFar += dwWrit;
+         dwWritten += dwWrit;
+      }
+   }
+
+   release();
+   return bRet;
+}
+
+BOOL FileTransport::Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout )
+{
+   HANDLE hFile = acquire();
+   if ( INVALID_HANDLE_VALUE == hFile )
+   {
+      return FALSE;
+   }
+
+   // a read that times out on the device returns nothing, it's repeated after RETRY_DELAY
+   // until the timeout of the call, so the read timeouts of the device that return at once
+   // don't make it spin. a partial read is a success.
+   BOOL bRet = FALSE;
+   DWORD dwRead = 0;
+   DWORD dwStart = GetTickCount();
+   for (;;)
+   {
+      bRet = ReadFile( hFile, pBuffer, dwSize, &dwRead, NULL );
+      if ( dwRead > 0 || !bRet || 0 == dwSize )
+      {
+         bRet = ( bRet || dwRead > 0 );
+         break;
+      }
+
+      if ( !IsOpen() )
+      {
+         SetLastError( ERROR_OPERATION_ABORTED );
+         bRet = FALSE;
+         break;
+      }
+
+      DWORD dwDelay = RETRY_DELAY;
+      if ( INFINITE != dwTimeout )
+      {
+         DWORD dwElapsed = GetTickCount() - dwStart;
+         if ( dwElapsed >= dwTimeout )
+         {
+            SetLastError( ERROR_TIMEOUT );
+            bRet = FALSE;
+            break;
+         }
+         if ( dwTimeout - dwElapsed < dwDelay )
+         {
+            dwDelay = dwTimeout - dwElapsed;
+         }
+      }
+      Sleep( dwDelay );
+   }
+
+   if ( pdwRead )
+   {
+      *pdwRead = dwRead;
+   }
+
+   release();
+   return bRet;
+}
+
+DWORD FileTransport::GetCredits( DWORD dwMessageSize )
+{
+   // the writes block until the device takes the data.
+   return 1;
+}
+
+HANDLE FileTransport::GetReceiveEvent()
+{
+   // the stream device can't be waited for.
+   return NULL;
+}
+
+HANDLE FileTransport::GetSendEvent( DWORD dwMessageSize )
+{
+   return NULL;
+}
\ No newline at end of file
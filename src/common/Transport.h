@@ -0,0 +1,169 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <windows.h>
+#include "ShmRing.h"
+
+// Describes one contiguous piece of a message.
+struct PacketSegment
+{
+   const void* data;
+   size_t length;
+};
+
+// Bidirectional link the packets are sent over. Message transports keep the
+// message boundaries, stream transports ( FileTransport ) don't.
+class Transport
+{
+public:
+   virtual ~Transport() {}
+
+public:
+   virtual void Close() = 0;
+   virtual BOOL IsOpen() const = 0;
+
+   // sends the segments as one message ( or one piece of the stream ).
+   virtual BOOL Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout ) = 0;
+   // receives one message ( or the available part of the stream ).
+   virtual BOOL Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout ) = 0;
+
+   // returns the number of messages of the given size that can be sent without blocking.
+   // the callers size their batches with it.
+   virtual DWORD GetCredits( DWORD dwMessageSize ) = 0;
+
+   // return handles signaled when there is data to receive or room to send.
+   // the handles must be taken again before each wait.
+   virtual HANDLE GetReceiveEvent() = 0;
+   virtual HANDLE GetSendEvent( DWORD dwMessageSize ) = 0;
+
+public:
+   // copies the segments one after another into the buffer, for the transports without
+   // a gather write. returns FALSE if they don't fit.
+   static BOOL Coalesce( const PacketSegment* pSegments, size_t count, void* pBuffer, size_t size, size_t* pLength );
+};
+
+// CE point-to-point message queues.
+class MsgQueueTransport : public Transport
+{
+public:
+   enum { MAX_MESSAGE_SIZE = 4 * 1024 }; // largest message Send coalesces from several segments.
+
+public:
+   MsgQueueTransport();
+   virtual ~MsgQueueTransport();
+
+public:
+   // creates or opens the queues. dwDepth is used only by the side that creates them.
+   BOOL Open( LPCTSTR szReadName, LPCTSTR szWriteName, DWORD dwDepth, DWORD dwMaxMessage );
+
+   virtual void Close();
+   virtual BOOL IsOpen() const;
+   virtual BOOL Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout );
+   virtual BOOL Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout );
+   virtual DWORD GetCredits( DWORD dwMessageSize );
+   virtual HANDLE GetReceiveEvent();
+   virtual HANDLE GetSendEvent( DWORD dwMessageSize );
+
+private:
+   MsgQueueTransport( const MsgQueueTransport& transport );
+   MsgQueueTransport& operator=( const MsgQueueTransport& transport );
+
+private:
+   HANDLE _hReadQueue;
+   HANDLE _hWriteQueue;
+};
+
+// Pair of shared memory rings.
+class ShmTransport : public Transport
+{
+public:
+   ShmTransport();
+   virtual ~ShmTransport();
+
+public:
+   // creates or opens the rings. dwSize is used only by the side that creates them.
+   BOOL Open( LPCTSTR szReadName, LPCTSTR szWriteName, DWORD dwSize );
+
+   virtual void Close();
+   virtual BOOL IsOpen() const;
+   virtual BOOL Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout );
+   virtual BOOL Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout );
+   virtual DWORD GetCredits( DWORD dwMessageSize );
+   virtual HANDLE GetReceiveEvent();
+   virtual HANDLE GetSendEvent( DWORD dwMessageSize );
+
+private:
+   ShmTransport( const ShmTransport& transport );
+   ShmTransport& operator=( const ShmTransport& transport );
+
+private:
+   ShmRing _readRing;
+   ShmRing _writeRing;
+};
+
+// Stream device opened with CreateFile, e.g. the BTE1: port. Each call blocks for
+// the timeouts set on the device, the timeout of the call is checked between them.
+// Close can be called while the other threads send and receive, the handle is
+// closed when the last call using it returns.
+class FileTransport : public Transport
+{
+public:
+   enum {
+      CLOSE_TIMEOUT = 1000,               // ms Close waits for the calls in progress to return.
+      RETRY_DELAY = 10                    // ms between the aborts of Close and between the empty reads.
+   };
+
+public:
+   FileTransport();
+   virtual ~FileTransport();
+
+public:
+   BOOL Open( LPCTSTR szFileName );
+   HANDLE GetHandle() const;
+
+   // aborts the reads and writes in progress with PurgeComm and closes the handle when they
+   // return. if they don't return in CLOSE_TIMEOUT, the last of them closes it.
+   virtual void Close();
+   virtual BOOL IsOpen() const;
+   // writes all the segments.
+   virtual BOOL Send( const PacketSegment* pSegments, size_t count, DWORD dwTimeout );
+   virtual BOOL Receive( void* pBuffer, DWORD dwSize, DWORD* pdwRead, DWORD dwTimeout );
+   virtual DWORD GetCredits( DWORD dwMessageSize );
+   virtual HANDLE GetReceiveEvent();
+   virtual HANDLE GetSendEvent( DWORD dwMessageSize );
+
+private:
+   FileTransport( const FileTransport& transport );
+   FileTransport& operator=( const FileTransport& transport );
+
+   // returns the handle for a call or INVALID_HANDLE_VALUE if the transport is closed.
+   HANDLE acquire();
+   void release();
+
+private:
+   mutable CRITICAL_SECTION _cs;          // guards the handle and the calls using it.
+   HANDLE _hFile;
+   LONG _lUsers;                          // number of the calls using the handle.
+   BOOL _bClosing;                        // the handle is closed by the last call.
+};
+
+#endif //__TRANSPORT_H__
\ No newline at end of file
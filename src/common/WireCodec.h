@@ -0,0 +1,152 @@
+/**
+ *   This file is part of Bluetooth for Microsoft Device Emulator
+ *
+ *   Copyright (C) 2008-2009 Dmitry Klionsky aka ten0s <dm.klionsky@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WIRE_CODEC_H__
+#define __WIRE_CODEC_H__
+
+// Wire format versions.
+// PACKET_WIRE_FIXED  - array lengths are 32 bit little-endian values.
+// PACKET_WIRE_VARINT - array lengths are LEB128 varints ( 1 byte for lengths below 128 ).
+// Both sides of the message queue must be built with the same version.
+#define PACKET_WIRE_FIXED           1
+#define PACKET_WIRE_VARINT          2
+
+#ifndef PACKET_WIRE_VERSION
+   #define PACKET_WIRE_VERSION      PACKET_WIRE_FIXED
+#endif
+
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( _M_AMD64 ) || defined( _M_ARM ) || defined( _M_MRX000 ) || defined( _M_SH ) || \
+   ( defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ )
+   #define WIRE_HOST_LITTLE_ENDIAN
+#endif
+
+// Values on the wire have explicit widths. long is sent as 32 bit value on every
+// platform, the same as on Windows, so 32 and 64 bit builds can talk to each other.
+template < typename T > struct WireType { typedef T type; };
+template <> struct WireType< long > { typedef int type; };
+template <> struct WireType< unsigned long > { typedef unsigned int type; };
+
+struct WireCodec
+{
+   enum { VERSION = PACKET_WIRE_VERSION };
+
+#if PACKET_WIRE_VERSION == PACKET_WIRE_VARINT
+   enum { MAX_LENGTH_SIZE = 5 };
+#else
+   enum { MAX_LENGTH_SIZE = 4 };
+#endif
+
+   // returns size of the value on the wire.
+   template < typename T >
+   static size_t size( T )
+   {
+      return sizeof( typename WireType< T >::type );
+   }
+
+   // stores the value in little-endian order. returns number of bytes stored.
+   template < typename T >
+   static size_t store( unsigned char* buffer, T value )
+   {
+      typename WireType< T >::type wire = ( typename WireType< T >::type )value;
+#ifdef WIRE_HOST_LITTLE_ENDIAN
+      memcpy( buffer, &wire, sizeof( wire ) );
+#else
+      const unsigned char* bytes = (const unsigned char*)&wire;
+      for ( size_t i = 0; i < sizeof( wire ); ++i )
+      {
+         buffer[i] = bytes[sizeof( wire ) - 1 - i];
+      }
+#endif
+      return sizeof( wire );
+   }
+
+   // loads the little-endian value.
+   template < typename T >
+   static T load( const unsigned char* buffer )
+   {
+      typename WireType< T >::type wire;
+#ifdef WIRE_HOST_LITTLE_ENDIAN
+      memcpy( &wire, buffer, sizeof( wire ) );
+#else
+      unsigned char* bytes = (unsigned char*)&wire;
+      for ( size_t i = 0; i < sizeof( wire ); ++i )
+      {
+         bytes[i] = buffer[sizeof( wire ) - 1 - i];
+      }
+#endif
+      return ( T )wire;
+   }
+
+   // returns size of the array length prefix on the wire.
+   static size_t lengthSize( size_t length )
+   {
+#if PACKET_WIRE_VERSION == PACKET_WIRE_VARINT
+      size_t size = 1;
+      while ( length >= 0x80 )
+      {
+         length >>= 7;
+         ++size;
+      }
+      return size;
+#else
+      return sizeof( unsigned int );
+#endif
+   }
+
+   // stores the array length prefix. returns number of bytes stored.
+   static size_t storeLength( unsigned char* buffer, size_t length )
+   {
+#if PACKET_WIRE_VERSION == PACKET_WIRE_VARINT
+      size_t size = 0;
+      while ( length >= 0x80 )
+      {
+         buffer[size++] = (unsigned char)( length | 0x80 );
+         length >>= 7;
+      }
+      buffer[size++] = (unsigned char)length;
+      return size;
+#else
+      return store( buffer, (unsigned int)length );
+#endif
+   }
+
+   // loads the array length prefix from at most size bytes. returns number of bytes
+   // consumed or 0 if the prefix is truncated or malformed.
+   static size_t loadLength( const unsigned char* buffer, size_t size, size_t& length )
+   {
+#if PACKET_WIRE_VERSION == PACKET_WIRE_VARINT
+      length = 0;
+      for ( size_t i = 0; i < size && i < MAX_LENGTH_SIZE; ++i )
+      {
+         length |= (size_t)( buffer[i] & 0x7F ) << ( 7 * i );
+         if ( !( buffer[i] & 0x80 ) )
+         {
+            return i + 1;
+         }
+      }
+      return 0;
+#else
+      if ( size < sizeof( unsigned int ) ) return 0;
+      length = load< unsigned int >( buffer );
+      return sizeof( unsigned int );
+#endif
+   }
+};
+
+#endif //__WIRE_CODEC_H__
\ No newline at end of file
@@ -408,6 +408,321 @@ FreeBT_GetHCIEvent_Exit:
 
 }
 
+// Selects the SCO alternate setting of the isochronous interface on the first SCO request
+NTSTATUS FreeBT_SelectScoInterface(IN PDEVICE_OBJECT DeviceObject)
+{
+	PDEVICE_EXTENSION			deviceExtension;
+	PUSB_INTERFACE_DESCRIPTOR	interfaceDescriptor;
+	PUSBD_INTERFACE_INFORMATION	Interface;
+	PURB						urb;
+	USHORT						urbSize;
+	ULONG						i;
+	NTSTATUS					ntStatus;
+
+    deviceExtension = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    KeWaitForSingleObject(&deviceExtension->ScoSelectEvent, Executive, KernelMode, FALSE, NULL);
+    if (deviceExtension->ScoInterface)
+    {
+        KeSetEvent(&deviceExtension->ScoSelectEvent, IO_NO_INCREMENT, FALSE);
+        return STATUS_SUCCESS;
+
+    }
+
+    interfaceDescriptor = USBD_ParseConfigurationDescriptorEx(
+                                deviceExtension->UsbConfigurationDescriptor,
+                                deviceExtension->UsbConfigurationDescriptor,
+                                FREEBT_SCO_INTERFACE,
+                                FREEBT_SCO_ALTSETTING,
+                                -1, -1, -1);
+
+    if (!interfaceDescriptor)
+    {
+        FreeBT_DbgPrint(1, ("FBTUSB: FreeBT_SelectScoInterface: The device has no SCO interface\n"));
+        ntStatus = STATUS_NOT_SUPPORTED;
+        goto FreeBT_SelectScoInterface_Exit;
+
+    }
+
+    urbSize = (USHORT) GET_SELECT_INTERFACE_REQUEST_SIZE(interfaceDescriptor->bNumEndpoints);
+    urb = (PURB)ExAllocatePool(NonPagedPool, urbSize);
+    if (urb==NULL)
+    {
+        FreeBT_DbgPrint(1, ("FBTUSB: FreeBT_SelectScoInterface: Failed to alloc mem for urb\n"));
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeBT_SelectScoInterface_Exit;
+
+    }
+
+    RtlZeroMemory(urb, urbSize);
+    UsbBuildSelectInterfaceRequest(
+                            urb,
+                            urbSize,
+                            deviceExtension->ConfigurationHandle,
+                            FREEBT_SCO_INTERFACE,
+                            FREEBT_SCO_ALTSETTING);
+
+    Interface = &urb->UrbSelectInterface.Interface;
+    Interface->Length = (USHORT) GET_USBD_INTERFACE_SIZE(interfaceDescriptor->bNumEndpoints);
+    for (i=0; i<interfaceDescriptor->bNumEndpoints; i++)
+        Interface->Pipes[i].MaximumTransferSize = USBD_DEFAULT_MAXIMUM_TRANSFER_SIZE;
+
+    ntStatus = CallUSBD(DeviceObject, urb);
+    if (NT_SUCCESS(ntStatus))
+    {
+        for (i=0; i<Interface->NumberOfPipes; i++)
+        {
+            FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SelectScoInterface: EndpointAddress 0x%x, MaxPacketSize 0x%x\n",
+                                 Interface->Pipes[i].EndpointAddress,
+                                 Interface->Pipes[i].MaximumPacketSize));
+
+            switch (Interface->Pipes[i].EndpointAddress)
+            {
+                case FREEBT_STDENDPOINT_AUDIOIN:
+                    deviceExtension->AudioInPipe=Interface->Pipes[i];
+                    break;
+
+                case FREEBT_STDENDPOINT_AUDIOOUT:
+                    deviceExtension->AudioOutPipe=Interface->Pipes[i];
+                    break;
+
+            }
+
+        }
+
+        deviceExtension->ScoInterface = (PUSBD_INTERFACE_INFORMATION) ExAllocatePool(NonPagedPool, Interface->Length);
+        if (deviceExtension->ScoInterface)
+            RtlCopyMemory(deviceExtension->ScoInterface, Interface, Interface->Length);
+
+        else
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+
+    }
+
+    else
+        FreeBT_DbgPrint(1, ("FBTUSB: FreeBT_SelectScoInterface: Failed to select alternate setting %d, status 0x%08x\n", FREEBT_SCO_ALTSETTING, ntStatus));
+
+    ExFreePool(urb);
+
+FreeBT_SelectScoInterface_Exit:
+    KeSetEvent(&deviceExtension->ScoSelectEvent, IO_NO_INCREMENT, FALSE);
+
+    return ntStatus;
+
+}
+
+// Called when a SCO transfer on one of the audio pipes completes
+NTSTATUS FreeBT_SCOCompletion(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID Context)
+{
+    NTSTATUS            ntStatus;
+    PURB				urb;
+    PUCHAR				pBuffer;
+    ULONG				length;
+    ULONG				i;
+
+    FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SCOCompletion, status=0x%08X\n", Irp->IoStatus.Status));
+
+	if (Irp->PendingReturned)
+		IoMarkIrpPending(Irp);
+
+	urb=(PURB)Context;
+    ntStatus = Irp->IoStatus.Status;
+    Irp->IoStatus.Information = 0;
+
+    if (NT_SUCCESS(ntStatus) && (urb->UrbIsochronousTransfer.TransferFlags & USBD_TRANSFER_DIRECTION_IN))
+    {
+        // Each frame lands at its own offset, pack the received bytes together.
+        // A lost frame breaks the SCO packet boundaries, so the whole read fails
+        // and the reader starts over with the next one
+        pBuffer = (PUCHAR)urb->UrbIsochronousTransfer.TransferBuffer;
+        length = 0;
+        for (i=0; i<urb->UrbIsochronousTransfer.NumberOfPackets; i++)
+        {
+            if (!USBD_SUCCESS(urb->UrbIsochronousTransfer.IsoPacket[i].Status))
+            {
+                ntStatus = STATUS_DATA_ERROR;
+                length = 0;
+                break;
+
+            }
+
+            RtlMoveMemory(pBuffer + length,
+                          pBuffer + urb->UrbIsochronousTransfer.IsoPacket[i].Offset,
+                          urb->UrbIsochronousTransfer.IsoPacket[i].Length);
+
+            length += urb->UrbIsochronousTransfer.IsoPacket[i].Length;
+
+        }
+
+        Irp->IoStatus.Status = ntStatus;
+        Irp->IoStatus.Information = length;
+
+    }
+
+    ExFreePool(Context);
+	FreeBT_IoDecrement(DeviceObject->DeviceExtension);
+
+    return ntStatus;
+
+}
+
+// Sends a SCO transfer down the isochronous pipe. The transfer is split into frames of the
+// pipe's packet size and starts as soon as possible, so the queued transfers go out one
+// frame after another at the pace of the bus
+NTSTATUS FreeBT_SubmitSCOTransfer(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN USBD_PIPE_INFORMATION *PipeInfo, IN PVOID IoBuffer, IN ULONG BufferLength, IN ULONG NumberOfPackets, IN ULONG Direction)
+{
+	PDEVICE_EXTENSION	deviceExtension;
+	PURB				urb;
+	ULONG				urbSize;
+	ULONG				i;
+	NTSTATUS			ntStatus;
+    PIO_STACK_LOCATION	nextStack;
+
+    deviceExtension = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    urbSize = GET_ISO_URB_SIZE(NumberOfPackets);
+    urb = (PURB)ExAllocatePool(NonPagedPool, urbSize);
+    if (urb==NULL)
+    {
+        FreeBT_DbgPrint(1, ("FBTUSB: FreeBT_SubmitSCOTransfer: Failed to alloc mem for urb\n"));
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto FreeBT_SubmitSCOTransfer_Exit;
+
+    }
+
+    RtlZeroMemory(urb, urbSize);
+    urb->UrbIsochronousTransfer.Hdr.Length = (USHORT) urbSize;
+    urb->UrbIsochronousTransfer.Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+    urb->UrbIsochronousTransfer.PipeHandle = PipeInfo->PipeHandle;
+    urb->UrbIsochronousTransfer.TransferFlags = USBD_START_ISO_TRANSFER_ASAP | Direction;
+    urb->UrbIsochronousTransfer.TransferBuffer = IoBuffer;
+    urb->UrbIsochronousTransfer.TransferBufferLength = BufferLength;
+    urb->UrbIsochronousTransfer.NumberOfPackets = NumberOfPackets;
+    for (i=0; i<NumberOfPackets; i++)
+        urb->UrbIsochronousTransfer.IsoPacket[i].Offset = i * PipeInfo->MaximumPacketSize;
+
+    nextStack = IoGetNextIrpStackLocation(Irp);
+    nextStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    nextStack->Parameters.Others.Argument1 = (PVOID) urb;
+    nextStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+
+    IoSetCompletionRoutine(
+		Irp,
+		(PIO_COMPLETION_ROUTINE)FreeBT_SCOCompletion,
+		urb,
+		TRUE,
+		TRUE,
+		TRUE);
+
+    // We return STATUS_PENDING; call IoMarkIrpPending.
+    IoMarkIrpPending(Irp);
+
+	FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SubmitSCOTransfer::"));
+    FreeBT_IoIncrement(deviceExtension);
+
+    ntStatus = IoCallDriver(deviceExtension->TopOfStackDeviceObject, Irp);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SubmitSCOTransfer: IoCallDriver fails with status %X\n", ntStatus));
+
+		FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SubmitSCOTransfer::"));
+		FreeBT_IoDecrement(deviceExtension);
+
+        // If the device was surprise removed out, the pipeInformation field is invalid.
+        // similarly if the request was cancelled, then we need not reset the pipe.
+        if((ntStatus != STATUS_CANCELLED) && (ntStatus != STATUS_DEVICE_NOT_CONNECTED))
+            FreeBT_ResetPipe(DeviceObject, PipeInfo->PipeHandle);
+
+        goto FreeBT_SubmitSCOTransfer_Exit;
+
+    }
+
+    return STATUS_PENDING;
+
+FreeBT_SubmitSCOTransfer_Exit:
+    Irp->IoStatus.Status=ntStatus;
+    Irp->IoStatus.Information=0;
+
+    FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_SubmitSCOTransfer: Failure (0x%08x), completing IRP\n", ntStatus));
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return ntStatus;
+
+}
+
+// Called from the DeviceIOControl handler to send a SCO packet received from the user
+NTSTATUS FreeBT_SendSCOData(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID IoBuffer, IN ULONG InputBufferLength)
+{
+	PDEVICE_EXTENSION	deviceExtension;
+	ULONG				packetSize;
+	NTSTATUS			ntStatus;
+
+    deviceExtension = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    ntStatus = FreeBT_SelectScoInterface(DeviceObject);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        Irp->IoStatus.Status = ntStatus;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return ntStatus;
+
+    }
+
+    packetSize = deviceExtension->AudioOutPipe.MaximumPacketSize;
+    return FreeBT_SubmitSCOTransfer(
+                            DeviceObject,
+                            Irp,
+                            &deviceExtension->AudioOutPipe,
+                            IoBuffer,
+                            InputBufferLength,
+                            (InputBufferLength + packetSize - 1) / packetSize,
+                            USBD_TRANSFER_DIRECTION_OUT);
+
+}
+
+// Called from the DeviceIOControl handler to read the SCO data of the next few frames
+NTSTATUS FreeBT_GetSCOData(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID IoBuffer, IN ULONG OutputBufferLength)
+{
+	PDEVICE_EXTENSION	deviceExtension;
+	ULONG				readSize;
+	NTSTATUS			ntStatus;
+
+    deviceExtension = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    ntStatus = FreeBT_SelectScoInterface(DeviceObject);
+    if (NT_SUCCESS(ntStatus))
+    {
+        readSize = FREEBT_SCO_ISO_PACKETS * deviceExtension->AudioInPipe.MaximumPacketSize;
+        if (OutputBufferLength<readSize)
+        {
+            FreeBT_DbgPrint(3, ("FBTUSB: FreeBT_GetSCOData: Buffer too small\n"));
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+
+        }
+
+    }
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        Irp->IoStatus.Status = ntStatus;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return ntStatus;
+
+    }
+
+    return FreeBT_SubmitSCOTransfer(
+                            DeviceObject,
+                            Irp,
+                            &deviceExtension->AudioInPipe,
+                            IoBuffer,
+                            readSize,
+                            FREEBT_SCO_ISO_PACKETS,
+                            USBD_TRANSFER_DIRECTION_IN);
+
+}
+
 // DeviceIOControl dispatch
 NTSTATUS FreeBT_DispatchDevCtrl(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 {
@@ -487,6 +802,32 @@ NTSTATUS FreeBT_DispatchDevCtrl(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 		return FreeBT_GetHCIEvent(DeviceObject, Irp, ioBuffer, outputBufferLength);
 		break;
 
+	case IOCTL_FREEBT_SCO_SEND_DATA:
+		FreeBT_DbgPrint(3, ("FBTUSB: IOCTL_FREEBT_SCO_SEND_DATA received\n"));
+		if (inputBufferLength<FBT_HCI_SCO_MIN_SIZE)
+		{
+			ntStatus = STATUS_BUFFER_TOO_SMALL;
+			FreeBT_DbgPrint(3, ("FBTUSB: IOCTL_FREEBT_SCO_SEND_DATA: Buffer too small\n"));
+			goto FreeBT_DispatchDevCtrlExit;
+
+		}
+
+		if (inputBufferLength>FBT_HCI_SCO_MAX_SIZE)
+		{
+			ntStatus = STATUS_INVALID_BUFFER_SIZE;
+			FreeBT_DbgPrint(3, ("FBTUSB: IOCTL_FREEBT_SCO_SEND_DATA: Buffer too long\n"));
+			goto FreeBT_DispatchDevCtrlExit;
+
+		}
+
+		return FreeBT_SendSCOData(DeviceObject, Irp, ioBuffer, inputBufferLength);
+		break;
+
+	case IOCTL_FREEBT_SCO_GET_DATA:
+		FreeBT_DbgPrint(3, ("FBTUSB: IOCTL_FREEBT_SCO_GET_DATA received\n"));
+		return FreeBT_GetSCOData(DeviceObject, Irp, ioBuffer, outputBufferLength);
+		break;
+
     default:
     	FreeBT_DbgPrint(3, ("FBTUSB: Invalid IOCTL 0x%08x received\n", code));
         ntStatus = STATUS_INVALID_DEVICE_REQUEST;
@@ -153,6 +153,7 @@ NTSTATUS HandleStartDevice(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
     deviceExtension->UsbConfigurationDescriptor = NULL;
     deviceExtension->UsbInterface = NULL;
     deviceExtension->PipeContext = NULL;
+    deviceExtension->ScoInterface = NULL;
 
     // We cannot touch the device (send it any non pnp irps) until a
     // start device has been passed down to the lower drivers.
@@ -519,6 +520,8 @@ NTSTATUS SelectInterfaces(IN PDEVICE_OBJECT DeviceObject, IN PUSB_CONFIGURATION_
         ntStatus = CallUSBD(DeviceObject, urb);
         if (NT_SUCCESS(ntStatus))
 		{
+            deviceExtension->ConfigurationHandle = urb->UrbSelectConfiguration.ConfigurationHandle;
+
             // save a copy of interface information in the device extension.
             deviceExtension->UsbInterface = (PUSBD_INTERFACE_INFORMATION) ExAllocatePool(NonPagedPool, Interface->Length);
             if (deviceExtension->UsbInterface)
@@ -1809,6 +1812,14 @@ NTSTATUS ReleaseMemory(IN PDEVICE_OBJECT DeviceObject)
 
     }
 
+    if(deviceExtension->ScoInterface)
+	{
+		FreeBT_DbgPrint(3, ("FBTUSB: ReleaseMemory: Freeing ScoInterface\n"));
+        ExFreePool(deviceExtension->ScoInterface);
+        deviceExtension->ScoInterface = NULL;
+
+    }
+
     if(deviceExtension->PipeContext)
 	{
 		RtlInitUnicodeString(&uniDeviceName, deviceExtension->wszDosDeviceName);
@@ -318,6 +318,9 @@ NTSTATUS FreeBT_AddDevice(IN PDRIVER_OBJECT DriverObject, IN PDEVICE_OBJECT Phys
     // is indeed complete before we unload the drivers.
     KeInitializeEvent(&deviceExtension->DelayEvent, NotificationEvent, FALSE);
 
+    // Guards the selection of the SCO interface
+    KeInitializeEvent(&deviceExtension->ScoSelectEvent, SynchronizationEvent, TRUE);
+
     // Clear the DO_DEVICE_INITIALIZING flag.
     // Note: Do not clear this flag until the driver has set the
     // device power state and the power DO flags.
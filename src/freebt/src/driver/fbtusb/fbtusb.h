@@ -36,6 +36,12 @@
 #define FREEBT_STDENDPOINT_AUDIOIN	0x83	// SCO In
 #define FREEBT_STDENDPOINT_AUDIOOUT	0x03	// SCO Out
 
+// SCO data goes over the isochronous endpoints of the second interface. Its alternate
+// settings differ in the packet size, setting 2 carries one 16 bit voice channel.
+#define FREEBT_SCO_INTERFACE		1
+#define FREEBT_SCO_ALTSETTING		2
+#define FREEBT_SCO_ISO_PACKETS		6		// Frames per SCO read, a SCO packet takes 3 frames
+
 
 #define OBTTAG (ULONG) 'OBTU'
 
@@ -245,6 +251,14 @@ typedef struct _DEVICE_EXTENSION
 	USBD_PIPE_INFORMATION AudioInPipe;
 	USBD_PIPE_INFORMATION AudioOutPipe;
 
+	// Needed to select the SCO alternate setting after the configuration
+	USBD_CONFIGURATION_HANDLE ConfigurationHandle;
+
+	// SCO interface, selected by the first SCO request. The selection waits for USBD,
+	// so it is guarded with an event rather than a mutex that would block the APCs
+	PUSBD_INTERFACE_INFORMATION ScoInterface;
+	KEVENT ScoSelectEvent;
+
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
 
@@ -38,5 +38,15 @@ DEFINE_GUID(GUID_CLASS_FREEBT_USB,
                                                       METHOD_BUFFERED,        \
                                                       FILE_ANY_ACCESS)
 
+#define IOCTL_FREEBT_SCO_SEND_DATA           CTL_CODE(FILE_DEVICE_UNKNOWN,    \
+                                                      FREEBT_IOCTL_INDEX + 3, \
+                                                      METHOD_BUFFERED,        \
+                                                      FILE_ANY_ACCESS)
+
+#define IOCTL_FREEBT_SCO_GET_DATA            CTL_CODE(FILE_DEVICE_UNKNOWN,    \
+                                                      FREEBT_IOCTL_INDEX + 4, \
+                                                      METHOD_BUFFERED,        \
+                                                      FILE_ANY_ACCESS)
+
 #endif
 
@@ -18,6 +18,9 @@
 #define FBT_HCI_DATA_MIN_SIZE       5
 #define FBT_HCI_DATA_MAX_SIZE       1024
 
+#define FBT_HCI_SCO_MIN_SIZE        3
+#define FBT_HCI_SCO_MAX_SIZE        258
+
 #define FBT_HCI_BDADDR_SIZE         6
 #define FBT_HCI_NAME_SIZE           248
 
@@ -25,17 +25,64 @@
 #define BUFFER_SIZE (16 * 1024)
 CRITICAL_SECTION CBthEmulHci::s_criticalSection;
 
-CBthEmulHci::CBthEmulHci( CBTHW& btHw ) : CHci( btHw ), m_btHw( btHw ), m_hciEventListener( NULL ), m_hReaderThread( NULL ), m_hStopReadingEvent( NULL ), m_hReaderReadyEvent( NULL )
+CBthEmulHci::CBthEmulHci( CBTHW& btHw ) : CHci( btHw ), m_btHw( btHw ), m_hciEventListener( NULL ), m_hReaderThread( NULL ), m_hStopReadingEvent( NULL ), m_hReaderReadyEvent( NULL ), m_hScoReaderThread( NULL ), m_pScoWriteSlots( NULL ), m_nScoWriteSlot( 0 ), m_dwScoDropped( 0 ), m_dwRelayMtu( 0 ), m_pAclFragment( NULL ), m_dwReadSize( 0 ), m_pReadBuffer( NULL ), m_pAclEvent( NULL )
 {
    InitializeCriticalSection( &s_criticalSection );
-   m_hStopReadingEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+   InitializeCriticalSection( &m_scoWriteSection );
+   // both readers wait for it, so it's manual reset.
+   m_hStopReadingEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
    memset( &m_devInfo, 0, sizeof(DEVICE_INFO) );
+
+   // the slots are on the heap, so a write the driver never completes can keep them.
+   m_pScoWriteSlots = (SCO_SLOT*)malloc( SCO_WRITE_SLOTS * sizeof(SCO_SLOT) );
+   if ( m_pScoWriteSlots != NULL )
+   {
+      memset( m_pScoWriteSlots, 0, SCO_WRITE_SLOTS * sizeof(SCO_SLOT) );
+      for ( int i = 0; i < SCO_WRITE_SLOTS; ++i )
+      {
+         m_pScoWriteSlots[i].overlapped.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+      }
+   }
 }
 
 CBthEmulHci::~CBthEmulHci()
 {
+   if ( m_pScoWriteSlots != NULL )
+   {
+      BOOL bPending = FALSE;
+      for ( int i = 0; i < SCO_WRITE_SLOTS; ++i )
+      {
+         if ( m_pScoWriteSlots[i].bPending && WAIT_OBJECT_0 != WaitForSingleObject( m_pScoWriteSlots[i].overlapped.hEvent, 0 ) )
+         {
+            bPending = TRUE;
+         }
+      }
+
+      if ( bPending )
+      {
+         // the driver still owns a write, its OVERLAPPED, event and buffer are left to it.
+         fbtLog( fbtLog_Failure, _T("CBthEmulHci::~CBthEmulHci: SCO write is still pending, the write slots are leaked") );
+      }
+      else
+      {
+         for ( int i = 0; i < SCO_WRITE_SLOTS; ++i )
+         {
+            CloseHandle( m_pScoWriteSlots[i].overlapped.hEvent );
+         }
+         free( m_pScoWriteSlots );
+      }
+      m_pScoWriteSlots = NULL;
+   }
+
    CloseHandle( m_hStopReadingEvent );
    m_hStopReadingEvent = NULL;
+   free( m_pAclFragment );
+   m_pAclFragment = NULL;
+   free( m_pReadBuffer );
+   m_pReadBuffer = NULL;
+   free( m_pAclEvent );
+   m_pAclEvent = NULL;
+   DeleteCriticalSection( &m_scoWriteSection );
    DeleteCriticalSection( &s_criticalSection );
 }
 
@@ -55,7 +102,6 @@ DWORD CBthEmulHci::SendHCICommand( const BYTE* lpBuffer, DWORD dwBufferSize )
    FBT_TRY
 
       DWORD dwResult = ERROR_SUCCESS;
-      DWORD dwBytesSent = 0;
       
       // check received buffer.
       if ( lpBuffer != NULL && dwBufferSize > 0 )
@@ -72,11 +118,11 @@ DWORD CBthEmulHci::SendHCICommand( const BYTE* lpBuffer, DWORD dwBufferSize )
             break;
 
          case FBT_HCI_SYNC_ACL_DATA_PACKET:
-            dwResult = SendData( lpBuffer + 1, dwBufferSize - 1, &dwBytesSent, NULL );
+            dwResult = SendAclData( lpBuffer + 1, dwBufferSize - 1 );
             break;
 
          case FBT_HCI_SYNC_SCO_DATA_PACKET:
-            dwResult = ERROR_CALL_NOT_IMPLEMENTED;
+            dwResult = SendScoData( lpBuffer + 1, dwBufferSize - 1 );
             break;
 
          case FBT_HCI_SYNC_HCI_EVENT_PACKET:
@@ -107,7 +153,25 @@ DWORD CBthEmulHci::StartEventListener()
             return ERROR_INTERNAL_ERROR;
          }      
 
+         // the buffers take the largest packet the controller sends. the ACL packets are handed
+         // to the listener from one buffer, the handler threads take it in turn.
+         m_dwReadSize = max( (DWORD)FBT_HCI_DATA_MAX_SIZE, ACL_HEADER_SIZE + GetAclMtu() );
+         free( m_pReadBuffer );
+         m_pReadBuffer = (BYTE*)malloc( m_dwReadSize );
+
+         EnterCriticalSection( &s_criticalSection );
+         free( m_pAclEvent );
+         m_pAclEvent = (BYTE*)malloc( 1 + m_dwReadSize );
+         LeaveCriticalSection( &s_criticalSection );
+
+         if ( m_pReadBuffer == NULL || m_pAclEvent == NULL )
+         {
+            fbtLog( fbtLog_Failure, _T("CBthEmulHci::StartEventListener: Failed to allocate read buffers of %d bytes"), m_dwReadSize );
+            return ERROR_NOT_ENOUGH_MEMORY;
+         }
+
          // start the reader thread.
+         ResetEvent( m_hStopReadingEvent );
          m_hReaderReadyEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
          m_hReaderThread = CreateThread( NULL, 0, DataReader, this, 0, NULL );         
          
@@ -122,6 +186,18 @@ DWORD CBthEmulHci::StartEventListener()
          WaitForSingleObject( m_hReaderReadyEvent, INFINITE );
          CloseHandle( m_hReaderReadyEvent );
 
+         // the SCO data comes over its own pipe, so it has its own reader. the devices
+         // without the SCO interface work on without it.
+         m_hScoReaderThread = CreateThread( NULL, 0, ScoDataReader, this, 0, NULL );
+         if ( m_hScoReaderThread == NULL )
+         {
+            fbtLog( fbtLog_Failure, _T("CBthEmulHci::StartEventListener: Failed to create SCO reader thread, error %d"), GetLastError() );
+         }
+         else
+         {
+            SetThreadPriority( m_hScoReaderThread, THREAD_PRIORITY_TIME_CRITICAL );
+         }
+
          return ERROR_SUCCESS;
       }
 
@@ -146,6 +222,37 @@ DWORD CBthEmulHci::StopEventListener()
       CloseHandle( m_hReaderThread );
       m_hReaderThread = NULL;
 
+      // the read of a terminated reader may still be outstanding in the driver, which writes
+      // to the buffer when it completes. the buffer is leaked then rather than freed.
+      if ( dwResult == WAIT_OBJECT_0 )
+      {
+         free( m_pReadBuffer );
+      }
+      else
+      {
+         fbtLog( fbtLog_Warning, _T("CBthEmulHci::StopEventListener: Reader terminated, read buffer of %d bytes kept"), m_dwReadSize );
+      }
+      m_pReadBuffer = NULL;
+
+      // the handler threads still running drop their packets.
+      EnterCriticalSection( &s_criticalSection );
+      free( m_pAclEvent );
+      m_pAclEvent = NULL;
+      LeaveCriticalSection( &s_criticalSection );
+
+      if ( m_hScoReaderThread != NULL )
+      {
+         if ( WaitForSingleObject( m_hScoReaderThread, 5000 ) != WAIT_OBJECT_0 )
+         {
+            TerminateThread( m_hScoReaderThread, -1 );
+         }
+
+         CloseHandle( m_hScoReaderThread );
+         m_hScoReaderThread = NULL;
+      }
+
+      WaitScoWrites();
+
       return dwParentResult || dwResult;
 
    FBT_CATCH_RETURN( ERROR_INTERNAL_ERROR )
@@ -193,10 +300,12 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
 
       CBthEmulHci* pThis = (CBthEmulHci*)lpParam;
       HANDLE hStopReadingEvent = pThis->m_hStopReadingEvent;
-      BYTE readBuffer[FBT_HCI_DATA_MAX_SIZE];
-      memset( readBuffer, 0, sizeof(readBuffer) );
+      DWORD dwReadSize = pThis->m_dwReadSize;
+      BYTE* readBuffer = pThis->m_pReadBuffer;
+      memset( readBuffer, 0, dwReadSize );
       int nBufferPos = 0;
       int nPacketSize = 0;      
+      int nSkip = 0;
       
       SetEvent( pThis->m_hReaderReadyEvent );
 
@@ -209,7 +318,7 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
          ResetEvent( overlapped.hEvent );
          
          DWORD dwBytesReaded = 0;
-         DWORD dwResult = pThis->m_btHw.GetData( readBuffer + nBufferPos, sizeof(readBuffer) - nBufferPos, &dwBytesReaded, &overlapped );
+         DWORD dwResult = pThis->m_btHw.GetData( readBuffer + nBufferPos, dwReadSize - nBufferPos, &dwBytesReaded, &overlapped );
          if ( ERROR_SUCCESS == dwResult )
          {
             HANDLE handles[] = { hStopReadingEvent, overlapped.hEvent };
@@ -217,7 +326,11 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
             DWORD dwWait = WaitForMultipleObjects( sizeof(handles)/sizeof(handles[0]), handles, FALSE, INFINITE );
             if ( dwWait == WAIT_OBJECT_0 )
             {
-               // stop event. exit cycle...
+               // stop event. the read was issued by this thread, so it's cancelled here and
+               // drained before the read buffer is given back. exit cycle...
+               CancelIo( pThis->GetDriverHandle() );
+               DWORD dwLength = 0;
+               GetOverlappedResult( pThis->GetDriverHandle(), &overlapped, &dwLength, TRUE );
                break;
             }
             else if ( dwWait == WAIT_OBJECT_0 + 1 )
@@ -227,6 +340,13 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
                if ( GetOverlappedResult( pThis->m_btHw.GetDriverHandle(), &overlapped, &dwLength, FALSE ) )
                {
                   fbtLog( fbtLog_Notice, _T("CBthEmulHci::DataReader GetOverlappedResult OK %d"), dwLength );
+
+                  // the rest of the dropped packet.
+                  if ( nSkip > 0 )
+                  {
+                     nSkip -= min( nSkip, (int)dwLength );
+                     continue;
+                  }
                   
                   // the first data packet.
                   if ( nBufferPos == 0 )
@@ -234,9 +354,18 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
                      // determine the whole packet size.
                      nPacketSize = 0;
                      memcpy( &nPacketSize, readBuffer + 2, 2 );
-                     nPacketSize += 4;
+                     nPacketSize += ACL_HEADER_SIZE;
 
                      fbtLog( fbtLog_Notice, _T("CBthEmulHci::DataReader data packet size %d"), nPacketSize );
+
+                     // the controller sent more than its buffer size, the packet is dropped.
+                     if ( nPacketSize > (int)dwReadSize )
+                     {
+                        fbtLog( fbtLog_Warning, _T("CBthEmulHci::DataReader: packet size %d exceeds %d, dropped"), nPacketSize, dwReadSize );
+                        nSkip = nPacketSize - dwLength;
+                        nPacketSize = 0;
+                        continue;
+                     }
                   }
                   
                   nBufferPos += dwLength;
@@ -246,25 +375,42 @@ DWORD WINAPI CBthEmulHci::DataReader( LPVOID lpParam )
                   {
                      fbtLog( fbtLog_Notice, _T("CBthEmulHci::DataReader send packet further") );
                      PHCI_EVENT pEventParameters = (PHCI_EVENT)malloc( sizeof(HCI_EVENT) );
-                     pEventParameters->pEvent = (PFBT_HCI_EVENT_HEADER)malloc( nPacketSize );
-                     memcpy( pEventParameters->pEvent, readBuffer, nPacketSize );
-                     pEventParameters->dwLength = nPacketSize;
-                     pEventParameters->pThis = pThis;
-
-                     // restore read buffer to zero state.
-                     memset( readBuffer, 0, sizeof(readBuffer) );
-                     nBufferPos = 0;
-                     nPacketSize = 0;
+                     PFBT_HCI_EVENT_HEADER pPacket = (PFBT_HCI_EVENT_HEADER)malloc( nPacketSize );
+                     HANDLE hThread = NULL;
+                     if ( pEventParameters != NULL && pPacket != NULL )
+                     {
+                        memcpy( pPacket, readBuffer, nPacketSize );
+                        pEventParameters->pEvent = pPacket;
+                        pEventParameters->dwLength = nPacketSize;
+                        pEventParameters->pThis = pThis;
+
+                        // spin handling off in a thread in order to reduce turnaround time.
+                        hThread = CreateThread( NULL, 0, DataEventHandler, pEventParameters, 0, NULL );
+                        if ( hThread == NULL )
+                        {
+                           DWORD dwLastError = GetLastError();
+                           fbtLog( fbtLog_Failure, _T("CBthEmulHci::DataReader: Failed to create listener thread, error %d"), dwLastError );
+                        }
+                     }
+                     else
+                     {
+                        fbtLog( fbtLog_Failure, _T("CBthEmulHci::DataReader: Out of memory, packet of %d bytes dropped"), nPacketSize );
+                     }
 
-                     // spin handling off in a thread in order to reduce turnaround time.
-                     HANDLE hThread = CreateThread( NULL, 0, DataEventHandler, pEventParameters, 0, NULL );
                      if ( hThread == NULL )
                      {
-                        DWORD dwLastError = GetLastError();
-                        fbtLog( fbtLog_Failure, _T("CBthEmulHci::DataReader: Failed to create listener thread, error %d"), dwLastError );
+                        free( pPacket );
+                        free( pEventParameters );
+                     }
+                     else
+                     {
+                        CloseHandle( hThread );
                      }
 
-                     CloseHandle( hThread );  
+                     // restore read buffer to zero state.
+                     memset( readBuffer, 0, dwReadSize );
+                     nBufferPos = 0;
+                     nPacketSize = 0;
                   }                                     
                }
                else
@@ -299,24 +445,55 @@ DWORD WINAPI CBthEmulHci::DataEventHandler( LPVOID lpParam )
       PHCI_EVENT pEvent = (PHCI_EVENT)lpParam;
       CBthEmulHci* pThis = (CBthEmulHci*)pEvent->pThis;
       DWORD dwLength = pEvent->dwLength;
-      BYTE eventBuffer[FBT_HCI_DATA_MAX_SIZE + 1];
+      const BYTE* pPacket = (const BYTE*)pEvent->pEvent;
 
       if ( pThis->m_hciEventListener )
       {
+         // the packets larger than the relay takes are split into continuing fragments.
+         DWORD dwFragmentSize = dwLength - ACL_HEADER_SIZE;
+         if ( pThis->m_dwRelayMtu != 0 && pThis->m_dwRelayMtu < dwFragmentSize )
+         {
+            dwFragmentSize = pThis->m_dwRelayMtu;
+         }
+
          EnterCriticalSection( &s_criticalSection );
 
          fbtLog( fbtLog_Notice, _T("CBthEmulHci::DataEventHandler buffer (%d):"), dwLength );
          fbtLogDumpBuf( fbtLog_Notice, (unsigned char*)pEvent->pEvent, dwLength );
 
-         memset( eventBuffer, 0, sizeof(eventBuffer) );
-         eventBuffer[0] = FBT_HCI_SYNC_ACL_DATA_PACKET;
-         memcpy( eventBuffer + 1, pEvent->pEvent, dwLength );
+         // the buffer is gone once the listener is stopped.
+         BYTE* eventBuffer = pThis->m_pAclEvent;
+         if ( eventBuffer == NULL )
+         {
+            fbtLog( fbtLog_Warning, _T("CBthEmulHci::DataEventHandler: Listener stopped, packet dropped") );
+            LeaveCriticalSection( &s_criticalSection );
 
-         DWORD dwResult = pThis->m_hciEventListener( eventBuffer, dwLength + 1 );
-         if ( dwResult != ERROR_SUCCESS ) 
+            free( pEvent->pEvent );
+            free( pEvent );
+            return ERROR_SUCCESS;
+         }
+
+         USHORT usHandle = 0;
+         memcpy( &usHandle, pPacket, 2 );
+         DWORD dwPos = ACL_HEADER_SIZE;
+         do
          {
-            fbtLog( fbtLog_Failure, _T("CBthEmulHci::DataEventHandler: HciEventListener failed, error %d"), dwResult );
+            USHORT usLength = (USHORT)min( dwLength - dwPos, dwFragmentSize );
+            eventBuffer[0] = FBT_HCI_SYNC_ACL_DATA_PACKET;
+            memcpy( eventBuffer + 1, &usHandle, 2 );
+            memcpy( eventBuffer + 3, &usLength, 2 );
+            memcpy( eventBuffer + 1 + ACL_HEADER_SIZE, pPacket + dwPos, usLength );
+
+            DWORD dwResult = pThis->m_hciEventListener( eventBuffer, 1 + ACL_HEADER_SIZE + usLength );
+            if ( dwResult != ERROR_SUCCESS ) 
+            {
+               fbtLog( fbtLog_Failure, _T("CBthEmulHci::DataEventHandler: HciEventListener failed, error %d"), dwResult );
+            }
+
+            dwPos += usLength;
+            usHandle = ( usHandle & ~0x3000 ) | ACL_PB_CONTINUING;
          }
+         while ( dwPos < dwLength );
 
          fbtLog( fbtLog_Notice, _T("CBthEmulHci::DataEventHandler: Event handling complete") );
 
@@ -331,6 +508,221 @@ DWORD WINAPI CBthEmulHci::DataEventHandler( LPVOID lpParam )
    FBT_CATCH_RETURN( ERROR_INTERNAL_ERROR )
 }
 
+DWORD CBthEmulHci::SendScoData( const BYTE* lpBuffer, DWORD dwBufferSize )
+{
+   if ( dwBufferSize < FBT_HCI_SCO_MIN_SIZE || dwBufferSize > FBT_HCI_SCO_MAX_SIZE )
+   {
+      return ERROR_INVALID_PARAMETER;
+   }
+
+   if ( m_pScoWriteSlots == NULL )
+   {
+      return ERROR_NOT_ENOUGH_MEMORY;
+   }
+
+   DWORD dwResult = ERROR_SUCCESS;
+
+   EnterCriticalSection( &m_scoWriteSection );
+
+   // the writes complete in order, so the next slot holds the oldest one. a slot a write
+   // is still pending on is never reused, its packet is dropped instead.
+   SCO_SLOT& slot = m_pScoWriteSlots[m_nScoWriteSlot];
+   if ( slot.bPending )
+   {
+      if ( WAIT_OBJECT_0 != WaitForSingleObject( slot.overlapped.hEvent, 0 ) )
+      {
+         // the pipe is behind by the whole queue. the late audio is worse than the lost one,
+         // so the packet is dropped instead of blocking the caller.
+         ++m_dwScoDropped;
+         fbtLog( fbtLog_Warning, _T("CBthEmulHci::SendScoData: SCO queue is full, %u packets dropped"), m_dwScoDropped );
+         LeaveCriticalSection( &m_scoWriteSection );
+         return ERROR_SUCCESS;
+      }
+
+      DWORD dwLength = 0;
+      if ( !GetOverlappedResult( GetDriverHandle(), &slot.overlapped, &dwLength, FALSE ) )
+      {
+         fbtLog( fbtLog_Failure, _T("CBthEmulHci::SendScoData: SCO write failed, error %d"), GetLastError() );
+      }
+      slot.bPending = FALSE;
+   }
+
+   memcpy( slot.buffer, lpBuffer, dwBufferSize );
+   dwResult = SendCommand( IOCTL_FREEBT_SCO_SEND_DATA, slot.buffer, dwBufferSize, NULL, 0, &slot.overlapped );
+   if ( ERROR_SUCCESS == dwResult )
+   {
+      slot.bPending = TRUE;
+      m_nScoWriteSlot = ( m_nScoWriteSlot + 1 ) % SCO_WRITE_SLOTS;
+   }
+
+   LeaveCriticalSection( &m_scoWriteSection );
+
+   return dwResult;
+}
+
+void CBthEmulHci::WaitScoWrites()
+{
+   if ( m_pScoWriteSlots == NULL )
+   {
+      return;
+   }
+
+   EnterCriticalSection( &m_scoWriteSection );
+
+   BOOL bPending = FALSE;
+   for ( int i = 0; i < SCO_WRITE_SLOTS; ++i )
+   {
+      SCO_SLOT& slot = m_pScoWriteSlots[i];
+      if ( slot.bPending )
+      {
+         // a queued packet takes a few frames at most. the writes were issued by the callers'
+         // threads and can't be cancelled here, so a write that doesn't complete keeps its slot.
+         if ( WAIT_OBJECT_0 != WaitForSingleObject( slot.overlapped.hEvent, 1000 ) )
+         {
+            fbtLog( fbtLog_Failure, _T("CBthEmulHci::WaitScoWrites: SCO write didn't complete") );
+            bPending = TRUE;
+            continue;
+         }
+
+         DWORD dwLength = 0;
+         GetOverlappedResult( GetDriverHandle(), &slot.overlapped, &dwLength, FALSE );
+         slot.bPending = FALSE;
+      }
+   }
+
+   // the slots are taken in order again, unless a write is left behind.
+   if ( !bPending )
+   {
+      m_nScoWriteSlot = 0;
+   }
+
+   LeaveCriticalSection( &m_scoWriteSection );
+}
+
+DWORD CBthEmulHci::PostScoRead( SCO_SLOT& slot )
+{
+   DWORD dwResult = SendCommand( IOCTL_FREEBT_SCO_GET_DATA, NULL, 0, slot.buffer, sizeof(slot.buffer), &slot.overlapped );
+   slot.bPending = ( ERROR_SUCCESS == dwResult );
+   return dwResult;
+}
+
+DWORD CBthEmulHci::OnScoData( BYTE* lpPacket, DWORD dwLength )
+{
+   DWORD dwResult = ERROR_SUCCESS;
+
+   if ( m_hciEventListener )
+   {
+      EnterCriticalSection( &s_criticalSection );
+
+      fbtLog( fbtLog_Verbose, _T("CBthEmulHci::OnScoData buffer (%d):"), dwLength );
+      fbtLogDumpBuf( fbtLog_Verbose, lpPacket, dwLength );
+
+      dwResult = m_hciEventListener( lpPacket, dwLength );
+      if ( dwResult != ERROR_SUCCESS )
+      {
+         fbtLog( fbtLog_Failure, _T("CBthEmulHci::OnScoData: HciEventListener failed, error %d"), dwResult );
+      }
+
+      LeaveCriticalSection( &s_criticalSection );
+   }
+
+   return dwResult;
+}
+
+DWORD WINAPI CBthEmulHci::ScoDataReader( LPVOID lpParam )
+{
+   FBT_TRY
+
+      CBthEmulHci* pThis = (CBthEmulHci*)lpParam;
+      HANDLE hStopReadingEvent = pThis->m_hStopReadingEvent;
+
+      // the reads are preallocated and kept pending all the time, they complete in order.
+      SCO_SLOT slots[SCO_READ_SLOTS];
+      memset( slots, 0, sizeof(slots) );
+      for ( int i = 0; i < SCO_READ_SLOTS; ++i )
+      {
+         slots[i].overlapped.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+      }
+
+      // the SCO packet being reassembled. the packets may span the reads.
+      BYTE packet[FBT_HCI_SCO_MAX_SIZE + 1];
+      packet[0] = FBT_HCI_SYNC_SCO_DATA_PACKET;
+      DWORD dwPacketPos = 0;
+
+      DWORD dwResult = ERROR_SUCCESS;
+      for ( int i = 0; i < SCO_READ_SLOTS && ERROR_SUCCESS == dwResult; ++i )
+      {
+         dwResult = pThis->PostScoRead( slots[i] );
+      }
+
+      int nSlot = 0;
+      while ( ERROR_SUCCESS == dwResult )
+      {
+         HANDLE handles[] = { hStopReadingEvent, slots[nSlot].overlapped.hEvent };
+         DWORD dwWait = WaitForMultipleObjects( sizeof(handles)/sizeof(handles[0]), handles, FALSE, INFINITE );
+         if ( dwWait != WAIT_OBJECT_0 + 1 )
+         {
+            // stop event or an error. exit cycle...
+            break;
+         }
+
+         SCO_SLOT& slot = slots[nSlot];
+         slot.bPending = FALSE;
+
+         DWORD dwLength = 0;
+         if ( GetOverlappedResult( pThis->GetDriverHandle(), &slot.overlapped, &dwLength, FALSE ) )
+         {
+            const BYTE* pData = slot.buffer;
+            while ( dwLength > 0 )
+            {
+               // the header first, then the number of bytes it gives.
+               DWORD dwNeeded = ( dwPacketPos < FBT_HCI_SCO_MIN_SIZE ) ? FBT_HCI_SCO_MIN_SIZE - dwPacketPos : FBT_HCI_SCO_MIN_SIZE + packet[3] - dwPacketPos;
+               DWORD dwCopy = min( dwNeeded, dwLength );
+               memcpy( packet + 1 + dwPacketPos, pData, dwCopy );
+               dwPacketPos += dwCopy;
+               pData += dwCopy;
+               dwLength -= dwCopy;
+
+               if ( dwPacketPos >= FBT_HCI_SCO_MIN_SIZE && dwPacketPos == FBT_HCI_SCO_MIN_SIZE + packet[3] )
+               {
+                  pThis->OnScoData( packet, dwPacketPos + 1 );
+                  dwPacketPos = 0;
+               }
+            }
+         }
+         else
+         {
+            // a frame was lost, the packet can't be completed.
+            fbtLog( fbtLog_Warning, _T("CBthEmulHci::ScoDataReader: SCO read failed, error %d"), GetLastError() );
+            dwPacketPos = 0;
+         }
+
+         dwResult = pThis->PostScoRead( slot );
+         nSlot = ( nSlot + 1 ) % SCO_READ_SLOTS;
+      }
+
+      if ( ERROR_SUCCESS != dwResult )
+      {
+         fbtLog( fbtLog_Warning, _T("CBthEmulHci::ScoDataReader: SCO reads stopped, error %d"), dwResult );
+      }
+
+      // the reads were issued by this thread, so they can be cancelled here.
+      CancelIo( pThis->GetDriverHandle() );
+      for ( int i = 0; i < SCO_READ_SLOTS; ++i )
+      {
+         if ( slots[i].bPending )
+         {
+            DWORD dwLength = 0;
+            GetOverlappedResult( pThis->GetDriverHandle(), &slots[i].overlapped, &dwLength, TRUE );
+         }
+         CloseHandle( slots[i].overlapped.hEvent );
+      }
+
+      return ERROR_SUCCESS;
+
+   FBT_CATCH_RETURN( ERROR_INTERNAL_ERROR )
+}
+
 DWORD CBthEmulHci::Attach( LPCTSTR szDeviceName )
 {
    return m_btHw.Attach( szDeviceName );
@@ -388,6 +780,10 @@ BOOL CBthEmulHci::GetDeviceInfo( DEVICE_INFO* pDevInfo )
       bRet &= TRUE;
    }
 
+   // the ACL packets from the emulator are split to the controller's buffer size in it.
+   free( m_pAclFragment );
+   m_pAclFragment = (BYTE*)malloc( ACL_HEADER_SIZE + GetAclMtu() );
+
    hci.StopEventListener();
 
    if ( bRet )
@@ -398,6 +794,48 @@ BOOL CBthEmulHci::GetDeviceInfo( DEVICE_INFO* pDevInfo )
    return bRet;
 }
 
+DWORD CBthEmulHci::GetAclMtu() const
+{
+   // the controllers that didn't report their buffer size get the default one.
+   return m_devInfo.acl_mtu ? m_devInfo.acl_mtu : FBT_HCI_DATA_MAX_SIZE - ACL_HEADER_SIZE;
+}
+
+void CBthEmulHci::SetRelayMtu( DWORD dwRelayMtu )
+{
+   fbtLog( fbtLog_Notice, _T("CBthEmulHci::SetRelayMtu %d, controller's %d"), dwRelayMtu, GetAclMtu() );
+   m_dwRelayMtu = dwRelayMtu;
+}
+
+DWORD CBthEmulHci::SendAclData( const BYTE* lpBuffer, DWORD dwBufferSize )
+{
+   DWORD dwBytesSent = 0;
+   DWORD dwMtu = GetAclMtu();
+   if ( dwBufferSize <= ACL_HEADER_SIZE + dwMtu || m_pAclFragment == NULL )
+   {
+      return SendData( lpBuffer, dwBufferSize, &dwBytesSent, NULL );
+   }
+
+   // the emulator side sent more than the controller takes at once. the first fragment
+   // keeps the packet boundary flags, the rest are continuing ones.
+   USHORT usHandle = 0;
+   memcpy( &usHandle, lpBuffer, 2 );
+   DWORD dwPos = ACL_HEADER_SIZE;
+   DWORD dwResult = ERROR_SUCCESS;
+   while ( dwPos < dwBufferSize && dwResult == ERROR_SUCCESS )
+   {
+      USHORT usLength = (USHORT)min( dwBufferSize - dwPos, dwMtu );
+      memcpy( m_pAclFragment, &usHandle, 2 );
+      memcpy( m_pAclFragment + 2, &usLength, 2 );
+      memcpy( m_pAclFragment + ACL_HEADER_SIZE, lpBuffer + dwPos, usLength );
+
+      dwResult = SendData( m_pAclFragment, ACL_HEADER_SIZE + usLength, &dwBytesSent, NULL );
+      dwPos += usLength;
+      usHandle = ( usHandle & ~0x3000 ) | ACL_PB_CONTINUING;
+   }
+
+   return dwResult;
+}
+
 DWORD CBthEmulHci::SendData( LPCVOID lpBuffer, DWORD dwBufferSize, DWORD* dwBytesSent, OVERLAPPED* pOverlapped )
 {
    return m_btHw.SendData( lpBuffer, dwBufferSize, dwBytesSent, pOverlapped );
@@ -24,6 +24,28 @@
 #include "fbthci.h"           // CHci
 #include "fbtrt.h"            // HCI_EVENT_LISTENER
 
+// number of the SCO packets queued to the driver at once. the isochronous pipe sends one
+// frame per millisecond, so the queued packets go out evenly paced and the queue length
+// bounds the audio latency.
+#define SCO_WRITE_SLOTS 8
+// number of the SCO reads kept pending. the frames that come while no read is pending are lost.
+#define SCO_READ_SLOTS 4
+// size of one SCO read, large enough for the frames of any alternate setting.
+#define SCO_READ_SIZE 512
+
+// size of the ACL data packet header.
+#define ACL_HEADER_SIZE 4
+// packet boundary flag of the continuing ACL fragments.
+#define ACL_PB_CONTINUING 0x1000
+
+// preallocated SCO transfer.
+struct SCO_SLOT
+{
+   OVERLAPPED overlapped;
+   BOOL bPending;
+   BYTE buffer[SCO_READ_SIZE];
+};
+
 struct DEVICE_INFO : public LOCAL_DEVICE_INFO 
 {
    unsigned short acl_mtu;
@@ -51,15 +73,23 @@ public:
    DWORD SendHCICommand( const BYTE* lpBuffer, DWORD dwBufferSize );
    BOOL SubscribeHCIEvent( HCI_EVENT_LISTENER hciEventListener );
    BOOL GetDeviceInfo( DEVICE_INFO* pDevInfo );
+   DWORD GetAclMtu() const;
+   void SetRelayMtu( DWORD dwRelayMtu );
 
 private:
    static DWORD WINAPI DataReader( LPVOID lpParam );
    static DWORD WINAPI DataEventHandler( LPVOID lpParam );
+   static DWORD WINAPI ScoDataReader( LPVOID lpParam );
    static CRITICAL_SECTION s_criticalSection;
 
 private:
    DWORD SendCommand( DWORD dwCommand, LPCVOID lpInBuffer = NULL, DWORD dwInBufferSize = 0, LPVOID lpOutBuffer = NULL, DWORD dwOutBufferSize = 0, OVERLAPPED* pOverlapped = NULL );
    DWORD	SendData( LPCVOID lpBuffer, DWORD dwBufferSize, DWORD* dwBytesSent, OVERLAPPED* pOverlapped );
+   DWORD SendAclData( const BYTE* lpBuffer, DWORD dwBufferSize );
+   DWORD SendScoData( const BYTE* lpBuffer, DWORD dwBufferSize );
+   void WaitScoWrites();
+   DWORD PostScoRead( SCO_SLOT& slot );
+   DWORD OnScoData( BYTE* lpPacket, DWORD dwLength );
 
 private:
    CBTHW& m_btHw; 
@@ -67,6 +97,16 @@ private:
    HANDLE m_hReaderThread;
    HANDLE m_hStopReadingEvent;
    HANDLE m_hReaderReadyEvent;
+   HANDLE m_hScoReaderThread;
+   CRITICAL_SECTION m_scoWriteSection;
+   SCO_SLOT* m_pScoWriteSlots;   // SCO_WRITE_SLOTS slots.
+   int m_nScoWriteSlot;
+   DWORD m_dwScoDropped;
+   DWORD m_dwRelayMtu;
+   BYTE* m_pAclFragment;
+   DWORD m_dwReadSize;
+   BYTE* m_pReadBuffer;    // the ACL packet being read by the reader.
+   BYTE* m_pAclEvent;      // the ACL packet ( fragment ) given to the listener, guarded by s_criticalSection.
    DEVICE_INFO m_devInfo;
 };
 
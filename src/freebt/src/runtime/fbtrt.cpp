@@ -259,6 +259,53 @@ extern "C" BOOL __stdcall Export_GetManufacturerName( USHORT usManufacturer, LPT
    return bRet;
 }
 
+extern "C" BOOL __stdcall Export_GetAclMtu( int devId, DWORD* pdwAclMtu )
+{
+   EnterCriticalSection( &g_hciCritSection );
+
+   BOOL bRet = FALSE;
+
+   if ( devId >= 0 && devId < MAX_DEVICES && g_bthHci[devId] )
+   {
+      __try
+      {
+         *pdwAclMtu = g_bthHci[devId]->GetAclMtu();
+         bRet = TRUE;
+      }
+      __except( EXCEPTION_EXECUTE_HANDLER )
+      {
+         SetLastError( ERROR_INVALID_PARAMETER );
+      }
+   }
+   else
+   {
+      SetLastError( ERROR_INVALID_PARAMETER );
+   }
+
+   LeaveCriticalSection( &g_hciCritSection );
+   return bRet;
+}
+
+extern "C" BOOL __stdcall Export_SetRelayMtu( int devId, DWORD dwRelayMtu )
+{
+   EnterCriticalSection( &g_hciCritSection );
+
+   BOOL bRet = FALSE;
+
+   if ( devId >= 0 && devId < MAX_DEVICES && g_bthHci[devId] )
+   {
+      g_bthHci[devId]->SetRelayMtu( dwRelayMtu );
+      bRet = TRUE;
+   }
+   else
+   {
+      SetLastError( ERROR_INVALID_PARAMETER );
+   }
+
+   LeaveCriticalSection( &g_hciCritSection );
+   return bRet;
+}
+
 extern "C" BOOL __stdcall Export_SubscribeHCIEvent( int devId, HCI_EVENT_LISTENER hciEventListener )
 {
    EnterCriticalSection( &g_hciCritSection );
@@ -44,6 +44,11 @@ extern "C" {
    BOOL __stdcall GetDeviceInfo( int devId, LOCAL_DEVICE_INFO* /*in*/pDevInfo );   
    BOOL __stdcall GetManufacturerName( USHORT usManufacturer, LPTSTR /*in*/szInBuffer, DWORD dwBufferLength );
 
+   // the controller's ACL MTU and the largest ACL payload the relay carries, the larger
+   // packets from the controller are fragmented to it. 0 means no limit.
+   BOOL __stdcall GetAclMtu( int devId, DWORD* /*out*/pdwAclMtu );
+   BOOL __stdcall SetRelayMtu( int devId, DWORD dwRelayMtu );
+
    typedef DWORD ( __stdcall *HCI_EVENT_LISTENER)( BYTE* /*in*/pEventBuffer, DWORD dwEventLength );
    BOOL __stdcall SubscribeHCIEvent( int devId, HCI_EVENT_LISTENER hciEventListener );
    